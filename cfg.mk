@@ -41,4 +41,4 @@ exclude_file_name_regexp--sc_makefile_at_at_check = ^maint.mk|gl/Makefile.am
 exclude_file_name_regexp--sc_prohibit_undesirable_word_seq = ^maint.mk
 exclude_file_name_regexp--sc_prohibit_atoi_atof = ^src/u2f-host.c
 exclude_file_name_regexp--sc_space_tab = ^gtk-doc/gtk-doc.make
-exclude_file_name_regexp--sc_trailing_blank = ^u2f-host/cdecode.c|u2f-host/cencode.c|u2f-host/inc/u2f.h|u2f-host/inc/u2f_hid.h
+exclude_file_name_regexp--sc_trailing_blank = ^u2f-host/inc/u2f.h|u2f-host/inc/u2f_hid.h
@@ -0,0 +1,190 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "b64/b64url.h"
+
+/* a register response with the longest certificate and signature */
+#define BENCH_SIZE (1 + 65 + 1 + 128 + 1024 + 72)
+
+#define DEFAULT_ITERATIONS 20000
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The test vectors of RFC 4648, in the URL alphabet and unpadded,
+   and every length up to a few groups round trips. */
+static int
+test_vectors (void)
+{
+  static const struct
+  {
+    const char *in;
+    const char *out;
+  } tests[] =
+  {
+    {"", ""},
+    {"f", "Zg"},
+    {"fo", "Zm8"},
+    {"foo", "Zm9v"},
+    {"foob", "Zm9vYg"},
+    {"fooba", "Zm9vYmE"},
+    {"foobar", "Zm9vYmFy"},
+    {"\xfb\xff", "-_8"},
+  };
+  unsigned char data[300], out[300];
+  char enc[512];
+  size_t i, len, n;
+
+  for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++)
+    {
+      len = strlen (tests[i].in);
+      n = b64url_encode ((const unsigned char *) tests[i].in, len, enc);
+      if (n != strlen (tests[i].out) || strcmp (enc, tests[i].out) != 0)
+	{
+	  printf ("encoding \"%s\" gave \"%s\"\n", tests[i].in, enc);
+	  return -1;
+	}
+    }
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = rand ();
+
+  for (len = 0; len <= sizeof (data); len++)
+    {
+      n = b64url_encode (data, len, enc);
+      if (n != B64URL_ENCODED_LEN (len) || strlen (enc) != n)
+	{
+	  printf ("encoding %lu bytes gave %lu characters\n",
+		  (unsigned long) len, (unsigned long) n);
+	  return -1;
+	}
+      if (b64url_decode (enc, n, out, len) != (int) len
+	  || memcmp (out, data, len) != 0)
+	{
+	  printf ("decoding %lu bytes failed\n", (unsigned long) len);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+static int
+test_strict (void)
+{
+  static const struct
+  {
+    const char *in;
+    int len;
+  } tests[] =
+  {
+    {"", 0},
+    {"AA", 1},
+    {"AAA", 2},
+    {"AAAA", 3},
+    {"AA==", 1},
+    {"AAA=", 2},
+    {"-_-_", 3},
+    {"A", -1},
+    {"AAAAA", -1},
+    {"AB", -1},
+    {"AAB", -1},
+    {"AA+A", -1},
+    {"AA/A", -1},
+    {"AA A", -1},
+    {"A===", -1},
+    {"====", -1},
+    {"AA=A", -1},
+    {"AA\x80" "A", -1},
+  };
+  unsigned char out[8];
+  size_t i;
+
+  for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++)
+    if (b64url_decode (tests[i].in, strlen (tests[i].in), out, sizeof (out))
+	!= tests[i].len)
+      {
+	printf ("decoding \"%s\" did not give %d\n", tests[i].in,
+		tests[i].len);
+	return -1;
+      }
+
+  /* output that does not fit is an error */
+  if (b64url_decode ("AAAA", 4, out, 2) != -1)
+    {
+      printf ("decoding overran the output\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+main (void)
+{
+  unsigned char data[BENCH_SIZE], out[BENCH_SIZE];
+  char enc[B64URL_ENCODED_LEN (BENCH_SIZE) + 1];
+  int iterations = DEFAULT_ITERATIONS;
+  double start, t[2];
+  size_t len;
+  int i;
+
+  if (getenv ("U2FH_BENCH_ITERATIONS"))
+    iterations = atoi (getenv ("U2FH_BENCH_ITERATIONS"));
+
+  if (test_vectors () != 0 || test_strict () != 0)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < BENCH_SIZE; i++)
+    data[i] = rand ();
+  len = b64url_encode (data, BENCH_SIZE, enc);
+
+  start = now ();
+  for (i = 0; i < iterations; i++)
+    b64url_encode (data, BENCH_SIZE, enc);
+  t[0] = now () - start;
+
+  start = now ();
+  for (i = 0; i < iterations; i++)
+    if (b64url_decode (enc, len, out, sizeof (out)) != BENCH_SIZE)
+      return EXIT_FAILURE;
+  t[1] = now () - start;
+
+  if (iterations > 0)
+    {
+      printf ("encode %d bytes: %.2f us\n", BENCH_SIZE,
+	      t[0] * 1e6 / iterations);
+      printf ("decode %d bytes: %.2f us\n", BENCH_SIZE,
+	      t[1] * 1e6 / iterations);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1175 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <u2f-host.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "b64/b64url.h"
+
+#define APPID "https://demo.yubico.com"
+#define CHALLENGE "5kRJ5D4F_qz8tIDK5QWZAyjthaVSjD6kE8Z-a8kJ3Bo"
+
+#define REGISTER_REQUEST \
+  "{\"challenge\": \"" CHALLENGE "\", \"version\": \"U2F_V2\", " \
+  "\"appId\": \"" APPID "\"}"
+
+#define DEFAULT_ITERATIONS 200
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Create a device set of @n software tokens, the i-th touched
+   @delays[i] milliseconds after it is first asked, and discover them.
+   Returns NULL, saying so for @test, if that fails. */
+static u2fh_devs *
+setup (const char *test, const unsigned *delays, size_t n)
+{
+  u2fh_devs *devs;
+  unsigned max_index;
+  size_t i;
+
+  if (u2fh_devs_init (&devs) != U2FH_OK)
+    {
+      printf ("%s setup failed\n", test);
+      return NULL;
+    }
+  for (i = 0; i < n; i++)
+    if (u2fh_devs_add_softtoken (devs, delays[i]) != U2FH_OK)
+      break;
+  if (i < n || u2fh_devs_discover (devs, &max_index) != U2FH_OK
+      || max_index != n - 1)
+    {
+      printf ("%s setup failed\n", test);
+      u2fh_devs_done (devs);
+      return NULL;
+    }
+
+  return devs;
+}
+
+/* Copy the string value of @key in the flat JSON object @json. */
+static int
+get_field (const char *json, const char *key, char *out, size_t outlen)
+{
+  char pattern[64];
+  const char *p, *end;
+
+  snprintf (pattern, sizeof (pattern), "\"%s\": \"", key);
+  p = strstr (json, pattern);
+  if (p == NULL)
+    return -1;
+  p += strlen (pattern);
+  end = strchr (p, '"');
+  if (end == NULL || (size_t) (end - p) >= outlen)
+    return -1;
+  memcpy (out, p, end - p);
+  out[end - p] = '\0';
+
+  return 0;
+}
+
+static int
+do_register (u2fh_devs * devs, char *keyhandle, size_t khlen)
+{
+  char response[4096];
+  size_t response_len = sizeof (response);
+  char regdata[2048];
+  unsigned char raw[2048];
+  int rawlen;
+  int rc;
+
+  rc = u2fh_register2 (devs, REGISTER_REQUEST, APPID, response,
+		       &response_len, U2FH_REQUEST_USER_PRESENCE);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_register2 %d\n", rc);
+      return -1;
+    }
+
+  if (get_field (response, "registrationData", regdata, sizeof (regdata))
+      != 0 || strstr (response, "\"clientData\"") == NULL)
+    {
+      printf ("bad register response %s\n", response);
+      return -1;
+    }
+
+  rawlen = b64url_decode (regdata, strlen (regdata), raw, sizeof (raw));
+  if (rawlen < 67 || raw[0] != 0x05 || raw[1] != 0x04
+      || rawlen < 67 + raw[66])
+    {
+      printf ("bad registrationData (%d bytes)\n", rawlen);
+      return -1;
+    }
+
+  /* re-encode the key handle for the authenticate request */
+  if (B64URL_ENCODED_LEN ((size_t) raw[66]) >= khlen)
+    return -1;
+  b64url_encode (raw + 67, raw[66], keyhandle);
+
+  return 0;
+}
+
+static int
+do_authenticate (u2fh_devs * devs, const char *keyhandle,
+		 u2fh_cmdflags flags)
+{
+  char request[1024];
+  char response[4096];
+  size_t response_len = sizeof (response);
+  char sigdata[1024];
+  int rc;
+
+  snprintf (request, sizeof (request),
+	    "{\"challenge\": \"%s\", \"version\": \"U2F_V2\", "
+	    "\"appId\": \"%s\", \"keyHandle\": \"%s\"}",
+	    CHALLENGE, APPID, keyhandle);
+
+  response[0] = '\0';
+  rc = u2fh_authenticate2 (devs, request, APPID, response, &response_len,
+			   flags);
+  if (rc != U2FH_OK)
+    return rc;
+
+  if (flags & U2FH_REQUEST_USER_PRESENCE)
+    {
+      if (get_field (response, "signatureData", sigdata, sizeof (sigdata))
+	  != 0 || get_field (response, "keyHandle", sigdata,
+			     sizeof (sigdata)) != 0
+	  || strcmp (sigdata, keyhandle) != 0)
+	{
+	  printf ("bad authenticate response %s\n", response);
+	  return U2FH_JSON_ERROR;
+	}
+    }
+
+  return U2FH_OK;
+}
+
+/* Two tokens touched at very different times: the quicker one must
+   win without the operation waiting on the slower one. */
+static int
+test_fanout (void)
+{
+  static const unsigned delays[] = { 30000, 50 };
+  u2fh_devs *devs;
+  char keyhandle[256];
+  double start, elapsed;
+  int rc;
+
+  devs = setup ("fanout", delays, 2);
+  if (devs == NULL)
+    return -1;
+
+  start = now ();
+  if (do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    return -1;
+  elapsed = now () - start;
+  /* far below the slow token's delay, however loaded the machine */
+  if (elapsed > 10)
+    {
+      printf ("fanout register took %.3f s\n", elapsed);
+      return -1;
+    }
+
+  /* only the token that registered knows the key handle */
+  rc = do_authenticate (devs, keyhandle, U2FH_REQUEST_USER_PRESENCE);
+  if (rc != U2FH_OK)
+    {
+      printf ("fanout authenticate %d\n", rc);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static void
+record_status (u2fh_status status, void *arg)
+{
+  *(int *) arg |= 1 << status;
+}
+
+/* A token touched too late runs into the caller's timeout, after
+   reporting that it waits for a touch. */
+static int
+test_timeout (void)
+{
+  static const unsigned delay = 30000;
+  u2fh_devs *devs;
+  u2fh_cmdopts opts;
+  char response[4096];
+  size_t response_len = sizeof (response);
+  int seen = 0;
+  int rc;
+
+  devs = setup ("timeout", &delay, 1);
+  if (devs == NULL)
+    return -1;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.timeout = 200;
+  opts.status_cb = record_status;
+  opts.status_arg = &seen;
+  rc = u2fh_register3 (devs, REGISTER_REQUEST, APPID, response,
+		       &response_len, U2FH_REQUEST_USER_PRESENCE, &opts);
+  /* the token would only have answered after 30 s */
+  if (rc != U2FH_TIMEOUT_ERROR || opts.elapsed > 10000)
+    {
+      printf ("u2fh_register3 %d after %u ms\n", rc, opts.elapsed);
+      return -1;
+    }
+  if (!(seen & (1 << U2FH_STATUS_UPNEEDED)))
+    {
+      printf ("no touch request reported\n");
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static void *
+cancel_later (void *arg)
+{
+  usleep (100 * 1000);
+  u2fh_cancel (arg, NULL);
+  return NULL;
+}
+
+/* A blocking register is cancelled from another thread, and a
+   non-blocking one directly. */
+static int
+test_cancel (void)
+{
+  static const unsigned delay = 30000;
+  u2fh_devs *devs;
+  u2fh_op *op;
+  pthread_t thread;
+  char response[4096];
+  size_t response_len = sizeof (response);
+  double start, elapsed;
+  int rc;
+
+  devs = setup ("cancel", &delay, 1);
+  if (devs == NULL)
+    return -1;
+
+  start = now ();
+  pthread_create (&thread, NULL, cancel_later, devs);
+  rc = u2fh_register2 (devs, REGISTER_REQUEST, APPID, response,
+		       &response_len, U2FH_REQUEST_USER_PRESENCE);
+  elapsed = now () - start;
+  pthread_join (thread, NULL);
+  /* the token would only have answered after 30 s */
+  if (rc != U2FH_CANCELLED || elapsed > 10)
+    {
+      printf ("cancelled register %d after %.3f s\n", rc, elapsed);
+      return -1;
+    }
+
+  rc = u2fh_register_start (devs, REGISTER_REQUEST, APPID,
+			    U2FH_REQUEST_USER_PRESENCE, NULL, &op);
+  if (rc != U2FH_OK
+      || u2fh_step (op, response, &response_len) != U2FH_AGAIN
+      || u2fh_cancel (devs, op) != U2FH_OK
+      || (rc = u2fh_step (op, response, &response_len)) != U2FH_CANCELLED)
+    {
+      printf ("cancelled u2fh_step %d\n", rc);
+      return -1;
+    }
+  u2fh_op_done (op);
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+struct pinger
+{
+  u2fh_devs *devs;
+  unsigned char fill;
+  int failed;
+};
+
+static void *
+ping_loop (void *arg)
+{
+  struct pinger *p = arg;
+  int i;
+
+  for (i = 0; i < 20; i++)
+    {
+      unsigned char ping[300], pong[1024];
+      size_t ponglen = sizeof (pong);
+      int rc;
+
+      memset (ping, p->fill, sizeof (ping));
+      ping[0] = i;
+      rc = u2fh_sendrecv (p->devs, 0, 0x81, ping, sizeof (ping), pong,
+			  &ponglen);
+      if (rc != U2FH_OK || ponglen != sizeof (ping)
+	  || memcmp (ping, pong, sizeof (ping)) != 0)
+	{
+	  printf ("concurrent ping %d len %zu\n", rc, ponglen);
+	  p->failed = 1;
+	  break;
+	}
+    }
+
+  return NULL;
+}
+
+/* Several threads ping one token on channels of their own while a
+   register waits for a touch on yet another channel. */
+static int
+test_channels (void)
+{
+  static const unsigned delay = 200;
+  u2fh_devs *devs;
+  struct pinger pingers[4];
+  pthread_t threads[4];
+  char keyhandle[256];
+  int failed = 0;
+  int i;
+
+  devs = setup ("channels", &delay, 1);
+  if (devs == NULL)
+    return -1;
+
+  for (i = 0; i < 4; i++)
+    {
+      pingers[i].devs = devs;
+      pingers[i].fill = 0x10 * (i + 1);
+      pingers[i].failed = 0;
+      pthread_create (&threads[i], NULL, ping_loop, &pingers[i]);
+    }
+  if (do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    failed = 1;
+  for (i = 0; i < 4; i++)
+    {
+      pthread_join (threads[i], NULL);
+      failed |= pingers[i].failed;
+    }
+  if (failed)
+    return -1;
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static void *
+discover_loop (void *arg)
+{
+  int i;
+
+  for (i = 0; i < 100; i++)
+    if (u2fh_devs_discover (arg, NULL) != U2FH_OK)
+      return arg;
+
+  return NULL;
+}
+
+static void *
+register_loop (void *arg)
+{
+  char keyhandle[256];
+  int i;
+
+  for (i = 0; i < 50; i++)
+    if (do_register (arg, keyhandle, sizeof (keyhandle)) != 0
+	|| do_authenticate (arg, keyhandle, U2FH_REQUEST_USER_PRESENCE)
+	!= U2FH_OK)
+      return arg;
+
+  return NULL;
+}
+
+/* Two threads run operations on one device set while a third keeps
+   rediscovering its devices. */
+static int
+test_threads (void)
+{
+  static const unsigned delays[] = { 0, 0 };
+  u2fh_devs *devs;
+  pthread_t discoverer, workers[2];
+  void *res, *failed = NULL;
+  int i;
+
+  devs = setup ("threads", delays, 2);
+  if (devs == NULL)
+    return -1;
+
+  pthread_create (&discoverer, NULL, discover_loop, devs);
+  for (i = 0; i < 2; i++)
+    pthread_create (&workers[i], NULL, register_loop, devs);
+  for (i = 0; i < 2; i++)
+    {
+      pthread_join (workers[i], &res);
+      if (res != NULL)
+	failed = res;
+    }
+  pthread_join (discoverer, &res);
+  if (failed != NULL || res != NULL)
+    {
+      printf ("threaded operations failed\n");
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static void
+count_log (const char *msg, void *arg)
+{
+  (void) msg;
+  ++*(int *) arg;
+}
+
+static int
+test_ctx (void)
+{
+  u2fh_ctx *ctx;
+  u2fh_devs *devs;
+  u2fh_cmdopts opts;
+  char response[4096];
+  size_t response_len = sizeof (response);
+  unsigned max_index;
+  int logged = 0;
+  int rc;
+
+  if (u2fh_ctx_init (&ctx, U2FH_DEBUG | U2FH_NO_HID) != U2FH_OK)
+    {
+      printf ("u2fh_ctx_init failed\n");
+      return -1;
+    }
+  u2fh_ctx_set_log (ctx, count_log, &logged);
+  u2fh_ctx_set_timeout (ctx, 200);
+
+  if (u2fh_devs_init2 (&devs, ctx) != U2FH_OK
+      || u2fh_devs_add_softtoken (devs, 30000) != U2FH_OK
+      || u2fh_devs_discover (devs, &max_index) != U2FH_OK)
+    {
+      printf ("context setup failed\n");
+      return -1;
+    }
+
+  /* the context supplies the timeout when the options leave it 0 */
+  memset (&opts, 0, sizeof (opts));
+  rc = u2fh_register3 (devs, REGISTER_REQUEST, APPID, response,
+		       &response_len, U2FH_REQUEST_USER_PRESENCE, &opts);
+  if (rc != U2FH_TIMEOUT_ERROR || opts.elapsed > 10000)
+    {
+      printf ("context timeout %d after %u ms\n", rc, opts.elapsed);
+      return -1;
+    }
+  if (logged == 0)
+    {
+      printf ("nothing logged through the context\n");
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+  u2fh_ctx_done (ctx);
+
+  return 0;
+}
+
+static int
+test_monitor (void)
+{
+  u2fh_devs *devs;
+  unsigned max_index = 42;
+  int fd;
+  int rc;
+
+  if (u2fh_devs_init (&devs) != U2FH_OK
+      || u2fh_devs_add_softtoken (devs, 0) != U2FH_OK)
+    {
+      printf ("monitor setup failed\n");
+      return -1;
+    }
+
+  rc = u2fh_devs_monitor (devs, &fd);
+  if (rc == U2FH_TRANSPORT_ERROR)
+    {
+      /* no netlink here */
+      u2fh_devs_done (devs);
+      return 0;
+    }
+  if (rc != U2FH_OK || fd < 0)
+    {
+      printf ("u2fh_devs_monitor %d fd %d\n", rc, fd);
+      return -1;
+    }
+
+  /* without events nothing is touched and the token stays */
+  if (u2fh_devs_discover (devs, &max_index) != U2FH_OK
+      || (rc = u2fh_devs_update (devs, &max_index)) != U2FH_OK
+      || max_index != 0 || !u2fh_is_alive (devs, 0))
+    {
+      printf ("u2fh_devs_update %d max_index %u\n", rc, max_index);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static int
+test_many (void)
+{
+  u2fh_devs *devs;
+  unsigned max_index;
+  char desc[256];
+  size_t desclen = sizeof (desc);
+  int i;
+
+  if (u2fh_devs_init (&devs) != U2FH_OK)
+    return -1;
+  for (i = 0; i < 100; i++)
+    if (u2fh_devs_add_softtoken (devs, 0) != U2FH_OK)
+      {
+	printf ("u2fh_devs_add_softtoken %d failed\n", i);
+	return -1;
+      }
+
+  /* rediscovery keeps the devices and their indexes */
+  for (i = 0; i < 2; i++)
+    if (u2fh_devs_discover (devs, &max_index) != U2FH_OK || max_index != 99)
+      {
+	printf ("discover of many tokens, max_index %u\n", max_index);
+	return -1;
+      }
+
+  if (!u2fh_is_alive (devs, 0) || !u2fh_is_alive (devs, 99)
+      || u2fh_is_alive (devs, 100)
+      || u2fh_get_device_description (devs, 57, desc, &desclen) != U2FH_OK)
+    {
+      printf ("lookup among many tokens failed\n");
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static int
+test_filter (void)
+{
+  u2fh_devs *devs;
+  u2fh_devfilter filter;
+  const u2fh_usbid *known;
+  size_t nknown;
+  unsigned max_index;
+  int i, n;
+
+  known = u2fh_known_devices (&nknown);
+  if (nknown == 0 || known[0].vendor_id != 0x1050)
+    {
+      printf ("u2fh_known_devices %u\n", (unsigned) nknown);
+      return -1;
+    }
+
+  if (u2fh_devs_init (&devs) != U2FH_OK)
+    return -1;
+  for (i = 0; i < 12; i++)
+    if (u2fh_devs_add_softtoken (devs, 0) != U2FH_OK)
+      return -1;
+
+  /* software tokens have no USB ids, only the path counts */
+  memset (&filter, 0, sizeof (filter));
+  filter.ids = known;
+  filter.nids = nknown;
+  filter.path_glob = "softtoken:?";
+  if (u2fh_devs_set_filter (devs, &filter) != U2FH_OK
+      || u2fh_devs_discover (devs, &max_index) != U2FH_OK)
+    {
+      printf ("filtered discover failed\n");
+      return -1;
+    }
+  for (i = 0, n = 0; i <= (int) max_index; i++)
+    n += u2fh_is_alive (devs, i);
+  if (n != 10)
+    {
+      printf ("path filter kept %d devices\n", n);
+      return -1;
+    }
+
+  /* devices beyond the limit are released and not opened */
+  filter.ids = NULL;
+  filter.path_glob = NULL;
+  filter.max_devices = 3;
+  if (u2fh_devs_set_filter (devs, &filter) != U2FH_OK
+      || u2fh_devs_discover (devs, &max_index) != U2FH_OK)
+    return -1;
+  for (i = 0, n = 0; i <= (int) max_index; i++)
+    n += u2fh_is_alive (devs, i);
+  if (n != 3)
+    {
+      printf ("max_devices kept %d devices\n", n);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+static void
+count_opened (const char *msg, void *arg)
+{
+  if (strstr (msg, "opened channel") != NULL)
+    ++*(int *) arg;
+}
+
+static int
+test_lazy (void)
+{
+  u2fh_ctx *ctx;
+  u2fh_devs *devs;
+  unsigned char data[1] = { 0 };
+  unsigned char resp[1024];
+  size_t resplen = sizeof (resp);
+  unsigned max_index;
+  char keyhandle[256];
+  int opened = 0;
+  int timeout;
+
+  if (u2fh_ctx_init (&ctx, U2FH_DEBUG | U2FH_NO_HID | U2FH_LAZY_OPEN)
+      != U2FH_OK)
+    return -1;
+  u2fh_ctx_set_log (ctx, count_opened, &opened);
+  u2fh_ctx_set_idle_timeout (ctx, 50);
+  if (u2fh_devs_init2 (&devs, ctx) != U2FH_OK
+      || u2fh_devs_add_softtoken (devs, 0) != U2FH_OK
+      || u2fh_devs_add_softtoken (devs, 0) != U2FH_OK
+      || u2fh_devs_discover (devs, &max_index) != U2FH_OK
+      || max_index != 1)
+    {
+      printf ("lazy discover failed\n");
+      return -1;
+    }
+
+  /* nothing is open before the first use */
+  u2fh_devs_close_idle (devs, &timeout);
+  if (timeout != -1)
+    {
+      printf ("lazy discover opened a device\n");
+      return -1;
+    }
+
+  if (u2fh_sendrecv (devs, 1, 0x81, data, sizeof (data), resp, &resplen)
+      != U2FH_OK)
+    {
+      printf ("lazy ping failed\n");
+      return -1;
+    }
+  u2fh_devs_close_idle (devs, &timeout);
+  if (timeout <= 0 || timeout > 50)
+    {
+      printf ("device not open after use, timeout %d\n", timeout);
+      return -1;
+    }
+
+  /* idle devices are closed and opened again on demand */
+  usleep (60 * 1000);
+  u2fh_devs_close_idle (devs, &timeout);
+  if (timeout != -1)
+    {
+      printf ("idle device kept open\n");
+      return -1;
+    }
+  if (do_register (devs, keyhandle, sizeof (keyhandle)) != 0
+      || do_authenticate (devs, keyhandle,
+			  U2FH_REQUEST_USER_PRESENCE) != U2FH_OK)
+    {
+      printf ("reopened devices failed\n");
+      return -1;
+    }
+
+  /* an authenticate routed by its key handle opens only that token */
+  usleep (60 * 1000);
+  u2fh_devs_close_idle (devs, &timeout);
+  opened = 0;
+  if (timeout != -1
+      || do_authenticate (devs, keyhandle,
+			  U2FH_REQUEST_USER_PRESENCE) != U2FH_OK)
+    {
+      printf ("routed authenticate failed\n");
+      return -1;
+    }
+  u2fh_devs_close_idle (devs, &timeout);
+  if (opened != 1 || timeout <= 0)
+    {
+      printf ("routed authenticate opened %d channels\n", opened);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+  u2fh_ctx_done (ctx);
+
+  return 0;
+}
+
+static void
+count_routed (const char *msg, void *arg)
+{
+  if (strstr (msg, "key handle routed") != NULL)
+    ++*(int *) arg;
+}
+
+/* Authentications go straight to the token owning the key handle. */
+static int
+test_route (void)
+{
+  u2fh_ctx *ctx;
+  u2fh_devs *devs;
+  unsigned max_index;
+  char keyhandle[256];
+  int routed = 0;
+  int i;
+
+  if (u2fh_ctx_init (&ctx, U2FH_DEBUG | U2FH_NO_HID) != U2FH_OK)
+    return -1;
+  u2fh_ctx_set_log (ctx, count_routed, &routed);
+  if (u2fh_devs_init2 (&devs, ctx) != U2FH_OK)
+    return -1;
+  for (i = 0; i < 4; i++)
+    if (u2fh_devs_add_softtoken (devs, 0) != U2FH_OK)
+      return -1;
+  if (u2fh_devs_discover (devs, &max_index) != U2FH_OK
+      || do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    {
+      printf ("route setup failed\n");
+      return -1;
+    }
+
+  if (do_authenticate (devs, keyhandle, U2FH_REQUEST_USER_PRESENCE)
+      != U2FH_OK || do_authenticate (devs, keyhandle, 0) != U2FH_OK
+      || routed != 2)
+    {
+      printf ("key handle routed %d times\n", routed);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+  u2fh_ctx_done (ctx);
+
+  return 0;
+}
+
+static int
+test_raw (void)
+{
+  static const unsigned delay = 0;
+  u2fh_devs *devs;
+  unsigned char challenge[32], appparam[32];
+  unsigned char resp[2048];
+  size_t resp_len = 10;
+  size_t khlen;
+  int rc;
+
+  memset (challenge, 0x11, sizeof (challenge));
+  memset (appparam, 0x22, sizeof (appparam));
+  devs = setup ("raw", &delay, 1);
+  if (devs == NULL)
+    return -1;
+
+  /* the size needed is reported */
+  rc = u2fh_register_raw (devs, challenge, appparam, resp, &resp_len,
+			  U2FH_REQUEST_USER_PRESENCE, NULL);
+  if (rc != U2FH_SIZE_ERROR || resp_len <= 10)
+    {
+      printf ("raw register to a small buffer %d\n", rc);
+      return -1;
+    }
+  rc = u2fh_register_raw (devs, challenge, appparam, resp, &resp_len,
+			  U2FH_REQUEST_USER_PRESENCE, NULL);
+  if (rc != U2FH_OK || resp_len < 70 || resp[0] != 0x05
+      || memcmp (resp + resp_len - 2, "\x90\x00", 2) != 0)
+    {
+      printf ("raw register %d\n", rc);
+      return -1;
+    }
+
+  khlen = resp[66];
+  memmove (resp, resp + 67, khlen);
+  rc = u2fh_authenticate_raw (devs, challenge, appparam, resp, khlen,
+			      resp + khlen, &resp_len,
+			      U2FH_REQUEST_USER_PRESENCE, NULL);
+  if (rc != U2FH_OK || resp_len < 7
+      || memcmp (resp + khlen + resp_len - 2, "\x90\x00", 2) != 0)
+    {
+      printf ("raw authenticate %d\n", rc);
+      return -1;
+    }
+
+  /* a check-only request tells the key handle is known */
+  resp_len = sizeof (resp) - khlen;
+  rc = u2fh_authenticate_raw (devs, challenge, appparam, resp, khlen,
+			      resp + khlen, &resp_len, 0, NULL);
+  if (rc != U2FH_OK || resp_len != 2
+      || memcmp (resp + khlen, "\x69\x85", 2) != 0)
+    {
+      printf ("raw check-only authenticate %d\n", rc);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+/* Parse each request once and run it twice. */
+static int
+test_request (void)
+{
+  static const unsigned delay = 0;
+  u2fh_devs *devs;
+  u2fh_request *req;
+  char keyhandle[256];
+  char request[1024];
+  char response[4096];
+  size_t response_len;
+  int i, rc;
+
+  devs = setup ("request", &delay, 1);
+  if (devs == NULL || do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    return -1;
+
+  if (u2fh_request_init (&req, "{\"challenge\": ") != U2FH_JSON_ERROR
+      || u2fh_request_init (&req, "{\"challenge\": \"" CHALLENGE "\"}")
+      != U2FH_JSON_ERROR)
+    {
+      printf ("bad request accepted\n");
+      return -1;
+    }
+
+  if (u2fh_request_init (&req, REGISTER_REQUEST) != U2FH_OK)
+    return -1;
+  for (i = 0; i < 2; i++)
+    {
+      response_len = sizeof (response);
+      rc = u2fh_register_request (devs, req, APPID, response, &response_len,
+				  U2FH_REQUEST_USER_PRESENCE, NULL);
+      if (rc != U2FH_OK || strstr (response, "\"registrationData\"") == NULL)
+	{
+	  printf ("register request %d\n", rc);
+	  return -1;
+	}
+    }
+  /* a register request carries no key handle */
+  response_len = sizeof (response);
+  rc = u2fh_authenticate_request (devs, req, APPID, response, &response_len,
+				  U2FH_REQUEST_USER_PRESENCE, NULL);
+  u2fh_request_done (req);
+  if (rc != U2FH_JSON_ERROR)
+    {
+      printf ("authenticate without key handle %d\n", rc);
+      return -1;
+    }
+
+  snprintf (request, sizeof (request),
+	    "{\"challenge\": \"%s\", \"version\": \"U2F_V2\", "
+	    "\"appId\": \"%s\", \"keyHandle\": \"%s\"}",
+	    CHALLENGE, APPID, keyhandle);
+  if (u2fh_request_init (&req, request) != U2FH_OK)
+    return -1;
+  for (i = 0; i < 2; i++)
+    {
+      response_len = sizeof (response);
+      rc = u2fh_authenticate_request (devs, req, APPID, response,
+				      &response_len,
+				      U2FH_REQUEST_USER_PRESENCE, NULL);
+      if (rc != U2FH_OK || strstr (response, keyhandle) == NULL)
+	{
+	  printf ("authenticate request %d\n", rc);
+	  return -1;
+	}
+    }
+  u2fh_request_done (req);
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+/* A buffer of the size queried up front holds the response. */
+static int
+test_size (void)
+{
+  static const unsigned delay = 0;
+  u2fh_devs *devs;
+  char keyhandle[256];
+  char request[1024];
+  char *response;
+  size_t size, response_len;
+  int rc;
+
+  devs = setup ("size", &delay, 1);
+  if (devs == NULL || do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    return -1;
+
+  if (u2fh_register_size (REGISTER_REQUEST, APPID, &size) != U2FH_OK
+      || (response = malloc (size)) == NULL)
+    return -1;
+  response_len = size;
+  rc = u2fh_register2 (devs, REGISTER_REQUEST, APPID, response,
+		       &response_len, U2FH_REQUEST_USER_PRESENCE);
+  free (response);
+  if (rc != U2FH_OK || response_len >= size)
+    {
+      printf ("register into %lu bytes %d\n", (unsigned long) size, rc);
+      return -1;
+    }
+
+  snprintf (request, sizeof (request),
+	    "{\"challenge\": \"%s\", \"version\": \"U2F_V2\", "
+	    "\"appId\": \"%s\", \"keyHandle\": \"%s\"}",
+	    CHALLENGE, APPID, keyhandle);
+  if (u2fh_authenticate_size (REGISTER_REQUEST, APPID, &size)
+      != U2FH_JSON_ERROR
+      || u2fh_authenticate_size (request, APPID, &size) != U2FH_OK
+      || (response = malloc (size)) == NULL)
+    return -1;
+  response_len = size;
+  rc = u2fh_authenticate2 (devs, request, APPID, response, &response_len,
+			   U2FH_REQUEST_USER_PRESENCE);
+  free (response);
+  if (rc != U2FH_OK || response_len >= size)
+    {
+      printf ("authenticate into %lu bytes %d\n", (unsigned long) size, rc);
+      return -1;
+    }
+
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+/* Drive a register through the non-blocking API. */
+static int
+test_async (void)
+{
+  static const unsigned delay = 100;
+  u2fh_devs *devs;
+  u2fh_op *op;
+  char response[4096];
+  size_t response_len = sizeof (response);
+  int steps = 0;
+  int rc;
+
+  devs = setup ("async", &delay, 1);
+  if (devs == NULL)
+    return -1;
+
+  rc = u2fh_register_start (devs, REGISTER_REQUEST, APPID,
+			    U2FH_REQUEST_USER_PRESENCE, NULL, &op);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_register_start %d\n", rc);
+      return -1;
+    }
+
+  while ((rc = u2fh_step (op, response, &response_len)) == U2FH_AGAIN)
+    {
+      struct pollfd pfd[4];
+      int fds[4];
+      size_t nfds = 4, i;
+      int timeout;
+
+      steps++;
+      rc = u2fh_op_fds (op, fds, &nfds, &timeout);
+      if (rc != U2FH_OK)
+	{
+	  printf ("u2fh_op_fds %d\n", rc);
+	  return -1;
+	}
+      for (i = 0; i < nfds; i++)
+	{
+	  pfd[i].fd = fds[i];
+	  pfd[i].events = POLLIN;
+	}
+      poll (pfd, nfds, timeout);
+    }
+  if (rc != U2FH_OK || steps < 2 || strstr (response, "registrationData")
+      == NULL)
+    {
+      printf ("async register %d after %d steps\n", rc, steps);
+      return -1;
+    }
+
+  u2fh_op_done (op);
+  u2fh_devs_done (devs);
+
+  return 0;
+}
+
+int
+main (void)
+{
+  u2fh_devs *devs;
+  char keyhandle[256];
+  char desc[256];
+  size_t desclen = sizeof (desc);
+  unsigned max_index = 42;
+  int iterations = DEFAULT_ITERATIONS;
+  double start, reg_time = 0, auth_time = 0;
+  int rc;
+  int i;
+
+  if (getenv ("U2FH_BENCH_ITERATIONS"))
+    iterations = atoi (getenv ("U2FH_BENCH_ITERATIONS"));
+
+  rc = u2fh_global_init (0);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_global_init rc %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  rc = u2fh_devs_init (&devs);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_devs_init %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  rc = u2fh_devs_add_softtoken (devs, 0);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_devs_add_softtoken %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  rc = u2fh_devs_discover (devs, &max_index);
+  if (rc != U2FH_OK || max_index != 0)
+    {
+      printf ("u2fh_devs_discover %d max_index %u\n", rc, max_index);
+      return EXIT_FAILURE;
+    }
+
+  rc = u2fh_get_device_description (devs, 0, desc, &desclen);
+  if (rc != U2FH_OK || strstr (desc, "Software") == NULL)
+    {
+      printf ("u2fh_get_device_description %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  {
+    unsigned char ping[300], pong[1024];
+    size_t ponglen = sizeof (pong);
+
+    memset (ping, 0xa5, sizeof (ping));
+    rc = u2fh_sendrecv (devs, 0, 0x81, ping, sizeof (ping), pong, &ponglen);
+    if (rc != U2FH_OK || ponglen != sizeof (ping)
+	|| memcmp (ping, pong, sizeof (ping)) != 0)
+      {
+	printf ("ping %d len %zu\n", rc, ponglen);
+	return EXIT_FAILURE;
+      }
+  }
+
+  if (do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+    return EXIT_FAILURE;
+
+  rc = do_authenticate (devs, keyhandle, U2FH_REQUEST_USER_PRESENCE);
+  if (rc != U2FH_OK)
+    {
+      printf ("authenticate %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  /* check-only: a known key handle yields 0x6985 */
+  rc = do_authenticate (devs, keyhandle, 0);
+  if (rc != U2FH_OK)
+    {
+      printf ("check-only authenticate %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  /* a key handle the token did not issue is refused */
+  keyhandle[4] = keyhandle[4] == 'A' ? 'B' : 'A';
+  rc = do_authenticate (devs, keyhandle, U2FH_REQUEST_USER_PRESENCE);
+  if (rc != U2FH_AUTHENTICATOR_ERROR)
+    {
+      printf ("foreign key handle %d\n", rc);
+      return EXIT_FAILURE;
+    }
+
+  if (test_fanout () != 0 || test_timeout () != 0 || test_async () != 0
+      || test_cancel () != 0 || test_channels () != 0
+      || test_threads () != 0 || test_ctx () != 0
+      || test_monitor () != 0 || test_many () != 0
+      || test_filter () != 0 || test_lazy () != 0
+      || test_route () != 0 || test_raw () != 0
+      || test_request () != 0 || test_size () != 0)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < iterations; i++)
+    {
+      start = now ();
+      if (do_register (devs, keyhandle, sizeof (keyhandle)) != 0)
+	return EXIT_FAILURE;
+      reg_time += now () - start;
+
+      start = now ();
+      rc = do_authenticate (devs, keyhandle, U2FH_REQUEST_USER_PRESENCE);
+      if (rc != U2FH_OK)
+	{
+	  printf ("authenticate %d\n", rc);
+	  return EXIT_FAILURE;
+	}
+      auth_time += now () - start;
+    }
+
+  if (iterations > 0)
+    {
+      printf ("register:     %d ops, %.1f us/op, %.0f ops/s\n", iterations,
+	      reg_time * 1e6 / iterations, iterations / reg_time);
+      printf ("authenticate: %d ops, %.1f us/op, %.0f ops/s\n", iterations,
+	      auth_time * 1e6 / iterations, iterations / auth_time);
+    }
+
+  u2fh_devs_done (devs);
+
+  u2fh_global_done ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,409 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Create virtual FIDO HID devices through /dev/uhid and drive them
+ * through the normal discovery and u2fh_sendrecv path, reporting
+ * discovery latency and per-operation round-trip times.  The test is
+ * skipped when /dev/uhid cannot be opened.
+ */
+
+#include <config.h>
+#include <u2f-host.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "inc/u2f_hid.h"
+
+#define EXIT_SKIP 77
+
+#define DEVICE_NAME "libu2f-host uhid test device"
+#define DEFAULT_DEVICES 4
+#define DEFAULT_ITERATIONS 100
+#define DISCOVER_TIMEOUT 5.0
+
+static const unsigned char fido_rdesc[] = {
+  0x06, 0xd0, 0xf1,		/* Usage Page (FIDO Alliance) */
+  0x09, 0x01,			/* Usage (U2F HID) */
+  0xa1, 0x01,			/* Collection (Application) */
+  0x09, 0x20,			/*   Usage (Data In) */
+  0x15, 0x00,			/*   Logical Minimum (0) */
+  0x26, 0xff, 0x00,		/*   Logical Maximum (255) */
+  0x75, 0x08,			/*   Report Size (8) */
+  0x95, 0x40,			/*   Report Count (64) */
+  0x81, 0x02,			/*   Input (Data, Variable, Absolute) */
+  0x09, 0x21,			/*   Usage (Data Out) */
+  0x15, 0x00,			/*   Logical Minimum (0) */
+  0x26, 0xff, 0x00,		/*   Logical Maximum (255) */
+  0x75, 0x08,			/*   Report Size (8) */
+  0x95, 0x40,			/*   Report Count (64) */
+  0x91, 0x02,			/*   Output (Data, Variable, Absolute) */
+  0xc0				/* End Collection */
+};
+
+struct vdev
+{
+  int fd;
+  uint32_t next_cid;
+};
+
+static struct vdev *vdevs;
+static int nvdevs;
+static volatile int stop;
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+uhid_write (int fd, const struct uhid_event *ev)
+{
+  ssize_t ret = write (fd, ev, sizeof (*ev));
+
+  return ret == sizeof (*ev) ? 0 : -1;
+}
+
+static int
+create_device (struct vdev *v, int num)
+{
+  struct uhid_event ev;
+
+  v->fd = open ("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (v->fd < 0)
+    return -1;
+  v->next_cid = 1;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.type = UHID_CREATE2;
+  snprintf ((char *) ev.u.create2.name, sizeof (ev.u.create2.name), "%s",
+	    DEVICE_NAME);
+  snprintf ((char *) ev.u.create2.uniq, sizeof (ev.u.create2.uniq),
+	    "u2fh-uhid-%d", num);
+  memcpy (ev.u.create2.rd_data, fido_rdesc, sizeof (fido_rdesc));
+  ev.u.create2.rd_size = sizeof (fido_rdesc);
+  /* hidapi drops USB devices without a USB parent, while bluetooth
+     devices get their product string from the HID name */
+  ev.u.create2.bus = BUS_BLUETOOTH;
+  ev.u.create2.vendor = 0x1050;
+  ev.u.create2.product = 0xf1d0;
+
+  return uhid_write (v->fd, &ev);
+}
+
+static void
+destroy_device (struct vdev *v)
+{
+  struct uhid_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.type = UHID_DESTROY;
+  uhid_write (v->fd, &ev);
+  close (v->fd);
+}
+
+static void
+send_response (struct vdev *v, uint32_t cid, uint8_t cmd,
+	       const unsigned char *data, size_t len)
+{
+  struct uhid_event ev;
+  U2FHID_FRAME frame;
+
+  memset (&frame, 0, sizeof (frame));
+  frame.cid = cid;
+  frame.init.cmd = cmd;
+  frame.init.bcnth = (len >> 8) & 0xff;
+  frame.init.bcntl = len & 0xff;
+  memcpy (frame.init.data, data, len);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.type = UHID_INPUT2;
+  ev.u.input2.size = HID_RPT_SIZE;
+  memcpy (ev.u.input2.data, &frame, HID_RPT_SIZE);
+  uhid_write (v->fd, &ev);
+}
+
+/* Answer one U2FHID request; only single frame messages are needed. */
+static void
+handle_output (struct vdev *v, const unsigned char *data, size_t size)
+{
+  U2FHID_FRAME frame;
+  unsigned char resp[sizeof (frame.init.data)];
+  size_t len;
+
+  /* skip the report number if the kernel passed it on */
+  if (size == HID_RPT_SIZE + 1)
+    data++, size--;
+  if (size != HID_RPT_SIZE)
+    return;
+  memcpy (&frame, data, sizeof (frame));
+  if (FRAME_TYPE (frame) != TYPE_INIT)
+    return;
+
+  len = MSG_LEN (frame);
+  if (len > sizeof (frame.init.data))
+    {
+      resp[0] = ERR_INVALID_LEN;
+      send_response (v, frame.cid, U2FHID_ERROR, resp, 1);
+      return;
+    }
+
+  switch (frame.init.cmd)
+    {
+    case U2FHID_INIT:
+      memcpy (resp, frame.init.data, INIT_NONCE_SIZE);
+      memcpy (resp + INIT_NONCE_SIZE, &v->next_cid, sizeof (uint32_t));
+      v->next_cid++;
+      resp[INIT_NONCE_SIZE + 4] = U2FHID_IF_VERSION;
+      resp[INIT_NONCE_SIZE + 5] = 1;
+      resp[INIT_NONCE_SIZE + 6] = 0;
+      resp[INIT_NONCE_SIZE + 7] = 0;
+      resp[INIT_NONCE_SIZE + 8] = 0;
+      send_response (v, frame.cid, U2FHID_INIT, resp, INIT_NONCE_SIZE + 9);
+      break;
+    case U2FHID_PING:
+      send_response (v, frame.cid, U2FHID_PING, frame.init.data, len);
+      break;
+    case U2FHID_MSG:
+      /* U2F_VERSION, anything else is "instruction not supported" */
+      if (len >= 2 && frame.init.data[1] == 0x03)
+	send_response (v, frame.cid, U2FHID_MSG,
+		       (const unsigned char *) "U2F_V2\x90\x00", 8);
+      else
+	send_response (v, frame.cid, U2FHID_MSG,
+		       (const unsigned char *) "\x6d\x00", 2);
+      break;
+    default:
+      resp[0] = ERR_INVALID_CMD;
+      send_response (v, frame.cid, U2FHID_ERROR, resp, 1);
+      break;
+    }
+}
+
+static void *
+service_thread (void *arg)
+{
+  struct pollfd *pfds = calloc (nvdevs, sizeof (*pfds));
+  int i;
+
+  (void) arg;
+
+  if (pfds == NULL)
+    return NULL;
+  for (i = 0; i < nvdevs; i++)
+    {
+      pfds[i].fd = vdevs[i].fd;
+      pfds[i].events = POLLIN;
+    }
+
+  while (!stop)
+    {
+      if (poll (pfds, nvdevs, 100) <= 0)
+	continue;
+      for (i = 0; i < nvdevs; i++)
+	{
+	  struct uhid_event ev;
+
+	  if (!(pfds[i].revents & POLLIN))
+	    continue;
+	  if (read (vdevs[i].fd, &ev, sizeof (ev)) <= 0)
+	    continue;
+	  if (ev.type == UHID_OUTPUT)
+	    handle_output (&vdevs[i], ev.u.output.data, ev.u.output.size);
+	}
+    }
+
+  free (pfds);
+  return NULL;
+}
+
+/* Count the discovered devices that belong to this test. */
+static int
+count_devices (u2fh_devs * devs, unsigned max_index, unsigned *indexes)
+{
+  unsigned i;
+  int n = 0;
+
+  for (i = 0; i <= max_index && n < nvdevs; i++)
+    {
+      char desc[256];
+      size_t desclen = sizeof (desc);
+
+      if (!u2fh_is_alive (devs, i))
+	continue;
+      if (u2fh_get_device_description (devs, i, desc, &desclen) != U2FH_OK)
+	continue;
+      if (strcmp (desc, DEVICE_NAME) == 0)
+	indexes[n++] = i;
+    }
+
+  return n;
+}
+
+int
+main (void)
+{
+  u2fh_devs *devs;
+  pthread_t thread;
+  unsigned *indexes;
+  unsigned max_index = 0;
+  int iterations = DEFAULT_ITERATIONS;
+  double start, discover_time = 0, deadline;
+  int found = 0;
+  int exit_code = EXIT_FAILURE;
+  int rc;
+  int i, j;
+
+  nvdevs = DEFAULT_DEVICES;
+  if (getenv ("U2FH_UHID_DEVICES"))
+    nvdevs = atoi (getenv ("U2FH_UHID_DEVICES"));
+  if (getenv ("U2FH_BENCH_ITERATIONS"))
+    iterations = atoi (getenv ("U2FH_BENCH_ITERATIONS"));
+  if (nvdevs <= 0)
+    return EXIT_SKIP;
+
+  vdevs = calloc (nvdevs, sizeof (*vdevs));
+  indexes = calloc (nvdevs, sizeof (*indexes));
+  if (vdevs == NULL || indexes == NULL)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < nvdevs; i++)
+    {
+      if (create_device (&vdevs[i], i) != 0)
+	{
+	  printf ("cannot create uhid device: %s\n", strerror (errno));
+	  if (i == 0)
+	    return EXIT_SKIP;
+	  nvdevs = i;
+	  goto out;
+	}
+    }
+
+  if (pthread_create (&thread, NULL, service_thread, NULL) != 0)
+    goto out;
+
+  rc = u2fh_global_init (0);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_global_init rc %d\n", rc);
+      goto join;
+    }
+
+  rc = u2fh_devs_init (&devs);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_devs_init %d\n", rc);
+      goto join;
+    }
+
+  /* the hidraw nodes show up asynchronously, retry for a while */
+  deadline = now () + DISCOVER_TIMEOUT;
+  while (now () < deadline)
+    {
+      start = now ();
+      rc = u2fh_devs_discover (devs, &max_index);
+      discover_time = now () - start;
+      if (rc == U2FH_OK)
+	found = count_devices (devs, max_index, indexes);
+      if (found == nvdevs)
+	break;
+      usleep (50 * 1000);
+    }
+
+  if (found != nvdevs)
+    {
+      printf ("found %d of %d uhid devices, skipping\n", found, nvdevs);
+      exit_code = EXIT_SKIP;
+      goto done;
+    }
+
+  /* devices are open now, this measures a steady state rediscovery */
+  start = now ();
+  rc = u2fh_devs_discover (devs, &max_index);
+  if (rc != U2FH_OK)
+    {
+      printf ("u2fh_devs_discover %d\n", rc);
+      goto done;
+    }
+  printf ("discover: %d devices, first %.2f ms, repeat %.2f ms\n",
+	  nvdevs, discover_time * 1e3, (now () - start) * 1e3);
+
+  for (i = 0; i < nvdevs; i++)
+    {
+      double min = 1e9, max = 0, total = 0;
+
+      for (j = 0; j < iterations; j++)
+	{
+	  unsigned char ping[16], pong[1024];
+	  size_t ponglen = sizeof (pong);
+	  double t;
+
+	  memset (ping, j, sizeof (ping));
+	  start = now ();
+	  rc = u2fh_sendrecv (devs, indexes[i], U2FHID_PING, ping,
+			      sizeof (ping), pong, &ponglen);
+	  t = now () - start;
+	  if (rc != U2FH_OK || ponglen != sizeof (ping)
+	      || memcmp (ping, pong, sizeof (ping)) != 0)
+	    {
+	      printf ("ping device %u: %d\n", indexes[i], rc);
+	      goto done;
+	    }
+	  total += t;
+	  if (t < min)
+	    min = t;
+	  if (t > max)
+	    max = t;
+	}
+
+      if (iterations > 0)
+	printf ("device %u: %d pings, rtt min %.3f avg %.3f max %.3f ms\n",
+		indexes[i], iterations, min * 1e3, total * 1e3 / iterations,
+		max * 1e3);
+    }
+
+  exit_code = EXIT_SUCCESS;
+
+done:
+  u2fh_devs_done (devs);
+  u2fh_global_done ();
+join:
+  stop = 1;
+  pthread_join (thread, NULL);
+out:
+  for (i = 0; i < nvdevs; i++)
+    destroy_device (&vdevs[i]);
+  free (vdevs);
+  free (indexes);
+
+  return exit_code;
+}
@@ -18,100 +18,47 @@
 #include <config.h>
 #include "internal.h"
 
-#include <json.h>
-#include "b64/cencode.h"
-#include "b64/cdecode.h"
+#include "b64/b64url.h"
 #include "sha256.h"
 
+/* longest signature data a device may return: flags, counter and
+   signature; it bounds both the responses and u2fh_authenticate_size() */
+#define MAX_SIGNATURE_DATA (1 + 4 + U2F_MAX_EC_SIG_SIZE)
+
 static int
-prepare_response2 (const char *encstr, const char *bdstr, const char *input,
+prepare_response2 (const char *encstr, const char *bdstr, const char *keyb64,
 		   char **response, size_t * response_len)
 {
-  int rc = U2FH_JSON_ERROR;
-  struct json_object *jo = NULL, *enc = NULL, *bd = NULL, *key = NULL;
-  char keyb64[256];
-  size_t keylen = sizeof (keyb64);
-  const char *reply;
-
-  enc = json_object_new_string (encstr);
-  if (enc == NULL)
-    goto done;
-  bd = json_object_new_string (bdstr);
-  if (bd == NULL)
-    goto done;
-
-  rc = get_fixed_json_data (input, "keyHandle", keyb64, &keylen);
-  if (rc != U2FH_OK)
-    {
-      goto done;
-    }
-
-  rc = U2FH_JSON_ERROR;
-  key = json_object_new_string (keyb64);
-  if (key == NULL)
-    goto done;
-
-  jo = json_object_new_object ();
-  if (jo == NULL)
-    goto done;
-
-  json_object_object_add (jo, "signatureData", json_object_get (enc));
-  json_object_object_add (jo, "clientData", json_object_get (bd));
-  json_object_object_add (jo, "keyHandle", json_object_get (key));
-
-  reply = json_object_to_json_string (jo);
-  if (*response == NULL)
-    {
-      *response = strdup (reply);
-    }
-  else
-    {
-      if (strlen (reply) >= *response_len)
-	{
-	  rc = U2FH_SIZE_ERROR;
-	  *response_len = strlen (reply) + 1;
-	  goto done;
-	}
-      strcpy (*response, reply);
-    }
-  *response_len = strlen (reply);
-  if (*response == NULL)
-    rc = U2FH_MEMORY_ERROR;
-  else
-    rc = U2FH_OK;
+  static const char *const keys[] = {
+    "signatureData", "clientData", "keyHandle"
+  };
+  const char *values[3];
 
-done:
-  json_object_put (jo);
-  json_object_put (enc);
-  json_object_put (bd);
-  json_object_put (key);
+  values[0] = encstr;
+  values[1] = bdstr;
+  values[2] = keyb64;
 
-  return rc;
+  return json_write_object (keys, values, 3, response, response_len);
 }
 
 static int
 prepare_response (const unsigned char *buf, int len, const char *bd,
-		  const char *input, char **response, size_t * response_len)
+		  const char *keyb64, char **response, size_t * response_len)
 {
-  base64_encodestate b64ctx;
-  char b64enc[2048];
-  char bdstr[2048];
-  int cnt;
-
-  if (len > 2048)
+  char b64enc[B64URL_ENCODED_LEN (MAX_SIGNATURE_DATA) + 1];
+  char bdstr[B64URL_ENCODED_LEN (2048) + 1];
+  size_t bdlen = strlen (bd);
+
+  /* a device exceeding the limits of U2F is not followed */
+  if (len < 0 || (size_t) len > MAX_SIGNATURE_DATA)
+    return U2FH_AUTHENTICATOR_ERROR;
+  if (B64URL_ENCODED_LEN (bdlen) >= sizeof (bdstr))
     return U2FH_MEMORY_ERROR;
-  if (strlen (bd) > 2048)
-    return U2FH_MEMORY_ERROR;
-
-  base64_init_encodestate (&b64ctx);
-  cnt = base64_encode_block (buf, len, b64enc, &b64ctx);
-  base64_encode_blockend (b64enc + cnt, &b64ctx);
 
-  base64_init_encodestate (&b64ctx);
-  cnt = base64_encode_block (bd, strlen (bd), bdstr, &b64ctx);
-  base64_encode_blockend (bdstr + cnt, &b64ctx);
+  b64url_encode (buf, len, b64enc);
+  b64url_encode ((const unsigned char *) bd, bdlen, bdstr);
 
-  return prepare_response2 (b64enc, bdstr, input, response, response_len);
+  return prepare_response2 (b64enc, bdstr, keyb64, response, response_len);
 }
 
 #define CHALLBINLEN 32
@@ -119,119 +66,116 @@ prepare_response (const unsigned char *buf, int len, const char *bd,
 #define MAXKHLEN 128
 #define NOTSATISFIED "\x69\x85"
 
-static u2fh_rc
-_u2fh_authenticate (u2fh_devs * devs,
-		    const char *challenge,
-		    const char *origin, char **response,
-		    size_t * response_len, u2fh_cmdflags flags)
+int
+authenticate_start (u2fh_devs * devs, const char *origin,
+		    u2fh_cmdflags flags, unsigned timeout, u2fh_op * op)
 {
-  unsigned char data[CHALLBINLEN + HOSIZE + MAXKHLEN + 1];
-  unsigned char buf[MAXDATASIZE];
-  char bd[2048];
-  size_t bdlen = sizeof (bd);
-  size_t len;
+  unsigned char data[CHALLBINLEN];
+  size_t bdlen = sizeof (op->bd);
   int rc;
-  char chalb64[256];
-  size_t challen = sizeof (chalb64);
-  char khb64[256];
-  size_t kh64len = sizeof (khb64);
-  base64_decodestate b64;
-  size_t khlen;
-  int iterations = 0;
-
-  rc = get_fixed_json_data (challenge, "challenge", chalb64, &challen);
-  if (rc != U2FH_OK)
-    return rc;
 
-  rc = prepare_browserdata (chalb64, origin, AUTHENTICATE_TYP, bd, &bdlen);
+  if (!op->req.have_keyhandle)
+    return U2FH_JSON_ERROR;
+  if (devs->ctx->debug)
+    u2fh_log (devs->ctx, "JSON challenge URL-B64: %s, keyHandle URL-B64: %s",
+	      op->req.challenge, op->req.keyhandle);
+
+  rc = prepare_browserdata (devs->ctx, op->req.challenge, origin,
+			    AUTHENTICATE_TYP, op->bd, &bdlen);
   if (rc != U2FH_OK)
     return rc;
 
-  sha256_buffer (bd, bdlen, data);
+  sha256_buffer (op->bd, bdlen, data);
 
-  prepare_origin (challenge, data + CHALLBINLEN);
+  return authenticate_start_raw (devs, data, op->req.appparam, op->req.kh,
+				 op->req.khlen, flags, timeout, op);
+}
 
-  /* confusion between key_handle and keyHandle */
-  rc = get_fixed_json_data (challenge, "keyHandle", khb64, &kh64len);
-  if (rc != U2FH_OK)
-    return rc;
+/* Start authenticating with the 32-byte challenge and application
+   parameters of the APDU and the key handle @kh of @khlen bytes. */
+int
+authenticate_start_raw (u2fh_devs * devs, const unsigned char *challenge,
+			const unsigned char *appparam,
+			const unsigned char *kh, size_t khlen,
+			u2fh_cmdflags flags, unsigned timeout, u2fh_op * op)
+{
+  unsigned char data[CHALLBINLEN + HOSIZE + MAXKHLEN + 1];
+  unsigned id;
+  int rc;
 
-  base64_init_decodestate (&b64);
-  khlen = base64_decode_block (khb64, kh64len,
-			       data + HOSIZE + CHALLBINLEN + 1, &b64);
-  data[HOSIZE + CHALLBINLEN] = khlen;
+  if (khlen > MAXKHLEN)
+    return U2FH_SIZE_ERROR;
+  memcpy (data, challenge, CHALLBINLEN);
+  memcpy (data + CHALLBINLEN, appparam, HOSIZE);
+  data[CHALLBINLEN + HOSIZE] = khlen;
+  memcpy (data + CHALLBINLEN + HOSIZE + 1, kh, khlen);
+  memcpy (op->appparam, appparam, HOSIZE);
 
-  /* FIXME: Support asynchronous usage, through a new u2fh_cmdflags
-     flag. */
+  kh_digest (appparam, kh, khlen, op->khdigest);
 
-  do
-    {
-      struct u2fdevice *dev;
-
-      if (iterations > 0 && len == 2 && memcmp (buf, NOTSATISFIED, 2) == 0)
-	{
-	  Sleep (1000);
-	}
-      for (dev = devs->first; dev != NULL; dev = dev->next)
-	{
-	  unsigned char tmp_buf[MAXDATASIZE];
-	  if (iterations == 0)
-	    {
-	      dev->skipped = 0;
-	    }
-	  else if (dev->skipped != 0)
-	    {
-	      continue;
-	    }
-	  len = MAXDATASIZE;
-	  rc = send_apdu (devs, dev->id, U2F_AUTHENTICATE, data,
-			  HOSIZE + CHALLBINLEN + khlen + 1,
-			  flags & U2FH_REQUEST_USER_PRESENCE ? 3 : 7, tmp_buf,
-			  &len);
-	  if (rc != U2FH_OK)
-	    {
-	      return rc;
-	    }
-	  else if (len != 2)
-	    {
-	      memcpy (buf, tmp_buf, len);
-	      break;
-	    }
-	  else if (memcmp (tmp_buf, NOTSATISFIED, 2) != 0)
-	    {
-	      dev->skipped = 1;
-	    }
-	  else
-	    {
-	      memcpy (buf, tmp_buf, len);
-	    }
-	}
-      if (iterations++ > 15)
-	{
-	  return U2FH_TIMEOUT_ERROR;
-	}
-    }
-  while ((flags & U2FH_REQUEST_USER_PRESENCE)
-	 && len == 2 && memcmp (buf, NOTSATISFIED, 2) == 0);
+  rc = fanout_start (&op->fo, devs, U2F_AUTHENTICATE, data,
+		     HOSIZE + CHALLBINLEN + khlen + 1,
+		     flags & U2FH_REQUEST_USER_PRESENCE ? 3 : 7,
+		     flags & U2FH_REQUEST_USER_PRESENCE, timeout);
+  if (rc == U2FH_OK && kh_lookup (devs, op->khdigest, &id))
+    fanout_route (&op->fo, id);
 
+  return rc;
+}
+
+/* Remember which device owns the key handle of @op, which has
+   finished, for the next authentication with it. */
+void
+authenticate_learn (u2fh_op * op)
+{
+  if (op->fo.owner != NULL)
+    kh_remember (op->devs, op->khdigest, op->fo.owner->id);
+  else if (op->fo.rerouted)
+    kh_forget (op->devs, op->khdigest);
+}
+
+int
+authenticate_response (u2fh_op * op, const unsigned char *buf, size_t len,
+		       char **response, size_t * response_len)
+{
   if (len == 2 && memcmp (buf, NOTSATISFIED, 2) != 0)
     {
       return U2FH_AUTHENTICATOR_ERROR;
     }
-  else if ((flags & U2FH_REQUEST_USER_PRESENCE) == 0
-	   && len == 2 && memcmp (buf, NOTSATISFIED, 2) == 0)
+  else if ((op->flags & U2FH_REQUEST_USER_PRESENCE) == 0 && len == 2)
     {
       return U2FH_OK;
     }
   if (len != 2)
     {
-      prepare_response (buf, len - 2, bd, challenge, response, response_len);
-      return U2FH_OK;
+      return prepare_response (buf, len - 2, op->bd, op->req.keyhandle,
+			       response, response_len);
     }
 
   return U2FH_TRANSPORT_ERROR;
 }
 
+static u2fh_rc
+_u2fh_authenticate (u2fh_devs * devs,
+		    const char *challenge,
+		    const char *origin, char **response,
+		    size_t * response_len, u2fh_cmdflags flags,
+		    u2fh_cmdopts * opts)
+{
+  u2fh_op *op;
+  int rc;
+
+  rc = op_start (devs, U2F_AUTHENTICATE, challenge, origin, flags, opts,
+		 &op);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = op_run (op, opts, response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
+}
+
 /**
  * u2fh_authenticate2:
  * @devs: a device handle, from u2fh_devs_init() and u2fh_devs_discover().
@@ -253,7 +197,34 @@ u2fh_authenticate2 (u2fh_devs * devs,
 		    u2fh_cmdflags flags)
 {
   return _u2fh_authenticate (devs, challenge, origin, &response, response_len,
-			     flags);
+			     flags, NULL);
+}
+
+/**
+ * u2fh_authenticate3:
+ * @devs: a device handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @response: pointer to string for output data
+ * @response_len: pointer to length of @response
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Authenticate operation like u2fh_authenticate2(),
+ * giving up after the timeout in @opts.  The time taken is stored in
+ * @opts.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_authenticate3 (u2fh_devs * devs,
+		    const char *challenge,
+		    const char *origin, char *response, size_t * response_len,
+		    u2fh_cmdflags flags, u2fh_cmdopts * opts)
+{
+  return _u2fh_authenticate (devs, challenge, origin, &response, response_len,
+			     flags, opts);
 }
 
 /**
@@ -278,5 +249,162 @@ u2fh_authenticate (u2fh_devs * devs,
 
   *response = NULL;
   return _u2fh_authenticate (devs, challenge, origin, response, &response_len,
-			     flags);
+			     flags, NULL);
+}
+
+/**
+ * u2fh_authenticate_size:
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @size: output variable for the size of the response buffer needed.
+ *
+ * Compute the size, terminating NUL included, of the largest response
+ * u2fh_authenticate2() may return for @challenge and @origin.  A
+ * buffer of that size is never too small, so the operation does not
+ * have to be repeated because of %U2FH_SIZE_ERROR.  A device
+ * returning more data than U2F allows fails with
+ * %U2FH_AUTHENTICATOR_ERROR instead.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_authenticate_size (const char *challenge, const char *origin,
+			size_t * size)
+{
+  static const unsigned char data[MAX_SIGNATURE_DATA];
+  struct u2fh_request req;
+  char bd[2048];
+  size_t bdlen = sizeof (bd);
+  char c, *response = &c;
+  int rc;
+
+  rc = request_parse (&req, challenge);
+  if (rc != U2FH_OK)
+    return rc;
+  if (!req.have_keyhandle)
+    return U2FH_JSON_ERROR;
+  rc = prepare_browserdata (&default_ctx, req.challenge, origin,
+			    AUTHENTICATE_TYP, bd, &bdlen);
+  if (rc != U2FH_OK)
+    return rc;
+
+  /* measure the response to the longest data, in an empty buffer */
+  *size = 0;
+  rc = prepare_response (data, sizeof (data), bd, req.keyhandle,
+			 &response, size);
+  if (rc == U2FH_SIZE_ERROR)
+    rc = U2FH_OK;
+
+  return rc;
+}
+
+/**
+ * u2fh_authenticate_start:
+ * @devs: a device handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ * @op: pointer to output handle for the operation.
+ *
+ * Start the U2F Authenticate operation without waiting for it.
+ * Drive it to completion with u2fh_op_fds() and u2fh_step(), and
+ * release it with u2fh_op_done().  The elapsed field of @opts is not
+ * used.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_authenticate_start (u2fh_devs * devs,
+			 const char *challenge,
+			 const char *origin, u2fh_cmdflags flags,
+			 const u2fh_cmdopts * opts, u2fh_op ** op)
+{
+  return op_start (devs, U2F_AUTHENTICATE, challenge, origin, flags, opts,
+		   op);
+}
+
+/**
+ * u2fh_authenticate_request:
+ * @devs: a device handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @req: the request, from u2fh_request_init(), with a key handle.
+ * @origin: U2F origin URL.
+ * @response: pointer to string for output data
+ * @response_len: pointer to length of @response
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Authenticate operation like u2fh_authenticate3(),
+ * with the challenge parsed before.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_authenticate_request (u2fh_devs * devs, const u2fh_request * req,
+			   const char *origin, char *response,
+			   size_t * response_len, u2fh_cmdflags flags,
+			   u2fh_cmdopts * opts)
+{
+  u2fh_op *op;
+  int rc;
+
+  rc = op_start_request (devs, U2F_AUTHENTICATE, req, origin, flags, opts,
+			 &op);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = op_run (op, opts, &response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
+}
+
+/**
+ * u2fh_authenticate_raw:
+ * @devs: a device handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: the 32-byte challenge parameter, the SHA-256 hash of the
+ *   client data.
+ * @appparam: the 32-byte application parameter, the SHA-256 hash of
+ *   the application id.
+ * @keyhandle: the key handle, as returned by u2fh_register_raw().
+ * @keyhandle_len: length of @keyhandle, at most 128 bytes.
+ * @response: buffer for the response of the device.
+ * @response_len: on input the size of @response, on output the length
+ *   of the response.
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Authenticate operation on binary parameters, like
+ * u2fh_register_raw().  The signature data returned by the device is
+ * stored in @response, followed by the two-byte status word.  Without
+ * %U2FH_REQUEST_USER_PRESENCE the device only checks @keyhandle, and
+ * @response holds just the status word, 0x6985 if the key handle is
+ * known.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned.  If @response
+ * is too small %U2FH_SIZE_ERROR is returned and @response_len holds
+ * the size needed.  Otherwise an #u2fh_rc error code is returned.
+ */
+u2fh_rc
+u2fh_authenticate_raw (u2fh_devs * devs, const unsigned char *challenge,
+		       const unsigned char *appparam,
+		       const unsigned char *keyhandle, size_t keyhandle_len,
+		       unsigned char *response, size_t * response_len,
+		       u2fh_cmdflags flags, u2fh_cmdopts * opts)
+{
+  u2fh_op *op;
+  int rc;
+
+  rc = op_start_raw (devs, U2F_AUTHENTICATE, challenge, appparam,
+		     keyhandle, keyhandle_len, flags, opts, &op);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = op_run (op, opts, (char **) &response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
 }
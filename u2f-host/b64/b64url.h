@@ -15,32 +15,17 @@
   along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
-/*
-cdecode.h - c header for a base64 decoding algorithm
-
-This is part of the libb64 project, and has been placed in the public domain.
-For details, see http://sourceforge.net/projects/libb64
-*/
-
-#ifndef BASE64_CDECODE_H
-#define BASE64_CDECODE_H
-
-typedef enum
-{
-  step_a, step_b, step_c, step_d
-} base64_decodestep;
+#ifndef BASE64_B64URL_H
+#define BASE64_B64URL_H
 
-typedef struct
-{
-  base64_decodestep step;
-  char plainchar;
-} base64_decodestate;
+#include <stddef.h>
 
-void base64_init_decodestate (base64_decodestate * state_in);
+/* characters encoding @n bytes, without padding or NUL */
+#define B64URL_ENCODED_LEN(n) (((n) * 4 + 2) / 3)
 
-int base64_decode_value (char value_in);
+size_t b64url_encode (const unsigned char *in, size_t len, char *out);
 
-int base64_decode_block (const char *code_in, const int length_in,
-			 char *plaintext_out, base64_decodestate * state_in);
+int b64url_decode (const char *in, size_t len, unsigned char *out,
+		   size_t size);
 
-#endif /* BASE64_CDECODE_H */
+#endif /* BASE64_B64URL_H */
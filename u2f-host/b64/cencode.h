@@ -1,49 +0,0 @@
-/*
-  Copyright (C) 2013-2015 Yubico AB
-
-  This program is free software; you can redistribute it and/or modify it
-  under the terms of the GNU Lesser General Public License as published by
-  the Free Software Foundation; either version 2.1, or (at your option) any
-  later version.
-
-  This program is distributed in the hope that it will be useful, but
-  WITHOUT ANY WARRANTY; without even the implied warranty of
-  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
-  General Public License for more details.
-
-  You should have received a copy of the GNU Lesser General Public License
-  along with this program; if not, see <http://www.gnu.org/licenses/>.
-*/
-
-/*
-cencode.h - c header for a base64 encoding algorithm
-
-This is part of the libb64 project, and has been placed in the public domain.
-For details, see http://sourceforge.net/projects/libb64
-*/
-
-#ifndef BASE64_CENCODE_H
-#define BASE64_CENCODE_H
-
-typedef enum
-{
-  step_A, step_B, step_C
-} base64_encodestep;
-
-typedef struct
-{
-  base64_encodestep step;
-  char result;
-  int stepcount;
-} base64_encodestate;
-
-void base64_init_encodestate (base64_encodestate * state_in);
-
-char base64_encode_value (char value_in);
-
-int base64_encode_block (const char *plaintext_in, int length_in,
-			 char *code_out, base64_encodestate * state_in);
-
-int base64_encode_blockend (char *code_out, base64_encodestate * state_in);
-
-#endif /* BASE64_CENCODE_H */
@@ -0,0 +1,157 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Base64url without padding, as U2F uses for key handles, client
+ * data and responses.  Whole groups of three bytes and four
+ * characters are converted with table lookups, with no state carried
+ * from one character to the next.  Decoding is strict: characters
+ * outside the alphabet, impossible lengths and stray bits in the last
+ * character are rejected instead of skipped.
+ */
+
+#include <config.h>
+#include <b64/b64url.h>
+
+#include <limits.h>
+
+static const char encoding[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* value of each character, 0xff outside the alphabet */
+static const unsigned char decoding[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+  0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+  0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+  0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+  0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+  0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* Encode @len bytes of @in into @out, which must have room for
+   B64URL_ENCODED_LEN (@len) characters and a NUL.  Returns the number
+   of characters written, not counting the NUL. */
+size_t
+b64url_encode (const unsigned char *in, size_t len, char *out)
+{
+  char *p = out;
+  size_t i;
+
+  for (i = 0; i + 3 <= len; i += 3)
+    {
+      unsigned v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+
+      p[0] = encoding[v >> 18];
+      p[1] = encoding[(v >> 12) & 0x3f];
+      p[2] = encoding[(v >> 6) & 0x3f];
+      p[3] = encoding[v & 0x3f];
+      p += 4;
+    }
+  if (i < len)
+    {
+      unsigned v = in[i] << 16;
+
+      if (i + 1 < len)
+	v |= in[i + 1] << 8;
+      *p++ = encoding[v >> 18];
+      *p++ = encoding[(v >> 12) & 0x3f];
+      if (i + 1 < len)
+	*p++ = encoding[(v >> 6) & 0x3f];
+    }
+  *p = '\0';
+
+  return p - out;
+}
+
+/* Decode the @len characters of @in into @out of @size bytes.  Padding
+   is not needed but accepted.  Returns the number of bytes decoded, or
+   -1 if @in is not base64url or does not fit. */
+int
+b64url_decode (const char *in, size_t len, unsigned char *out, size_t size)
+{
+  const unsigned char *s = (const unsigned char *) in;
+  unsigned char *q = out;
+  unsigned bad = 0;
+  size_t i, n;
+
+  if (len > 0 && len % 4 == 0 && s[len - 1] == '=')
+    len -= s[len - 2] == '=' ? 2 : 1;
+  if (len % 4 == 1)
+    return -1;
+  n = len / 4 * 3 + (len % 4 ? len % 4 - 1 : 0);
+  if (n > size || n > INT_MAX)
+    return -1;
+
+  for (i = 0; i + 4 <= len; i += 4)
+    {
+      unsigned a = decoding[s[i]], b = decoding[s[i + 1]];
+      unsigned c = decoding[s[i + 2]], d = decoding[s[i + 3]];
+      unsigned v = a << 18 | b << 12 | c << 6 | d;
+
+      bad |= a | b | c | d;
+      q[0] = v >> 16;
+      q[1] = v >> 8;
+      q[2] = v;
+      q += 3;
+    }
+  if (i < len)
+    {
+      unsigned a = decoding[s[i]], b = decoding[s[i + 1]];
+      unsigned c = i + 2 < len ? decoding[s[i + 2]] : 0;
+      unsigned v = a << 18 | b << 12 | c << 6;
+
+      bad |= a | b | c;
+      *q++ = v >> 16;
+      if (i + 2 < len)
+	*q++ = v >> 8;
+      /* the bits beyond the last byte must be zero */
+      if (v & (i + 2 < len ? 0xff : 0xffff))
+	bad = 0xff;
+    }
+
+  /* only bytes outside the alphabet have the top bits set */
+  if (bad & 0xc0)
+    return -1;
+
+  return n;
+}
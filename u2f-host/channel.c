@@ -0,0 +1,507 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * U2FHID channels of a device.  Each transaction runs on a channel
+ * of its own, taken from a small pool that grows with U2FHID_INIT on
+ * the broadcast channel when every channel is in use.  Whoever reads
+ * a report from the device hands it to the channel it is addressed
+ * to, so transactions on different channels never eat each other's
+ * replies.  Each channel has a pipe that turns readable when a report
+ * is queued for it, so a thread waiting on the device wakes up when
+ * another thread has read its report.  The pipe exists from the start
+ * rather than once the device gets busy, as a thread that gathered its
+ * descriptors before then would not be woken.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+
+/* most reports queued for a channel, enough for the largest reply */
+#define CHANNEL_QUEUE_MAX (MAXDATASIZE / 59 + 2)
+/* drain_left while the reply to an abandoned request has not started */
+#define DRAIN_AWAIT_INIT ((size_t) -1)
+
+static struct u2fh_channel *
+channel_new (struct u2fdevice *dev, uint32_t cid)
+{
+  struct u2fh_channel *ch = calloc (1, sizeof (*ch));
+
+  if (ch == NULL)
+    return NULL;
+  ch->dev = dev;
+  ch->cid = cid;
+  ch->notify[0] = ch->notify[1] = -1;
+  if (make_pipe (ch->notify) != U2FH_OK)
+    {
+      free (ch);
+      return NULL;
+    }
+
+  return ch;
+}
+
+static void
+channel_free (struct u2fh_channel *ch)
+{
+  if (ch == NULL)
+    return;
+#ifndef _WIN32
+  if (ch->notify[0] >= 0)
+    {
+      close (ch->notify[0]);
+      close (ch->notify[1]);
+    }
+#endif
+  free (ch->queue);
+  free (ch);
+}
+
+/* Release the channels of @dev. */
+void
+channels_done (struct u2fdevice *dev)
+{
+  size_t i;
+
+  for (i = 0; i < dev->nchannels; i++)
+    channel_free (dev->channels[i]);
+  channel_free (dev->bcast);
+  dev->nchannels = 0;
+  dev->bcast = NULL;
+}
+
+/* Wake up threads waiting for a channel of @dev in channel_acquire(),
+   as one may have become free or may be opened.  Called with dev->io
+   held. */
+static void
+channel_freed (struct u2fdevice *dev)
+{
+  dev->freed_gen++;
+  cond_broadcast (&dev->freed);
+}
+
+/* Account for @frame arriving on @ch while it is draining the reply
+   to an abandoned request. */
+static void
+channel_drain (struct u2fh_channel *ch, const U2FHID_FRAME * frame)
+{
+  if (FRAME_TYPE (*frame) == TYPE_INIT)
+    {
+      size_t len = MSG_LEN (*frame);
+
+      if (frame->init.cmd == CTAPHID_KEEPALIVE)
+	return;
+      ch->drain_left = len > sizeof (frame->init.data) ?
+	len - sizeof (frame->init.data) : 0;
+    }
+  else if (ch->drain_left == DRAIN_AWAIT_INIT)
+    return;
+  else
+    ch->drain_left = ch->drain_left > sizeof (frame->cont.data) ?
+      ch->drain_left - sizeof (frame->cont.data) : 0;
+
+  if (ch->drain_left == 0)
+    {
+      ch->draining = 0;
+      channel_freed (ch->dev);
+    }
+}
+
+static void
+channel_push (struct u2fh_channel *ch, const unsigned char *report)
+{
+  if (ch->qhead == ch->qlen)
+    ch->qhead = ch->qlen = 0;
+  if (ch->qlen == ch->qsize && ch->qhead > 0)
+    {
+      memmove (ch->queue, ch->queue + ch->qhead,
+	       (ch->qlen - ch->qhead) * sizeof (*ch->queue));
+      ch->qlen -= ch->qhead;
+      ch->qhead = 0;
+    }
+  if (ch->qlen == ch->qsize)
+    {
+      size_t size = ch->qsize ? ch->qsize * 2 : 4;
+      void *queue;
+
+      if (size > CHANNEL_QUEUE_MAX)
+	size = CHANNEL_QUEUE_MAX;
+      if (size == ch->qsize
+	  || (queue = realloc (ch->queue, size * sizeof (*ch->queue))) == NULL)
+	{
+	  if (ch->dev->ctx->debug)
+	    u2fh_log (ch->dev->ctx, "USB dropped report for channel %08x",
+		      ch->cid);
+	  return;
+	}
+      ch->queue = queue;
+      ch->qsize = size;
+    }
+
+  memcpy (ch->queue[ch->qlen++], report, HID_RPT_SIZE);
+#ifndef _WIN32
+  if (ch->qlen - ch->qhead == 1 && ch->notify[1] >= 0
+      && write (ch->notify[1], "", 1) < 0 && ch->dev->ctx->debug)
+    u2fh_log (ch->dev->ctx, "cannot notify channel %08x", ch->cid);
+#endif
+}
+
+static void
+channel_clear (struct u2fh_channel *ch)
+{
+  ch->qhead = ch->qlen = 0;
+#ifndef _WIN32
+  if (ch->notify[0] >= 0)
+    {
+      char buf[16];
+
+      while (read (ch->notify[0], buf, sizeof (buf)) > 0)
+	;
+    }
+#endif
+}
+
+static void
+channel_pop (struct u2fh_channel *ch, unsigned char *report)
+{
+  memcpy (report, ch->queue[ch->qhead++], HID_RPT_SIZE);
+  if (ch->qhead == ch->qlen)
+    channel_clear (ch);
+}
+
+/* Find the channel of @dev that @report is for, or NULL if nobody is
+   waiting for it.  Called with dev->io held. */
+static struct u2fh_channel *
+channel_route (struct u2fdevice *dev, const unsigned char *report)
+{
+  struct u2fh_channel *ch = NULL;
+  U2FHID_FRAME frame;
+  size_t i;
+
+  memcpy (&frame, report, sizeof (frame));
+  if (dev->bcast && frame.cid == dev->bcast->cid)
+    ch = dev->bcast;
+  for (i = 0; ch == NULL && i < dev->nchannels; i++)
+    if (dev->channels[i]->cid == frame.cid)
+      ch = dev->channels[i];
+
+  if (ch != NULL && ch->draining)
+    {
+      channel_drain (ch, &frame);
+      return NULL;
+    }
+  if (ch == NULL || !ch->busy)
+    {
+      if (dev->ctx->debug)
+	u2fh_log (dev->ctx, "USB dropped report for channel %08x",
+		  frame.cid);
+      return NULL;
+    }
+
+  return ch;
+}
+
+/* Read the next report for @ch into @report, which has room for
+   HID_RPT_SIZE bytes.  Reports for other channels of the device met
+   on the way are queued for them.  Only transports without a
+   descriptor are read with a @timeout, in milliseconds, as the device
+   is locked meanwhile.  Returns the size of the report, 0 if there is
+   none, or a negative value on transport errors. */
+int
+channel_read (struct u2fh_channel *ch, unsigned char *report, int timeout)
+{
+  struct u2fdevice *dev = ch->dev;
+  int rc;
+
+  mutex_lock (&dev->io);
+  for (;;)
+    {
+      unsigned char data[HID_RPT_SIZE];
+      struct u2fh_channel *to;
+
+      if (ch->qhead < ch->qlen)
+	{
+	  channel_pop (ch, report);
+	  rc = HID_RPT_SIZE;
+	  break;
+	}
+
+      memset (data, 0, sizeof (data));
+      rc = dev->transport->read (dev->handle, data, sizeof (data), timeout);
+      if (rc <= 0)
+	break;
+      timeout = 0;
+
+      to = channel_route (dev, data);
+      if (to == ch)
+	{
+	  memcpy (report, data, HID_RPT_SIZE);
+	  rc = HID_RPT_SIZE;
+	  break;
+	}
+      if (to != NULL)
+	channel_push (to, data);
+    }
+  mutex_unlock (&dev->io);
+
+  return rc;
+}
+
+/* Return the descriptor that turns readable when a report is queued
+   for @ch, or -1. */
+int
+channel_fd (struct u2fh_channel *ch)
+{
+  return ch->notify[0];
+}
+
+/* Start asking @dev for a new channel with U2FHID_INIT on the
+   broadcast channel, to be completed with channel_open_finish() once
+   op->x is no longer busy.  A device that is not open is opened
+   first.  Returns %U2FH_AGAIN if the device is
+   being asked already or has no room for another channel. */
+int
+channel_open_start (struct channel_open *op, struct u2fdevice *dev,
+		    uint64_t deadline)
+{
+  int rc = U2FH_OK;
+
+  op->dev = dev;
+  mutex_lock (&dev->io);
+  if (dev->allocating || dev->nchannels == MAX_CHANNELS)
+    {
+      mutex_unlock (&dev->io);
+      return U2FH_AGAIN;
+    }
+  if (dev->handle == NULL && (rc = device_open (dev)) != U2FH_OK)
+    {
+      mutex_unlock (&dev->io);
+      return rc;
+    }
+  if (dev->bcast == NULL
+      && (dev->bcast = channel_new (dev, CID_BROADCAST)) == NULL)
+    rc = U2FH_MEMORY_ERROR;
+  if (rc != U2FH_OK)
+    {
+      mutex_unlock (&dev->io);
+      return rc;
+    }
+  dev->allocating = 1;
+  dev->bcast->busy = 1;
+  mutex_unlock (&dev->io);
+
+  if (obtain_nonce (op->nonce) != 0)
+    rc = U2FH_TRANSPORT_ERROR;
+  else
+    rc = xfer_start_on (&op->x, dev->bcast, U2FHID_INIT, op->nonce,
+			sizeof (op->nonce), op->resp, sizeof (op->resp),
+			deadline);
+  if (rc != U2FH_OK)
+    {
+      mutex_lock (&dev->io);
+      dev->allocating = 0;
+      dev->bcast->busy = 0;
+      channel_freed (dev);
+      mutex_unlock (&dev->io);
+    }
+
+  return rc;
+}
+
+/* Complete @op, giving up on it if the device has not answered yet.
+   The device information returned is stored, and the new channel is
+   taken for a transaction in *@chp. */
+int
+channel_open_finish (struct channel_open *op, struct u2fh_channel **chp)
+{
+  struct u2fdevice *dev = op->dev;
+  struct u2fh_channel *ch;
+  size_t offs = sizeof (op->nonce);
+  uint32_t cid = 0;
+  int rc = U2FH_OK;
+
+  xfer_abandon (&op->x);
+  if (op->x.rc != U2FH_OK)
+    rc = U2FH_TRANSPORT_ERROR;
+  /* the response has to be at least 17 bytes, if it's less we discard it */
+  else if (op->x.resp_len < 17)
+    rc = U2FH_SIZE_ERROR;
+  /* incoming and outgoing nonce has to match */
+  else if (memcmp (op->nonce, op->resp, sizeof (op->nonce)) != 0)
+    rc = U2FH_TRANSPORT_ERROR;
+
+  /* the device information is read by other threads under dev->io */
+  mutex_lock (&dev->io);
+  dev->allocating = 0;
+  dev->bcast->busy = 0;
+  channel_freed (dev);
+  if (rc == U2FH_OK)
+    {
+      memcpy (&cid, op->resp + offs, sizeof (cid));
+      offs += 4;
+      dev->versionInterface = op->resp[offs++];
+      dev->versionMajor = op->resp[offs++];
+      dev->versionMinor = op->resp[offs++];
+      dev->versionBuild = op->resp[offs++];
+      dev->capFlags = op->resp[offs++];
+      ch = channel_new (dev, cid);
+      if (ch == NULL)
+	rc = U2FH_MEMORY_ERROR;
+      else
+	{
+	  if (dev->ctx->debug)
+	    u2fh_log (dev->ctx, "opened channel %08x", cid);
+	  ch->busy = 1;
+	  dev->channels[dev->nchannels++] = ch;
+	  *chp = ch;
+	}
+    }
+  mutex_unlock (&dev->io);
+
+  return rc;
+}
+
+/* Give up on @op, which was started and not finished. */
+void
+channel_open_abandon (struct channel_open *op)
+{
+  struct u2fdevice *dev = op->dev;
+
+  xfer_abandon (&op->x);
+  mutex_lock (&dev->io);
+  dev->allocating = 0;
+  dev->bcast->busy = 0;
+  channel_freed (dev);
+  mutex_unlock (&dev->io);
+}
+
+/* Take a free channel of @dev for a transaction, without opening a
+   new one.  Returns %U2FH_AGAIN if all channels are in use. */
+int
+channel_take (struct u2fdevice *dev, struct u2fh_channel **chp)
+{
+  uint64_t now = monotonic_ms ();
+  struct u2fh_channel *ch;
+  size_t i;
+
+  mutex_lock (&dev->io);
+  for (i = 0; i < dev->nchannels; i++)
+    {
+      ch = dev->channels[i];
+      if (ch->draining && now >= ch->drain_until)
+	ch->draining = 0;
+      if (!ch->busy && !ch->draining)
+	{
+	  ch->busy = 1;
+	  *chp = ch;
+	  mutex_unlock (&dev->io);
+	  return U2FH_OK;
+	}
+    }
+  mutex_unlock (&dev->io);
+
+  return U2FH_AGAIN;
+}
+
+/* Sleep until channel_freed() is called for @dev after freed_gen
+   was @gen, a draining channel times out, or @deadline. */
+static void
+channel_wait (struct u2fdevice *dev, unsigned gen, uint64_t deadline)
+{
+  uint64_t now = monotonic_ms ();
+  size_t i;
+
+  mutex_lock (&dev->io);
+  for (i = 0; i < dev->nchannels; i++)
+    if (dev->channels[i]->draining
+	&& dev->channels[i]->drain_until < deadline)
+      deadline = dev->channels[i]->drain_until;
+  if (dev->freed_gen == gen && now < deadline)
+    cond_timedwait (&dev->freed, &dev->io, (int) (deadline - now));
+  mutex_unlock (&dev->io);
+}
+
+/* Take a free channel of @dev for a transaction, opening a new one
+   if all are in use, and waiting for the device to answer.  While
+   no channel can be had the thread sleeps until one is handed back.
+   Only for blocking calls; operations run channel_take() and the
+   steps of channel_open_start() instead.  Returns
+   %U2FH_TIMEOUT_ERROR if there is no channel by @deadline. */
+int
+channel_acquire (struct u2fdevice *dev, uint64_t deadline,
+		 struct u2fh_channel **chp)
+{
+  struct channel_open op;
+  struct u2fh_xfer *xp = &op.x;
+  unsigned gen;
+  int rc;
+
+  for (;;)
+    {
+      mutex_lock (&dev->io);
+      gen = dev->freed_gen;
+      mutex_unlock (&dev->io);
+
+      rc = channel_take (dev, chp);
+      if (rc != U2FH_AGAIN)
+	return rc;
+      rc = channel_open_start (&op, dev, deadline);
+      if (rc != U2FH_AGAIN)
+	break;
+      /* every channel is busy, or another thread is opening one */
+      if (monotonic_ms () >= deadline)
+	return U2FH_TIMEOUT_ERROR;
+      channel_wait (dev, gen, deadline);
+    }
+  if (rc != U2FH_OK)
+    return rc;
+  while (op.x.state == XFER_BUSY)
+    xfer_wait (&xp, 1, op.x.deadline, -1);
+
+  return channel_open_finish (&op, chp);
+}
+
+/* Hand back @ch after a transaction.  If the transaction was
+   abandoned before the reply arrived, the channel is not used again
+   until the reply is through or HID_TRANS_TIMEOUT has passed. */
+void
+channel_release (struct u2fh_channel *ch, int abandoned)
+{
+  struct u2fdevice *dev = ch->dev;
+
+  mutex_lock (&dev->io);
+  if (abandoned && ch != dev->bcast)
+    {
+      ch->draining = 1;
+      ch->drain_left = DRAIN_AWAIT_INIT;
+      ch->drain_until = monotonic_ms () + HID_TRANS_TIMEOUT;
+      while (ch->draining && ch->qhead < ch->qlen)
+	{
+	  U2FHID_FRAME frame;
+
+	  memcpy (&frame, ch->queue[ch->qhead++], sizeof (frame));
+	  channel_drain (ch, &frame);
+	}
+    }
+  channel_clear (ch);
+  ch->busy = 0;
+  dev->last_used = monotonic_ms ();
+  channel_freed (dev);
+  mutex_unlock (&dev->io);
+}
@@ -33,176 +33,246 @@
 #else
 #include <unistd.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <fcntl.h>
 #endif
 
-#ifdef __linux
-#include <linux/hidraw.h>
-#endif
+/* Take a reference to @dev, which keeps it from being freed while
+   it is used without devs->list_lock held. */
+void
+hold_device (struct u2fdevice *dev)
+{
+  refcount_inc (&dev->refs);
+}
 
-#ifdef __linux
-static uint32_t
-get_bytes (uint8_t * rpt, size_t len, size_t num_bytes, size_t cur)
+/* Drop a reference to @dev, freeing it with the last one. */
+void
+put_device (struct u2fdevice *dev)
 {
-  /* Return if there aren't enough bytes. */
-  if (cur + num_bytes >= len)
-    return 0;
+  if (refcount_dec (&dev->refs) != 0)
+    return;
 
-  if (num_bytes == 0)
-    return 0;
-  else if (num_bytes == 1)
-    {
-      return rpt[cur + 1];
-    }
-  else if (num_bytes == 2)
+  channels_done (dev);
+  if (dev->handle)
+    dev->transport->close (dev->handle);
+  mutex_destroy (&dev->io);
+  cond_destroy (&dev->freed);
+  free (dev->device_path);
+  free (dev->device_string);
+  free (dev);
+}
+
+/* Open the transport handle of @dev, which is not open yet or was
+   closed while idle.  Called with dev->io held. */
+int
+device_open (struct u2fdevice *dev)
+{
+  int rc;
+
+  rc = dev->transport->open (dev->devs, dev->device_path, &dev->handle);
+  if (rc != U2FH_OK)
     {
-      return (rpt[cur + 2] * 256 + rpt[cur + 1]);
+      dev->handle = NULL;
+      return rc;
     }
-  else
-    return 0;
+  dev->last_used = monotonic_ms ();
+  if (dev->ctx->debug)
+    u2fh_log (dev->ctx, "opened device %s", dev->device_path);
+
+  return U2FH_OK;
 }
 
+/* Close @dev if nothing has used it for @idle milliseconds before
+   @now.  Its channels go too, the next user opens the device and a
+   channel again.  Returns the milliseconds left before @dev is idle,
+   or -1 if it is closed. */
 static int
-get_usage (uint8_t * report_descriptor, size_t size,
-	   unsigned short *usage_page, unsigned short *usage)
+close_if_idle (struct u2fdevice *dev, uint64_t now, unsigned idle)
 {
-  size_t i = 0;
-  int size_code;
-  int data_len, key_size;
-  int usage_found = 0, usage_page_found = 0;
+  int left = -1;
+  size_t i;
 
-  while (i < size)
+  mutex_lock (&dev->io);
+  if (dev->handle == NULL)
+    {
+      mutex_unlock (&dev->io);
+      return -1;
+    }
+  if (dev->allocating)
+    left = idle;
+  for (i = 0; left < 0 && i < dev->nchannels; i++)
+    if (dev->channels[i]->busy)
+      left = idle;
+  if (left < 0 && dev->last_used + idle > now)
+    left = (int) (dev->last_used + idle - now);
+  if (left < 0)
     {
-      int key = report_descriptor[i];
-      int key_cmd = key & 0xfc;
+      if (dev->ctx->debug)
+	u2fh_log (dev->ctx, "closing idle device %s", dev->device_path);
+      channels_done (dev);
+      dev->transport->close (dev->handle);
+      dev->handle = NULL;
+    }
+  mutex_unlock (&dev->io);
 
-      if ((key & 0xf0) == 0xf0)
-	{
-	  fprintf (stderr, "invalid data received.\n");
-	  return -1;
-	}
-      else
-	{
-	  size_code = key & 0x3;
-	  switch (size_code)
-	    {
-	    case 0:
-	    case 1:
-	    case 2:
-	      data_len = size_code;
-	      break;
-	    case 3:
-	      data_len = 4;
-	      break;
-	    default:
-	      /* Can't ever happen since size_code is & 0x3 */
-	      data_len = 0;
-	      break;
-	    };
-	  key_size = 1;
-	}
+  return left;
+}
 
-      if (key_cmd == 0x4)
-	{
-	  *usage_page = get_bytes (report_descriptor, size, data_len, i);
-	  usage_page_found = 1;
-	}
-      if (key_cmd == 0x8)
-	{
-	  *usage = get_bytes (report_descriptor, size, data_len, i);
-	  usage_found = 1;
-	}
+/* Return the bucket of the path table of @devs for @path. */
+static size_t
+path_bucket (u2fh_devs * devs, const char *path)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+
+  while (*path)
+    h = (h ^ (unsigned char) *path++) * 16777619u;
+
+  return h & (devs->npaths - 1);
+}
 
-      if (usage_page_found && usage_found)
-	return 0;		/* success */
+/* Grow the path table of @devs to keep the chains short.  Called with
+   devs->list_lock held for writing. */
+static int
+grow_paths (u2fh_devs * devs)
+{
+  struct u2fdevice **old = devs->paths;
+  size_t oldn = devs->npaths, i;
+  size_t n = oldn ? oldn * 2 : 16;
 
-      i += data_len + key_size;
+  devs->paths = calloc (n, sizeof (*devs->paths));
+  if (devs->paths == NULL)
+    {
+      devs->paths = old;
+      return U2FH_MEMORY_ERROR;
     }
+  devs->npaths = n;
+  for (i = 0; i < oldn; i++)
+    while (old[i] != NULL)
+      {
+	struct u2fdevice *dev = old[i];
+	size_t b = path_bucket (devs, dev->device_path);
+
+	old[i] = dev->path_next;
+	dev->path_next = devs->paths[b];
+	devs->paths[b] = dev;
+      }
+  free (old);
 
-  return -1;			/* failure */
+  return U2FH_OK;
 }
-#endif
 
+/* Make room in the device table of @devs for @id, the highest id so
+   far.  Slots of devices removed below the lowest remaining one are
+   reused first.  Called with devs->list_lock held for writing. */
 static int
-get_usages (struct hid_device_info *dev, unsigned short *usage_page,
-	    unsigned short *usage)
+grow_table (u2fh_devs * devs, unsigned id)
 {
-#ifdef __linux
-  int res, desc_size;
-  int ret = U2FH_TRANSPORT_ERROR;
-  struct hidraw_report_descriptor rpt_desc;
-  int handle = open (dev->path, O_RDWR);
-  if (handle > 0)
-    {
-      memset (&rpt_desc, 0, sizeof (rpt_desc));
-      res = ioctl (handle, HIDIOCGRDESCSIZE, &desc_size);
-      if (res >= 0)
-	{
-	  rpt_desc.size = desc_size;
-	  res = ioctl (handle, HIDIOCGRDESC, &rpt_desc);
-	  if (res >= 0)
-	    {
-	      res =
-		get_usage (rpt_desc.value, rpt_desc.size, usage_page, usage);
-	      if (res >= 0)
-		{
-		  ret = U2FH_OK;
-		}
-	    }
-	}
-      close (handle);
+  size_t skip = 0;
+  size_t size;
+  void *table;
+
+  while (skip < devs->table_size && devs->table[skip] == NULL)
+    skip++;
+  if (skip == devs->table_size)
+    devs->base_id = id;
+  else if (skip > 0)
+    {
+      memmove (devs->table, devs->table + skip,
+	       (devs->table_size - skip) * sizeof (*devs->table));
+      memset (devs->table + devs->table_size - skip, 0,
+	      skip * sizeof (*devs->table));
+      devs->base_id += skip;
     }
-  return ret;
-#else
-  *usage_page = dev->usage_page;
-  *usage = dev->usage;
+  if (id - devs->base_id < devs->table_size)
+    return U2FH_OK;
+
+  size = devs->table_size ? devs->table_size : 16;
+  while (size <= id - devs->base_id)
+    size *= 2;
+  table = realloc (devs->table, size * sizeof (*devs->table));
+  if (table == NULL)
+    return U2FH_MEMORY_ERROR;
+  devs->table = table;
+  memset (devs->table + devs->table_size, 0,
+	  (size - devs->table_size) * sizeof (*devs->table));
+  devs->table_size = size;
+
   return U2FH_OK;
-#endif
 }
 
-static struct u2fdevice *
+/* Remove @dev from @devs and drop the reference held by the device
+   table.  Called with devs->list_lock held for writing. */
+static void
+unlink_device (u2fh_devs * devs, struct u2fdevice *dev)
+{
+  struct u2fdevice **p;
+
+  if (dev->id - devs->base_id >= devs->table_size
+      || devs->table[dev->id - devs->base_id] != dev)
+    return;
+  devs->table[dev->id - devs->base_id] = NULL;
+  devs->ndevices--;
+
+  for (p = &devs->paths[path_bucket (devs, dev->device_path)]; *p != NULL;
+       p = &(*p)->path_next)
+    if (*p == dev)
+      {
+	*p = dev->path_next;
+	break;
+      }
+
+  put_device (dev);
+}
+
+/* Remove @dev from @devs. */
+static void
 close_device (u2fh_devs * devs, struct u2fdevice *dev)
 {
-  struct u2fdevice *next = dev->next;
-  hid_close (dev->devh);
-  free (dev->device_path);
-  free (dev->device_string);
-  if (dev == devs->first)
-    {
-      devs->first = next;
-      free (dev);
-    }
-  else
-    {
-      struct u2fdevice *d;
-      for (d = devs->first; d != NULL; d = d->next)
-	{
-	  if (d->next == dev)
-	    {
-	      d->next = next;
-	      free (dev);
-	      break;
-	    }
-	}
-    }
-  return next;
+  rwlock_wrlock (&devs->list_lock);
+  unlink_device (devs, dev);
+  rwlock_wrunlock (&devs->list_lock);
 }
 
+/* Find device @id and take a reference to it, to be dropped with
+   put_device(). */
 struct u2fdevice *
 get_device (u2fh_devs * devs, unsigned id)
 {
-  struct u2fdevice *dev;
-  for (dev = devs->first; dev != NULL; dev = dev->next)
-    {
-      if (dev->id == id)
+  struct u2fdevice *dev = NULL;
+
+  rwlock_rdlock (&devs->list_lock);
+  if (id - devs->base_id < devs->table_size)
+    dev = devs->table[id - devs->base_id];
+  if (dev != NULL)
+    hold_device (dev);
+  rwlock_rdunlock (&devs->list_lock);
+
+  return dev;
+}
+
+/* Find the device at @path and take a reference to it. */
+static struct u2fdevice *
+find_device (u2fh_devs * devs, const char *path)
+{
+  struct u2fdevice *dev = NULL;
+
+  rwlock_rdlock (&devs->list_lock);
+  if (devs->npaths > 0)
+    for (dev = devs->paths[path_bucket (devs, path)]; dev != NULL;
+	 dev = dev->path_next)
+      if (strcmp (dev->device_path, path) == 0)
 	{
-	  return dev;
+	  hold_device (dev);
+	  break;
 	}
-    }
-  return NULL;
+  rwlock_rdunlock (&devs->list_lock);
+
+  return dev;
 }
 
+/* Allocate a device with the next free id.  It is not in the device
+   table until add_device() is called, which happens in order of the
+   ids. */
 static struct u2fdevice *
 new_device (u2fh_devs * devs)
 {
@@ -212,44 +282,325 @@ new_device (u2fh_devs * devs)
       return NULL;
     }
   memset (new, 0, sizeof (struct u2fdevice));
+  mutex_init (&new->io);
+  cond_init (&new->freed);
+  new->devs = devs;
+  new->ctx = devs->ctx;
+  new->refs = 1;
+  rwlock_wrlock (&devs->list_lock);
   new->id = devs->max_id++;
-  if (devs->first == NULL)
+  rwlock_wrunlock (&devs->list_lock);
+  return new;
+}
+
+/* Add @new, which has its path set, to @devs, which takes over its
+   reference. */
+static int
+add_device (u2fh_devs * devs, struct u2fdevice *new)
+{
+  size_t b;
+
+  rwlock_wrlock (&devs->list_lock);
+  if (grow_table (devs, new->id) != U2FH_OK
+      || (devs->ndevices >= devs->npaths && grow_paths (devs) != U2FH_OK))
     {
-      devs->first = new;
+      rwlock_wrunlock (&devs->list_lock);
+      return U2FH_MEMORY_ERROR;
     }
-  else
+  devs->table[new->id - devs->base_id] = new;
+  devs->ndevices++;
+  b = path_bucket (devs, new->device_path);
+  new->path_next = devs->paths[b];
+  devs->paths[b] = new;
+  rwlock_wrunlock (&devs->list_lock);
+
+  return U2FH_OK;
+}
+
+void
+free_devinfo (struct u2fh_devinfo *list)
+{
+  while (list)
     {
-      struct u2fdevice *dev;
-      for (dev = devs->first; dev != NULL; dev = dev->next)
+      struct u2fh_devinfo *next = list->next;
+      free (list->path);
+      free (list->product);
+      free (list);
+      list = next;
+    }
+}
+
+/* The devices of 70-u2f.rules, each product listed on its own. */
+static const u2fh_usbid known_devices[] = {
+  {0x1050, 0x0113, 0}, {0x1050, 0x0114, 0}, {0x1050, 0x0115, 0},
+  {0x1050, 0x0116, 0}, {0x1050, 0x0120, 0}, {0x1050, 0x0121, 0},
+  {0x1050, 0x0200, 0}, {0x1050, 0x0402, 0}, {0x1050, 0x0403, 0},
+  {0x1050, 0x0406, 0}, {0x1050, 0x0407, 0}, {0x1050, 0x0410, 0},
+  {0x2581, 0xf1d0, 0}, {0x1e0d, 0xf1d0, 0}, {0x1e0d, 0xf1ae, 0},
+  {0x096e, 0x0880, 0}, {0x2ccf, 0x0880, 0}, {0x096e, 0x0850, 0},
+  {0x096e, 0x0852, 0}, {0x096e, 0x0853, 0}, {0x096e, 0x0854, 0},
+  {0x096e, 0x0856, 0}, {0x096e, 0x0858, 0}, {0x096e, 0x085a, 0},
+  {0x096e, 0x085b, 0}, {0x096e, 0x085d, 0}, {0x096e, 0x0866, 0},
+  {0x096e, 0x0867, 0}, {0x24dc, 0x0101, 0}, {0x24dc, 0x0501, 0},
+  {0x10c4, 0x8acf, 0}, {0x1a44, 0x00bb, 0}, {0x2abe, 0x1002, 0},
+  {0x1ea8, 0xf025, 0}, {0x20a0, 0x4287, 0}, {0x20a0, 0x42b1, 0},
+  {0x20a0, 0x42b3, 0}, {0x18d1, 0x5026, 0}, {0x0483, 0xcdab, 0},
+  {0x0483, 0xa2ca, 0}, {0x1209, 0x5070, 0}, {0x1209, 0x50b0, 0},
+  {0x534c, 0x0001, 0}, {0x1209, 0x53c1, 0}, {0x058b, 0x022d, 0},
+  {0x2c97, 0x0000, 0}, {0x2c97, 0x0001, 0}, {0x2c97, 0x0004, 0},
+  {0x2c97, 0x0005, 0}, {0x2c97, 0x0015, 0}, {0x2c97, 0x1005, 0},
+  {0x2c97, 0x1015, 0}, {0x2c97, 0x4005, 0}, {0x2c97, 0x4015, 0},
+  {0x06cb, 0x0088, 0}, {0x4c4d, 0xf703, 0}, {0x311f, 0x4a1a, 0},
+  {0x311f, 0x4c2a, 0}, {0x311f, 0x5c2f, 0}, {0x311f, 0xf47c, 0},
+  {0x1d50, 0x60fc, 0}, {0x1fc9, 0xf143, 0}, {0x0483, 0xa2ac, 0}
+};
+
+/**
+ * u2fh_known_devices:
+ * @n: output variable for the number of entries returned.
+ *
+ * Get the USB device models listed in the udev rules that come with
+ * the library, for use as the ids of a #u2fh_devfilter.
+ *
+ * Returns: a static array of @n entries.
+ */
+const u2fh_usbid *
+u2fh_known_devices (size_t * n)
+{
+  *n = sizeof (known_devices) / sizeof (known_devices[0]);
+  return known_devices;
+}
+
+/* Match @s against the shell pattern @glob of "*" and "?". */
+static int
+glob_match (const char *glob, const char *s)
+{
+  const char *star = NULL, *back = NULL;
+
+  while (*s)
+    {
+      if (*glob == '*')
 	{
-	  if (dev->next == NULL)
-	    {
-	      break;
-	    }
+	  star = ++glob;
+	  back = s;
+	}
+      else if (*glob != '\0' && (*glob == '?' || *glob == *s))
+	{
+	  glob++;
+	  s++;
 	}
-      dev->next = new;
+      else if (star != NULL)
+	{
+	  glob = star;
+	  s = ++back;
+	}
+      else
+	return 0;
     }
-  return new;
+  while (*glob == '*')
+    glob++;
+
+  return *glob == '\0';
+}
+
+/* Tell whether the filter of @devs accepts the device at @path.
+   Transports check this first, before looking at the device.  Called
+   with devs->discover_lock held, as are the other filter functions. */
+int
+filter_path (u2fh_devs * devs, const char *path)
+{
+  return devs->filter.path_glob == NULL
+    || glob_match (devs->filter.path_glob, path);
+}
+
+/* Tell whether the filter of @devs looks at USB ids or serials, so
+   that transports need to find them out for filter_ids(). */
+int
+filter_wants_ids (u2fh_devs * devs)
+{
+  return devs->filter.ids != NULL || devs->filter.serial != NULL;
+}
+
+/* Tell whether the filter of @devs accepts a device with the given
+   USB ids and @serial, which may be NULL if unknown. */
+int
+filter_ids (u2fh_devs * devs, unsigned short vendor_id,
+	    unsigned short product_id, const char *serial)
+{
+  size_t i;
+
+  if (devs->filter.serial != NULL
+      && (serial == NULL || strcmp (devs->filter.serial, serial) != 0))
+    return 0;
+  if (devs->filter.ids == NULL)
+    return 1;
+  for (i = 0; i < devs->filter.nids; i++)
+    if (devs->filter.ids[i].vendor_id == vendor_id
+	&& (devs->filter.ids[i].any_product
+	    || devs->filter.ids[i].product_id == product_id))
+      return 1;
+
+  return 0;
+}
+
+/* Store in @vendor_id and @product_id the ids every device accepted
+   by the filter of @devs has, or 0 where they differ. */
+void
+filter_usb_hint (u2fh_devs * devs, unsigned short *vendor_id,
+		 unsigned short *product_id)
+{
+  size_t i;
+
+  *vendor_id = *product_id = 0;
+  if (devs->filter.ids == NULL || devs->filter.nids == 0)
+    return;
+  *vendor_id = devs->filter.ids[0].vendor_id;
+  *product_id = devs->filter.ids[0].product_id;
+  for (i = 0; i < devs->filter.nids; i++)
+    {
+      if (devs->filter.ids[i].vendor_id != *vendor_id)
+	{
+	  *vendor_id = *product_id = 0;
+	  return;
+	}
+      if (devs->filter.ids[i].any_product
+	  || devs->filter.ids[i].product_id != *product_id)
+	*product_id = 0;
+    }
+}
+
+static void
+free_filter (u2fh_devfilter * filter)
+{
+  free ((void *) filter->ids);
+  free ((void *) filter->serial);
+  free ((void *) filter->path_glob);
+  memset (filter, 0, sizeof (*filter));
+}
+
+/**
+ * u2fh_devs_set_filter:
+ * @devs: device handle, from u2fh_devs_init().
+ * @filter: the devices to consider, or %NULL for all.
+ *
+ * Restrict the devices that u2fh_devs_discover() and
+ * u2fh_devs_update() open.  Devices whose USB ids, serial number or
+ * path do not match are skipped before their report descriptor is
+ * read, which makes discovery fast and predictable when only a known
+ * set of keys is used.  Devices already open that no longer match,
+ * or are over @max_devices, are released by the next discovery.
+ * @filter is copied.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, or
+ *   %U2FH_MEMORY_ERROR.
+ */
+u2fh_rc
+u2fh_devs_set_filter (u2fh_devs * devs, const u2fh_devfilter * filter)
+{
+  u2fh_devfilter copy;
+
+  memset (&copy, 0, sizeof (copy));
+  if (filter != NULL)
+    {
+      copy.nids = filter->nids;
+      copy.max_devices = filter->max_devices;
+      if (filter->ids != NULL)
+	{
+	  u2fh_usbid *ids = malloc ((filter->nids ? filter->nids : 1)
+				    * sizeof (*ids));
+	  if (ids != NULL)
+	    memcpy (ids, filter->ids, filter->nids * sizeof (*ids));
+	  copy.ids = ids;
+	}
+      if (filter->serial != NULL)
+	copy.serial = strdup (filter->serial);
+      if (filter->path_glob != NULL)
+	copy.path_glob = strdup (filter->path_glob);
+      if ((filter->ids != NULL && copy.ids == NULL)
+	  || (filter->serial != NULL && copy.serial == NULL)
+	  || (filter->path_glob != NULL && copy.path_glob == NULL))
+	{
+	  free_filter (&copy);
+	  return U2FH_MEMORY_ERROR;
+	}
+    }
+
+  mutex_lock (&devs->discover_lock);
+  free_filter (&devs->filter);
+  devs->filter = copy;
+  mutex_unlock (&devs->discover_lock);
+
+  return U2FH_OK;
+}
+
+int
+add_transport (u2fh_devs * devs, const struct u2fh_transport *transport)
+{
+  size_t i;
+  int rc;
+
+  for (i = 0; i < devs->ntransports; i++)
+    if (devs->transports[i] == transport)
+      return U2FH_OK;
+
+  if (devs->ntransports == MAX_TRANSPORTS)
+    return U2FH_MEMORY_ERROR;
+
+  rc = transport->init (devs);
+  if (rc != U2FH_OK)
+    return rc;
+
+  devs->transports[devs->ntransports++] = transport;
+
+  return U2FH_OK;
+}
+
+/* Collect the devices of all transports into one list. */
+static int
+enumerate_devices (u2fh_devs * devs, struct u2fh_devinfo **list)
+{
+  struct u2fh_devinfo **tail = list;
+  size_t i;
+
+  *list = NULL;
+  for (i = 0; i < devs->ntransports; i++)
+    {
+      int rc = devs->transports[i]->enumerate (devs, tail);
+      if (rc != U2FH_OK)
+	{
+	  free_devinfo (*list);
+	  *list = NULL;
+	  return rc;
+	}
+      while (*tail != NULL)
+	{
+	  (*tail)->transport = devs->transports[i];
+	  tail = &(*tail)->next;
+	}
+    }
+
+  return U2FH_OK;
 }
 
 static void
 close_devices (u2fh_devs * devs)
 {
-  struct u2fdevice *dev;
+  size_t i;
+
   if (devs == NULL)
     {
       return;
     }
-  dev = devs->first;
 
-  while (dev)
-    {
-      dev = close_device (devs, dev);
-    }
+  rwlock_wrlock (&devs->list_lock);
+  for (i = 0; i < devs->table_size; i++)
+    if (devs->table[i] != NULL)
+      unlink_device (devs, devs->table[i]);
+  rwlock_wrunlock (&devs->list_lock);
 }
 
 #ifdef _WIN32
-static int
+int
 obtain_nonce(unsigned char* nonce)
 {
   NTSTATUS status;
@@ -263,7 +614,7 @@ obtain_nonce(unsigned char* nonce)
   return (0);
 }
 #elif defined(HAVE_DEV_URANDOM)
-static int
+int
 obtain_nonce(unsigned char* nonce)
 {
   int     fd = -1;
@@ -286,49 +637,175 @@ obtain_nonce(unsigned char* nonce)
 #error "please provide an implementation of obtain_nonce() for your platform"
 #endif /* _WIN32 */
 
+/* A device being opened by discovery. */
+struct pending_device
+{
+  struct u2fdevice *dev;
+  const struct u2fh_devinfo *info;
+  struct channel_open op;
+};
+
+/* Set the path and description of @dev from @info. */
 static int
-init_device (u2fh_devs * devs, struct u2fdevice *dev)
+set_device_info (u2fh_devs * devs, struct u2fdevice *dev,
+		 const struct u2fh_devinfo *info)
 {
-  unsigned char resp[1024];
-  unsigned char nonce[8];
-  if (obtain_nonce(nonce) != 0)
+  dev->device_path = strdup (info->path);
+  if (dev->device_path == NULL)
+    return U2FH_MEMORY_ERROR;
+  if (info->product)
     {
-      return U2FH_TRANSPORT_ERROR;
+      dev->device_string = strdup (info->product);
+      if (dev->device_string == NULL)
+	return U2FH_MEMORY_ERROR;
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "device %s discovered as '%s'",
+		  dev->device_path, dev->device_string);
+      if (devs->ctx->debug && dev->handle != NULL)
+	{
+	  u2fh_log (devs->ctx,
+		    "  version (Interface, Major, "
+		    "Minor, Build): %d, %d, "
+		    "%d, %d  capFlags: %d",
+		    dev->versionInterface,
+		    dev->versionMajor,
+		    dev->versionMinor, dev->versionBuild, dev->capFlags);
+	}
     }
-  size_t resplen = sizeof (resp);
-  dev->cid = CID_BROADCAST;
 
-  if (u2fh_sendrecv
-      (devs, dev->id, U2FHID_INIT, nonce, sizeof (nonce), resp,
-       &resplen) == U2FH_OK)
+  return U2FH_OK;
+}
+
+/* Add the @n devices described by @infos to @devs without opening
+   them, for %U2FH_LAZY_OPEN and for devices plugged in.
+   channel_open_start() opens each one when it is first used.
+   Returns the number of devices added, or %U2FH_MEMORY_ERROR. */
+static int
+add_closed_devices (u2fh_devs * devs, const struct u2fh_devinfo **infos,
+		    size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
     {
-      int offs = sizeof (nonce);
-      /* the response has to be at least 17 bytes, if it's less we discard it */
-      if (resplen < 17)
+      struct u2fdevice *dev = new_device (devs);
+
+      if (dev == NULL)
+	return U2FH_MEMORY_ERROR;
+      dev->transport = infos[i]->transport;
+      dev->seen = devs->discover_gen;
+      if (set_device_info (devs, dev, infos[i]) != U2FH_OK
+	  || add_device (devs, dev) != U2FH_OK)
 	{
-	  return U2FH_SIZE_ERROR;
+	  put_device (dev);
+	  return U2FH_MEMORY_ERROR;
 	}
+    }
 
-      /* incoming and outgoing nonce has to match */
-      if (memcmp (nonce, resp, sizeof (nonce)) != 0)
+  return (int) n;
+}
+
+/* Open the @n devices described by @infos and add those answering
+   U2FHID_INIT to @devs.  The devices are all asked at once, so this
+   takes about as long as the slowest of them.  Returns the number of
+   devices added, or %U2FH_MEMORY_ERROR. */
+static int
+open_devices (u2fh_devs * devs, const struct u2fh_devinfo **infos, size_t n)
+{
+  uint64_t deadline = monotonic_ms () + HID_TRANS_TIMEOUT;
+  struct pending_device *pd;
+  struct u2fh_xfer **busy;
+  size_t i, nbusy;
+  int rc = U2FH_OK;
+  int added = 0;
+
+  if (n == 0)
+    return 0;
+  if (devs->ctx->flags & U2FH_LAZY_OPEN)
+    return add_closed_devices (devs, infos, n);
+  pd = calloc (n, sizeof (*pd));
+  busy = calloc (n, sizeof (*busy));
+  if (pd == NULL || busy == NULL)
+    {
+      free (pd);
+      free (busy);
+      return U2FH_MEMORY_ERROR;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      struct u2fdevice *dev = new_device (devs);
+
+      if (dev == NULL)
 	{
-	  return U2FH_TRANSPORT_ERROR;
+	  rc = U2FH_MEMORY_ERROR;
+	  break;
 	}
+      dev->transport = infos[i]->transport;
+      if (dev->transport->open (devs, infos[i]->path, &dev->handle)
+	  != U2FH_OK
+	  || channel_open_start (&pd[i].op, dev, deadline) != U2FH_OK)
+	{
+	  put_device (dev);
+	  continue;
+	}
+      pd[i].dev = dev;
+      pd[i].info = infos[i];
+    }
 
-
-      memcpy((uint8_t*)&dev->cid, resp + offs, sizeof(dev->cid));
-      offs += 4;
-      dev->versionInterface = resp[offs++];
-      dev->versionMajor = resp[offs++];
-      dev->versionMinor = resp[offs++];
-      dev->versionBuild = resp[offs++];
-      dev->capFlags = resp[offs++];
+  for (;;)
+    {
+      nbusy = 0;
+      for (i = 0; i < n; i++)
+	if (pd[i].dev != NULL && pd[i].op.x.state == XFER_BUSY)
+	  busy[nbusy++] = &pd[i].op.x;
+      if (nbusy == 0)
+	break;
+      xfer_wait (busy, nbusy, deadline, -1);
     }
-  else
+
+  for (i = 0; i < n; i++)
     {
-      return U2FH_TRANSPORT_ERROR;
+      struct u2fdevice *dev = pd[i].dev;
+      struct u2fh_channel *ch;
+
+      if (dev == NULL)
+	continue;
+      if (channel_open_finish (&pd[i].op, &ch) != U2FH_OK)
+	{
+	  put_device (dev);
+	  continue;
+	}
+      channel_release (ch, 0);
+      dev->seen = devs->discover_gen;
+      if (rc == U2FH_MEMORY_ERROR
+	  || set_device_info (devs, dev, pd[i].info) != U2FH_OK
+	  || add_device (devs, dev) != U2FH_OK)
+	{
+	  rc = U2FH_MEMORY_ERROR;
+	  put_device (dev);
+	  continue;
+	}
+      added++;
     }
-  return U2FH_OK;
+
+  free (pd);
+  free (busy);
+
+  return rc == U2FH_OK ? added : rc;
+}
+
+/* Tell whether @dev has its transport handle open. */
+static int
+device_is_open (struct u2fdevice *dev)
+{
+  int open;
+
+  mutex_lock (&dev->io);
+  open = dev->handle != NULL;
+  mutex_unlock (&dev->io);
+
+  return open;
 }
 
 static int
@@ -346,7 +823,13 @@ ping_device (u2fh_devs * devs, unsigned index)
  * u2fh_devs_init:
  * @devs: pointer to #u2fh_devs type to initialize.
  *
- * Initialize device handle.
+ * Initialize device handle, configured by u2fh_global_init().
+ *
+ * A device handle may be shared by several threads.  All functions
+ * taking it can be called concurrently, except u2fh_devs_done(),
+ * which must only be called once no other call is using the handle.
+ * A device that u2fh_devs_discover() finds unplugged is released
+ * once the operations using it have finished.
  *
  * Returns: On success %U2FH_OK (integer 0) is returned, on memory
  * allocation errors %U2FH_MEMORY_ERROR is returned, or another
@@ -354,21 +837,54 @@ ping_device (u2fh_devs * devs, unsigned index)
  */
 u2fh_rc
 u2fh_devs_init (u2fh_devs ** devs)
+{
+  return u2fh_devs_init2 (devs, NULL);
+}
+
+/**
+ * u2fh_devs_init2:
+ * @devs: pointer to #u2fh_devs type to initialize.
+ * @ctx: the context to configure the device handle, from
+ *   u2fh_ctx_init(), or %NULL for the one of u2fh_global_init().
+ *
+ * Initialize device handle like u2fh_devs_init() does, but following
+ * the configuration of @ctx.  The context must stay valid until the
+ * device handle is released.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, on memory
+ * allocation errors %U2FH_MEMORY_ERROR is returned, or another
+ * #u2fh_rc error code is returned.
+ */
+u2fh_rc
+u2fh_devs_init2 (u2fh_devs ** devs, u2fh_ctx * ctx)
 {
   u2fh_devs *d;
-  int rc;
+  int rc = U2FH_OK;
 
   d = malloc (sizeof (*d));
   if (d == NULL)
     return U2FH_MEMORY_ERROR;
 
   memset (d, 0, sizeof (*d));
+  d->ctx = ctx ? ctx : &default_ctx;
+  d->monitor_fd = -1;
+  mutex_init (&d->lock);
+  mutex_init (&d->discover_lock);
+  rwlock_init (&d->list_lock);
 
-  rc = hid_init ();
-  if (rc != 0)
+  if (!(d->ctx->flags & U2FH_NO_HID))
+#ifdef USE_HIDRAW
+    rc = add_transport (d, &hidraw_transport);
+#else
+    rc = add_transport (d, &hidapi_transport);
+#endif
+  if (rc != U2FH_OK)
     {
+      mutex_destroy (&d->lock);
+      mutex_destroy (&d->discover_lock);
+      rwlock_destroy (&d->list_lock);
       free (d);
-      return U2FH_TRANSPORT_ERROR;
+      return rc;
     }
 
   *devs = d;
@@ -385,7 +901,11 @@ u2fh_devs_init (u2fh_devs ** devs)
  *
  * Discover and open new devices.  This function can safely be called
  * several times and will free resources associated with unplugged
- * devices and open new.
+ * devices and open new.  It may run while other threads use the
+ * devices; calls running at the same time are serialized.  With
+ * %U2FH_LAZY_OPEN new devices are only recorded, and devices are
+ * opened when first used.  Devices idle for longer than set with
+ * u2fh_ctx_set_idle_timeout() are closed.
  *
  * Returns: On success, %U2FH_OK (integer 0) is returned, when no U2F
  *   device could be found %U2FH_NO_U2F_DEVICE is returned, or another
@@ -394,132 +914,325 @@ u2fh_devs_init (u2fh_devs ** devs)
 u2fh_rc
 u2fh_devs_discover (u2fh_devs * devs, unsigned *max_index)
 {
-  struct hid_device_info *di, *cur_dev;
+  struct u2fh_devinfo *di, *cur_dev;
+  const struct u2fh_devinfo **todo = NULL;
+  size_t ntodo = 0;
+  unsigned nalive = 0;
   u2fh_rc res = U2FH_NO_U2F_DEVICE;
   struct u2fdevice *dev;
+  size_t i;
+  int rc;
+
+  u2fh_devs_close_idle (devs, NULL);
+
+  mutex_lock (&devs->discover_lock);
+  devs->discover_gen++;
+  rc = enumerate_devices (devs, &di);
+  if (rc != U2FH_OK)
+    {
+      mutex_unlock (&devs->discover_lock);
+      return rc;
+    }
 
-  di = hid_enumerate (0, 0);
   for (cur_dev = di; cur_dev; cur_dev = cur_dev->next)
+    ntodo++;
+  if (ntodo > 0 && (todo = calloc (ntodo, sizeof (*todo))) == NULL)
     {
-      int found = 0;
-      unsigned short usage_page = 0, usage = 0;
+      res = U2FH_MEMORY_ERROR;
+      goto out;
+    }
 
+  ntodo = 0;
+  for (cur_dev = di; cur_dev; cur_dev = cur_dev->next)
+    {
       /* check if we already opened this device */
-      for (dev = devs->first; dev != NULL; dev = dev->next)
+      dev = find_device (devs, cur_dev->path);
+      if (dev != NULL)
 	{
-	  if (strcmp (dev->device_path, cur_dev->path) == 0)
+	  int alive;
+
+	  if (devs->filter.max_devices && nalive >= devs->filter.max_devices)
 	    {
-	      if (ping_device (devs, dev->id) == U2FH_OK)
-		{
-		  found = 1;
-		  res = U2FH_OK;
-		}
-	      else
-		{
-		  if (debug)
-		    {
-		      fprintf (stderr, "Device %s failed ping, dead.\n",
-			       dev->device_path);
-		    }
-		  close_device (devs, dev);
-		}
-	      break;
+	      /* over the limit, released below */
+	      put_device (dev);
+	      continue;
 	    }
-	}
-      if (found)
-	{
-	  continue;
-	}
-
-      get_usages (cur_dev, &usage_page, &usage);
-      if (usage_page == FIDO_USAGE_PAGE && usage == FIDO_USAGE_U2FHID)
-	{
-	  dev = new_device (devs);
-	  if (dev == NULL)
+	  /* a closed device is there if it is enumerated */
+	  alive = !device_is_open (dev)
+	    || ping_device (devs, dev->id) == U2FH_OK;
+	  if (alive)
 	    {
-	      res = U2FH_MEMORY_ERROR;
-	      goto out;
+	      dev->seen = devs->discover_gen;
+	      nalive++;
+	      res = U2FH_OK;
 	    }
-	  dev->devh = hid_open_path (cur_dev->path);
-	  if (dev->devh != NULL)
+	  else
 	    {
-	      dev->device_path = strdup (cur_dev->path);
-	      if (dev->device_path == NULL)
+	      if (devs->ctx->debug)
 		{
-		  close_device (devs, dev);
-		  goto out;
-		}
-	      if (init_device (devs, dev) == U2FH_OK)
-		{
-		  if (cur_dev->product_string)
-		    {
-		      size_t len =
-			wcstombs (NULL, cur_dev->product_string, 0);
-		      dev->device_string = malloc (len + 1);
-		      if (dev->device_string == NULL)
-			{
-			  close_device (devs, dev);
-			  goto out;
-			}
-		      memset (dev->device_string, 0, len + 1);
-		      wcstombs (dev->device_string, cur_dev->product_string,
-				len);
-		      if (debug)
-			{
-			  fprintf (stderr, "device %s discovered as '%s'\n",
-				   dev->device_path, dev->device_string);
-			  fprintf (stderr,
-				   "  version (Interface, Major, "
-				   "Minor, Build): %d, %d, "
-				   "%d, %d  capFlags: %d\n",
-				   dev->versionInterface,
-				   dev->versionMajor,
-				   dev->versionMinor,
-				   dev->versionBuild, dev->capFlags);
-			}
-		    }
-		  res = U2FH_OK;
-		  continue;
+		  u2fh_log (devs->ctx, "Device %s failed ping, dead.",
+			    dev->device_path);
 		}
+	      close_device (devs, dev);
 	    }
-	  close_device (devs, dev);
+	  put_device (dev);
+	  if (alive)
+	    continue;
 	}
+
+      /* opened below, all together */
+      todo[ntodo++] = cur_dev;
     }
 
+  if (devs->filter.max_devices)
+    {
+      unsigned room = devs->filter.max_devices > nalive ?
+	devs->filter.max_devices - nalive : 0;
 
-  /* loop through all open devices and make sure we find them in the enumeration */
-  dev = devs->first;
-  while (dev)
+      if (ntodo > room)
+	ntodo = room;
+    }
+
+  rc = open_devices (devs, todo, ntodo);
+  if (rc == U2FH_MEMORY_ERROR)
     {
-      int found = 0;
+      res = rc;
+      goto out;
+    }
+  if (rc > 0)
+    res = U2FH_OK;
 
-      for (cur_dev = di; cur_dev; cur_dev = cur_dev->next)
+  /* release the devices that are no longer enumerated */
+  rwlock_wrlock (&devs->list_lock);
+  for (i = 0; i < devs->table_size; i++)
+    {
+      dev = devs->table[i];
+      if (dev != NULL && dev->seen != devs->discover_gen)
 	{
-	  if (strcmp (cur_dev->path, dev->device_path) == 0)
+	  if (devs->ctx->debug)
 	    {
-	      found = 1;
-	      dev = dev->next;
-	      break;
+	      u2fh_log (devs->ctx, "device %s looks dead.", dev->device_path);
 	    }
+	  unlink_device (devs, dev);
 	}
-      if (!found)
+    }
+  rwlock_wrunlock (&devs->list_lock);
+
+out:
+  free (todo);
+  free_devinfo (di);
+  if (res == U2FH_OK && max_index)
+    {
+      rwlock_rdlock (&devs->list_lock);
+      *max_index = devs->max_id - 1;
+      rwlock_rdunlock (&devs->list_lock);
+    }
+  mutex_unlock (&devs->discover_lock);
+
+  return res;
+}
+
+/* Add the device node @path that was plugged in, with whichever
+   transports recognize it.  The device is opened and sent its INIT
+   by the first operation using it, so nothing waits for it here. */
+static int
+add_node (u2fh_devs * devs, const char *path)
+{
+  struct u2fh_devinfo *di = NULL, **tail = &di, *cur_dev;
+  const struct u2fh_devinfo **todo;
+  size_t i, n = 0;
+  int rc = U2FH_OK;
+
+  for (i = 0; i < devs->ntransports && rc == U2FH_OK; i++)
+    {
+      const struct u2fh_transport *transport = devs->transports[i];
+
+      if (transport->probe == NULL)
+	continue;
+      rc = transport->probe (devs, path, tail);
+      for (; *tail != NULL; tail = &(*tail)->next, n++)
+	(*tail)->transport = transport;
+    }
+
+  if (rc == U2FH_OK && n > 0)
+    {
+      todo = calloc (n, sizeof (*todo));
+      if (todo == NULL)
+	rc = U2FH_MEMORY_ERROR;
+      else
 	{
-	  if (debug)
+	  for (cur_dev = di, n = 0; cur_dev; cur_dev = cur_dev->next)
+	    todo[n++] = cur_dev;
+	  if (devs->filter.max_devices)
 	    {
-	      fprintf (stderr, "device %s looks dead.\n", dev->device_path);
+	      size_t room;
+
+	      rwlock_rdlock (&devs->list_lock);
+	      room = devs->filter.max_devices > devs->ndevices ?
+		devs->filter.max_devices - devs->ndevices : 0;
+	      rwlock_rdunlock (&devs->list_lock);
+	      if (n > room)
+		n = room;
 	    }
-	  dev = close_device (devs, dev);
+	  if (add_closed_devices (devs, todo, n) == U2FH_MEMORY_ERROR)
+	    rc = U2FH_MEMORY_ERROR;
+	  free (todo);
 	}
     }
+  free_devinfo (di);
 
-out:
-  hid_free_enumeration (di);
-  if (res == U2FH_OK && max_index)
+  return rc;
+}
+
+/**
+ * u2fh_devs_monitor:
+ * @devs: device handle, from u2fh_devs_init().
+ * @fd: output variable for the file descriptor to poll.
+ *
+ * Start watching for devices being plugged in and out.  When @fd
+ * polls readable, call u2fh_devs_update() to take the changes into
+ * account.  Call this function before u2fh_devs_discover() so that
+ * no change in between is missed.  The events come from udev, so
+ * only Linux is supported.  The descriptor is closed by
+ * u2fh_devs_done().
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, or
+ *   %U2FH_TRANSPORT_ERROR if events cannot be received.
+ */
+u2fh_rc
+u2fh_devs_monitor (u2fh_devs * devs, int *fd)
+{
+  int rc = U2FH_OK;
+
+  mutex_lock (&devs->discover_lock);
+  if (devs->monitor_fd < 0)
+    rc = hotplug_open (&devs->monitor_fd);
+  *fd = devs->monitor_fd;
+  mutex_unlock (&devs->discover_lock);
+
+  return rc;
+}
+
+/**
+ * u2fh_devs_update:
+ * @devs: device handle, from u2fh_devs_init().
+ * @max_index: will on return be set to the maximum index, may be
+ *   NULL, as for u2fh_devs_discover().
+ *
+ * Apply the changes reported since u2fh_devs_monitor() was called or
+ * this function last ran.  Only devices that were plugged in are
+ * added, and only devices that were unplugged are released; the
+ * others are left alone.  Devices plugged in are not opened here but
+ * by the first operation using them, as with %U2FH_LAZY_OPEN, so
+ * this function does not wait for them.  Recognizing a device with
+ * the hidapi transport enumerates the HID devices, which takes a few
+ * milliseconds.  If events were lost the devices are discovered
+ * again with u2fh_devs_discover(), which blocks while they answer.
+ *
+ * Returns: %U2FH_OK (integer 0) if there is a device, when no U2F
+ *   device is left %U2FH_NO_U2F_DEVICE is returned, or another
+ *   #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_devs_update (u2fh_devs * devs, unsigned *max_index)
+{
+  char action[32], path[512];
+  u2fh_rc res = U2FH_OK;
+  int rc = 0;
+
+  u2fh_devs_close_idle (devs, NULL);
+
+  mutex_lock (&devs->discover_lock);
+  while (devs->monitor_fd >= 0
+	 && (rc = hotplug_next (devs->monitor_fd, action, sizeof (action),
+				path, sizeof (path))) == 1)
+    {
+      int added = strcmp (action, "add") == 0;
+      struct u2fdevice *dev;
+
+      if (!added && strcmp (action, "remove") != 0)
+	continue;
+
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "hotplug: %s %s", action, path);
+
+      /* a node that is added again belongs to another device now */
+      dev = find_device (devs, path);
+      if (dev != NULL)
+	{
+	  close_device (devs, dev);
+	  put_device (dev);
+	}
+
+      if (added && (res = add_node (devs, path)) != U2FH_OK)
+	break;
+    }
+  mutex_unlock (&devs->discover_lock);
+
+  if (res != U2FH_OK)
+    return res;
+  if (rc < 0)
+    {
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "hotplug events lost, discovering again");
+      return u2fh_devs_discover (devs, max_index);
+    }
+
+  rwlock_rdlock (&devs->list_lock);
+  if (devs->ndevices == 0)
+    res = U2FH_NO_U2F_DEVICE;
+  else if (max_index)
     *max_index = devs->max_id - 1;
+  rwlock_rdunlock (&devs->list_lock);
 
   return res;
 }
 
+/**
+ * u2fh_devs_close_idle:
+ * @devs: device handle, from u2fh_devs_init().
+ * @timeout: output variable for the milliseconds until the next
+ *   device becomes idle, or -1 if no device is open; may be NULL.
+ *
+ * Close the devices that have not been used for the time set with
+ * u2fh_ctx_set_idle_timeout(), releasing their descriptors.  They
+ * stay in @devs under the same index and are opened again when next
+ * used.  u2fh_devs_discover() and u2fh_devs_update() call this
+ * function as well; a process that sits idle can call it again after
+ * @timeout milliseconds.  Nothing is closed if no idle timeout is
+ * set.
+ *
+ * Returns: %U2FH_OK (integer 0).
+ */
+u2fh_rc
+u2fh_devs_close_idle (u2fh_devs * devs, int *timeout)
+{
+  unsigned idle = devs->ctx->idle_timeout;
+  uint64_t now = monotonic_ms ();
+  int next = -1;
+  size_t i;
+
+  if (idle > 0)
+    {
+      rwlock_rdlock (&devs->list_lock);
+      for (i = 0; i < devs->table_size; i++)
+	{
+	  int left;
+
+	  if (devs->table[i] == NULL)
+	    continue;
+	  left = close_if_idle (devs->table[i], now, idle);
+	  if (left >= 0 && (next < 0 || left < next))
+	    next = left;
+	}
+      rwlock_rdunlock (&devs->list_lock);
+    }
+  if (timeout)
+    *timeout = next;
+
+  return U2FH_OK;
+}
+
 /**
  * u2fh_devs_done:
  * @devs: device handle, from u2fh_devs_init().
@@ -530,9 +1243,24 @@ out:
 void
 u2fh_devs_done (u2fh_devs * devs)
 {
+  if (devs == NULL)
+    return;
+
   close_devices (devs);
-  hid_exit ();
+  hotplug_close (devs->monitor_fd);
+  while (devs->ntransports > 0)
+    devs->transports[--devs->ntransports]->exit (devs);
+#ifdef __linux
+  hidraw_usages_done (devs);
+#endif
 
+  mutex_destroy (&devs->lock);
+  mutex_destroy (&devs->discover_lock);
+  rwlock_destroy (&devs->list_lock);
+  free_filter (&devs->filter);
+  kh_cache_done (devs);
+  free (devs->table);
+  free (devs->paths);
   free (devs);
 }
 
@@ -566,9 +1294,11 @@ u2fh_get_device_description (u2fh_devs * devs, unsigned index, char *out,
     }
   else
     {
+      put_device (dev);
       return U2FH_MEMORY_ERROR;
     }
   strcpy (out, dev->device_string);
+  put_device (dev);
   return U2FH_OK;
 }
 
@@ -584,7 +1314,10 @@ u2fh_get_device_description (u2fh_devs * devs, unsigned index, char *out,
 int
 u2fh_is_alive (u2fh_devs * devs, unsigned index)
 {
-  if (!get_device (devs, index))
+  struct u2fdevice *dev = get_device (devs, index);
+
+  if (!dev)
     return 0;
+  put_device (dev);
   return 1;
 }
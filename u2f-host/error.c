@@ -37,6 +37,8 @@ static const err_t errors[] = {
   ERR (U2FH_AUTHENTICATOR_ERROR, "authenticator error"),
   ERR (U2FH_TIMEOUT_ERROR, "timeout error"),
   ERR (U2FH_SIZE_ERROR, "size error, buffer to small"),
+  ERR (U2FH_AGAIN, "operation in progress"),
+  ERR (U2FH_CANCELLED, "operation cancelled"),
 };
 
 /**
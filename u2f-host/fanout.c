@@ -0,0 +1,460 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Run one U2F APDU on every device of a set at the same time.  Each
+ * device has its own transaction and is asked again on its own
+ * schedule while it waits for a touch, so one slow device never
+ * holds up the others.  The first device to return more than a
+ * status word wins; transactions still running on the other devices
+ * are cancelled and their replies dropped as they arrive.  A device
+ * with no free channel is asked for another one, and the APDU is sent
+ * once it has answered; steps never wait for a device.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+
+#define NOTSATISFIED "\x69\x85"
+
+/* Wake up this often when a busy device cannot be polled for. */
+#define FALLBACK_POLL_INTERVAL 1
+
+/* Prepare @f for sending the APDU to all devices in @devs.  With
+   @presence set, devices answering 0x6985 are asked again until one
+   of them is touched.  The whole operation, including every transfer,
+   ends after @timeout milliseconds, or the default timeout of the
+   context if @timeout is 0.  Nothing is sent before the first
+   fanout_step(), which opens the devices to be asked that are not
+   open yet and sends each its INIT in the same pass, so that a
+   device left out by fanout_route() is not opened at all. */
+int
+fanout_start (struct fanout *f, u2fh_devs * devs, int cmd,
+	      const unsigned char *d, size_t dlen, int p1, int presence,
+	      unsigned timeout)
+{
+  size_t i, n;
+
+  memset (f, 0, sizeof (*f));
+  if (dlen > sizeof (f->apdu) - 9)
+    return U2FH_MEMORY_ERROR;
+  f->apdulen = build_apdu (cmd, p1, d, dlen, f->apdu);
+  f->presence = presence;
+  f->deadline = monotonic_ms () + (timeout ? timeout : devs->ctx->timeout);
+  f->rc = U2FH_NO_U2F_DEVICE;
+
+  /* take the devices present now; discovery may change the list
+     while the operation runs */
+  rwlock_rdlock (&devs->list_lock);
+  f->n = devs->ndevices;
+  if (f->n == 0)
+    {
+      rwlock_rdunlock (&devs->list_lock);
+      return U2FH_NO_U2F_DEVICE;
+    }
+
+  f->devs = calloc (f->n, sizeof (*f->devs));
+  f->busy = calloc (f->n, sizeof (*f->busy));
+  if (f->devs == NULL || f->busy == NULL)
+    {
+      rwlock_rdunlock (&devs->list_lock);
+      fanout_done (f);
+      return U2FH_MEMORY_ERROR;
+    }
+
+  for (i = 0, n = 0; i < devs->table_size; i++)
+    {
+      struct u2fdevice *dev = devs->table[i];
+
+      if (dev == NULL)
+	continue;
+      hold_device (dev);
+      f->devs[n].x.dev = dev;
+      f->devs[n].active = 1;
+      n++;
+    }
+  rwlock_rdunlock (&devs->list_lock);
+
+  return U2FH_OK;
+}
+
+/* Ask only device @id of @f at first, which is known to own the key
+   handle in the APDU.  Should it not recognize the key handle after
+   all, the other devices are asked.  Returns 1 if @id is in @f. */
+int
+fanout_route (struct fanout *f, unsigned id)
+{
+  size_t i;
+
+  for (i = 0; i < f->n; i++)
+    if (f->devs[i].x.dev->id == id)
+      break;
+  if (i == f->n)
+    return 0;
+
+  if (f->devs[i].x.dev->ctx->debug)
+    u2fh_log (f->devs[i].x.dev->ctx, "key handle routed to device %u", id);
+  f->route = i;
+  f->routed = 1;
+  for (i = 0; i < f->n; i++)
+    f->devs[i].active = i == f->route;
+
+  return 1;
+}
+
+/* Stop whatever @fd has running, telling a device that is working
+   on the APDU to give up; one waiting for a touch would keep waiting
+   otherwise.  A channel being opened has nothing to cancel yet. */
+static void
+fanout_stop (struct fanout_dev *fd)
+{
+  if (fd->opening)
+    {
+      channel_open_abandon (&fd->open);
+      fd->opening = 0;
+    }
+  xfer_cancel (&fd->x);
+}
+
+static int
+fanout_finish (struct fanout *f, int rc)
+{
+  size_t i;
+
+  for (i = 0; i < f->n; i++)
+    fanout_stop (&f->devs[i]);
+  f->nbusy = 0;
+  f->done = 1;
+  f->rc = rc;
+  return rc;
+}
+
+/* Settle the outcome once no device is left to ask.  When no device
+   returned data the result is 0x6985 if any device answered so,
+   otherwise the last status word seen; if every device failed the
+   last error is returned. */
+static int
+fanout_settle (struct fanout *f)
+{
+  if (f->notsatisfied)
+    memcpy (f->status, NOTSATISFIED, 2);
+  if (f->notsatisfied || f->have_status)
+    {
+      f->result = f->status;
+      f->result_len = 2;
+      return fanout_finish (f, U2FH_OK);
+    }
+
+  return fanout_finish (f, f->rc);
+}
+
+/* Send the APDU to @fd, on @ch if a channel was opened for it or on
+   a free one otherwise.  If the device has none free, it is asked for
+   another one and the APDU is sent once it has answered. */
+static int
+fanout_send (struct fanout *f, struct fanout_dev *fd,
+	     struct u2fh_channel *ch, uint64_t now)
+{
+  uint64_t deadline = now + HID_TRANS_TIMEOUT;
+  int rc;
+
+  if (deadline > f->deadline)
+    deadline = f->deadline;
+  if (ch != NULL)
+    rc = xfer_start_own (&fd->x, ch, U2FHID_MSG, f->apdu, f->apdulen,
+			 fd->resp, sizeof (fd->resp), deadline);
+  else
+    rc = xfer_start (&fd->x, fd->x.dev, U2FHID_MSG, f->apdu, f->apdulen,
+		     fd->resp, sizeof (fd->resp), deadline);
+  if (rc == U2FH_AGAIN)
+    {
+      rc = channel_open_start (&fd->open, fd->x.dev, deadline);
+      if (rc == U2FH_OK)
+	fd->opening = 1;
+      else if (rc == U2FH_AGAIN)
+	{
+	  /* the device is being asked already, try again soon */
+	  fd->next_poll = now + FALLBACK_POLL_INTERVAL;
+	  rc = U2FH_OK;
+	}
+    }
+  else if (rc == U2FH_OK)
+    {
+      /* a device sending keepalives may hold the request until
+         touched */
+      fd->x.limit = f->deadline;
+    }
+
+  return rc;
+}
+
+/* Collect the answer to the INIT of @fd, if it has come, and send the
+   APDU on the new channel. */
+static int
+fanout_opened (struct fanout *f, struct fanout_dev *fd, uint64_t now)
+{
+  struct u2fh_channel *ch;
+  int rc;
+
+  xfer_poll (&fd->open.x, now);
+  if (fd->open.x.state == XFER_BUSY)
+    return U2FH_OK;
+  fd->opening = 0;
+
+  rc = channel_open_finish (&fd->open, &ch);
+  if (rc != U2FH_OK)
+    return rc;
+
+  return fanout_send (f, fd, ch, now);
+}
+
+/* Wait for @x before the next step. */
+static void
+fanout_busy (struct fanout *f, struct u2fh_xfer *x)
+{
+  f->busy[f->nbusy++] = x;
+  if (x->deadline < f->wakeup)
+    f->wakeup = x->deadline;
+  if (x->retry && x->retry < f->wakeup)
+    f->wakeup = x->retry;
+}
+
+/* Advance @f without blocking: collect whatever the devices have
+   sent, and send the APDU to devices that are due to be asked.  A
+   device answering a status word other than 0x6985, or failing,
+   drops out.  Returns %U2FH_AGAIN while the operation is running;
+   otherwise the outcome is in f->result. */
+int
+fanout_step (struct fanout *f)
+{
+  uint64_t now = monotonic_ms ();
+  size_t nactive = 0;
+  size_t i;
+
+  if (f->done)
+    return f->rc;
+
+  for (i = 0; i < f->n; i++)
+    {
+      struct fanout_dev *fd = &f->devs[i];
+
+      if (!fd->active)
+	continue;
+      /* only devices being asked open channels */
+      if (fd->opening)
+	{
+	  int rc = fanout_opened (f, fd, now);
+
+	  if (rc != U2FH_OK)
+	    {
+	      f->rc = rc;
+	      fd->active = 0;
+	    }
+	  continue;
+	}
+      xfer_poll (&fd->x, now);
+      if (fd->x.state != XFER_DONE)
+	continue;
+      fd->x.state = XFER_IDLE;
+
+      if (fd->x.rc == U2FH_OK && fd->x.resp_len < 2)
+	fd->x.rc = U2FH_TRANSPORT_ERROR;
+      if (fd->x.rc != U2FH_OK)
+	{
+	  f->rc = fd->x.rc;
+	  fd->active = 0;
+	}
+      else if (fd->x.resp_len > 2)
+	{
+	  if (fd->x.dev->ctx->debug)
+	    u2fh_log (fd->x.dev->ctx, "device %u answered", fd->x.dev->id);
+	  f->result = fd->resp;
+	  f->result_len = fd->x.resp_len;
+	  f->owner = fd->x.dev;
+	  return fanout_finish (f, U2FH_OK);
+	}
+      else if (memcmp (fd->resp, NOTSATISFIED, 2) == 0)
+	{
+	  f->notsatisfied = 1;
+	  if (f->owner == NULL)
+	    f->owner = fd->x.dev;
+	  if (f->presence)
+	    {
+	      /* ask quickly at first, then back off */
+	      if (fd->interval == 0)
+		fd->interval = PRESENCE_POLL_INTERVAL;
+	      else if (fd->interval * 2 < PRESENCE_POLL_MAX)
+		fd->interval *= 2;
+	      else
+		fd->interval = PRESENCE_POLL_MAX;
+	      fd->next_poll = now + fd->interval;
+	    }
+	  else
+	    fd->active = 0;
+	}
+      else
+	{
+	  memcpy (f->status, fd->resp, 2);
+	  f->have_status = 1;
+	  fd->active = 0;
+	}
+    }
+
+  if (f->routed && !f->notsatisfied && !f->devs[f->route].active)
+    {
+      struct u2fdevice *dev = f->devs[f->route].x.dev;
+
+      if (dev->ctx->debug)
+	u2fh_log (dev->ctx, "device %u does not own the key handle", dev->id);
+      for (i = 0; i < f->n; i++)
+	f->devs[i].active = i != f->route;
+      f->routed = 0;
+      f->rerouted = 1;
+    }
+
+  if (now >= f->deadline)
+    return fanout_finish (f, U2FH_TIMEOUT_ERROR);
+
+  f->nbusy = 0;
+  f->wakeup = f->deadline;
+  for (i = 0; i < f->n; i++)
+    {
+      struct fanout_dev *fd = &f->devs[i];
+
+      if (!fd->active)
+	continue;
+      if (!fd->opening && fd->x.state != XFER_BUSY && fd->next_poll <= now)
+	{
+	  int rc = fanout_send (f, fd, NULL, now);
+
+	  if (rc != U2FH_OK)
+	    {
+	      f->rc = rc;
+	      fd->active = 0;
+	      continue;
+	    }
+	}
+      nactive++;
+      if (fd->opening)
+	fanout_busy (f, &fd->open.x);
+      else if (fd->x.state == XFER_BUSY)
+	fanout_busy (f, &fd->x);
+      else if (fd->next_poll < f->wakeup)
+	f->wakeup = fd->next_poll;
+    }
+
+  if (nactive == 0)
+    return fanout_settle (f);
+
+  return U2FH_AGAIN;
+}
+
+/* Return the #u2fh_status of @f. */
+int
+fanout_status (struct fanout *f)
+{
+  size_t i;
+
+  if (f->done)
+    return U2FH_STATUS_IDLE;
+  if (f->notsatisfied)
+    return U2FH_STATUS_UPNEEDED;
+  /* a device sending keepalives tells whether it waits for a touch */
+  for (i = 0; i < f->nbusy; i++)
+    if (f->busy[i]->keepalive == STATUS_UPNEEDED)
+      return U2FH_STATUS_UPNEEDED;
+
+  return U2FH_STATUS_PROCESSING;
+}
+
+/* Block until fanout_step() has something to do, or @wakefd (unless
+   -1) becomes readable. */
+void
+fanout_wait (struct fanout *f, int wakefd)
+{
+  uint64_t until = f->wakeup;
+
+#ifdef _WIN32
+  /* there is no descriptor to wake up on */
+  if (until > monotonic_ms () + CANCEL_CHECK_INTERVAL)
+    until = monotonic_ms () + CANCEL_CHECK_INTERVAL;
+#endif
+
+  xfer_wait (f->busy, f->nbusy, until, wakefd);
+}
+
+/* Stop @f, telling devices still working on the request to give up. */
+void
+fanout_cancel (struct fanout *f)
+{
+  fanout_finish (f, U2FH_CANCELLED);
+}
+
+/* Store in @fds the descriptors to wait on before the next
+   fanout_step(), and in @timeout the milliseconds to wait at most. */
+int
+fanout_fds (struct fanout *f, int *fds, size_t * nfds, int *timeout)
+{
+  uint64_t now = monotonic_ms ();
+  size_t i, n = 0;
+
+  *timeout = f->wakeup > now ? (int) (f->wakeup - now) : 0;
+  for (i = 0; i < f->nbusy; i++)
+    {
+      int xfds[2];
+      size_t j, k = xfer_fds (f->busy[i], xfds);
+
+      if (k == 0)
+	{
+	  if (*timeout > FALLBACK_POLL_INTERVAL)
+	    *timeout = FALLBACK_POLL_INTERVAL;
+	  continue;
+	}
+      for (j = 0; j < k; j++, n++)
+	if (n < *nfds)
+	  fds[n] = xfds[j];
+    }
+
+  if (n > *nfds)
+    {
+      *nfds = n;
+      return U2FH_SIZE_ERROR;
+    }
+  *nfds = n;
+
+  return U2FH_OK;
+}
+
+void
+fanout_done (struct fanout *f)
+{
+  size_t i;
+
+  for (i = 0; f->devs != NULL && i < f->n; i++)
+    {
+      fanout_stop (&f->devs[i]);
+      if (f->devs[i].x.dev != NULL)
+	put_device (f->devs[i].x.dev);
+    }
+  free (f->devs);
+  free (f->busy);
+  f->devs = NULL;
+  f->busy = NULL;
+  f->nbusy = 0;
+}
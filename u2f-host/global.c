@@ -18,14 +18,20 @@
 #include <config.h>
 #include "internal.h"
 
-int debug;
+#include <stdarg.h>
+#include <stdlib.h>
+
+/* the context of device sets made with u2fh_devs_init() */
+u2fh_ctx default_ctx = { 0, 0, NULL, NULL, PRESENCE_TIMEOUT, 0 };
 
 /**
  * u2fh_global_init:
  * @flags: initialization flags, ORed #u2fh_initflags.
  *
  * Initialize the library.  This function is not guaranteed to be
- * thread safe and must be invoked on application startup.
+ * thread safe and must be invoked on application startup.  The
+ * @flags apply to device sets made with u2fh_devs_init(); those made
+ * with u2fh_devs_init2() follow their own context.
  *
  * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
  * an #u2fh_rc error code.
@@ -34,7 +40,8 @@ u2fh_rc
 u2fh_global_init (u2fh_initflags flags)
 {
   if (flags & U2FH_DEBUG)
-    debug = 1;
+    default_ctx.debug = 1;
+  default_ctx.flags = flags;
 
   return U2FH_OK;
 }
@@ -48,5 +55,140 @@ u2fh_global_init (u2fh_initflags flags)
 void
 u2fh_global_done (void)
 {
-  debug = 0;
+  default_ctx.debug = 0;
+  default_ctx.flags = 0;
+}
+
+/**
+ * u2fh_ctx_init:
+ * @ctx: pointer to #u2fh_ctx type to initialize.
+ * @flags: ORed #u2fh_initflags for this context.
+ *
+ * Create a library context.  A context holds the configuration of the
+ * device sets made from it with u2fh_devs_init2(): debug logging, the
+ * default timeout and which devices to look for.  Contexts are
+ * independent of each other and of u2fh_global_init(), so differently
+ * configured users of the library can share a process.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, on memory
+ * allocation errors %U2FH_MEMORY_ERROR is returned.
+ */
+u2fh_rc
+u2fh_ctx_init (u2fh_ctx ** ctx, u2fh_initflags flags)
+{
+  u2fh_ctx *c = calloc (1, sizeof (*c));
+
+  if (c == NULL)
+    return U2FH_MEMORY_ERROR;
+  c->flags = flags;
+  c->debug = (flags & U2FH_DEBUG) != 0;
+  c->timeout = PRESENCE_TIMEOUT;
+
+  *ctx = c;
+  return U2FH_OK;
+}
+
+/**
+ * u2fh_ctx_done:
+ * @ctx: a context, from u2fh_ctx_init().
+ *
+ * Release @ctx.  The device sets made from it must have been released
+ * with u2fh_devs_done() before.
+ */
+void
+u2fh_ctx_done (u2fh_ctx * ctx)
+{
+  free (ctx);
+}
+
+/**
+ * u2fh_ctx_set_log:
+ * @ctx: a context, from u2fh_ctx_init().
+ * @log_cb: function called with each debug message, or %NULL to
+ *   print them on stderr.
+ * @log_arg: passed to @log_cb.
+ *
+ * Send the debug messages of @ctx, which are only produced with
+ * %U2FH_DEBUG set, to @log_cb.  Messages come without a trailing
+ * newline.  @log_cb may be called from any thread using the device
+ * sets of @ctx.  Set it before making device sets from @ctx.
+ */
+void
+u2fh_ctx_set_log (u2fh_ctx * ctx, u2fh_log_cb log_cb, void *log_arg)
+{
+  ctx->log_cb = log_cb;
+  ctx->log_arg = log_arg;
+}
+
+/**
+ * u2fh_ctx_set_timeout:
+ * @ctx: a context, from u2fh_ctx_init().
+ * @timeout: milliseconds, or 0 for the default of 16 seconds.
+ *
+ * Set how long register and authenticate calls on the device sets of
+ * @ctx wait for the user to touch a device, unless their
+ * #u2fh_cmdopts tell otherwise.  Set it before making device sets
+ * from @ctx.
+ */
+void
+u2fh_ctx_set_timeout (u2fh_ctx * ctx, unsigned timeout)
+{
+  ctx->timeout = timeout ? timeout : PRESENCE_TIMEOUT;
+}
+
+/**
+ * u2fh_ctx_set_idle_timeout:
+ * @ctx: a context, from u2fh_ctx_init().
+ * @idle_timeout: milliseconds, or 0 to keep devices open.
+ *
+ * Set how long a device of the device sets of @ctx may go unused
+ * before u2fh_devs_close_idle() closes it.  A closed device is opened
+ * again when it is next used.  Together with %U2FH_LAZY_OPEN this
+ * keeps a long-running process from holding a descriptor for every
+ * device.  Set it before making device sets from @ctx.
+ */
+void
+u2fh_ctx_set_idle_timeout (u2fh_ctx * ctx, unsigned idle_timeout)
+{
+  ctx->idle_timeout = idle_timeout;
+}
+
+/* Pass a debug message to the log of @ctx.  Callers check ctx->debug
+   first so that nothing is formatted when debugging is off. */
+void
+u2fh_log (const u2fh_ctx * ctx, const char *fmt, ...)
+{
+  char buf[1024];
+  char *msg = buf;
+  va_list ap;
+  int len;
+
+  va_start (ap, fmt);
+  len = vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+  if (len < 0)
+    return;
+  if ((size_t) len >= sizeof (buf))
+    {
+      msg = malloc (len + 1);
+      if (msg == NULL)
+	msg = buf;
+      else
+	{
+	  va_start (ap, fmt);
+	  vsnprintf (msg, len + 1, fmt, ap);
+	  va_end (ap);
+	}
+    }
+  len = strlen (msg);
+  if (len > 0 && msg[len - 1] == '\n')
+    msg[len - 1] = '\0';
+
+  if (ctx->log_cb)
+    ctx->log_cb (msg, ctx->log_arg);
+  else
+    fprintf (stderr, "%s\n", msg);
+
+  if (msg != buf)
+    free (msg);
 }
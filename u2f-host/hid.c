@@ -0,0 +1,233 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include "internal.h"
+
+#include <hidapi.h>
+#include <stdlib.h>
+
+static int
+get_usages (u2fh_devs * devs, struct hid_device_info *dev,
+	    unsigned short *usage_page, unsigned short *usage)
+{
+#ifdef __linux
+  return hidraw_get_usages (devs, dev->path, usage_page, usage);
+#else
+  (void) devs;
+  *usage_page = dev->usage_page;
+  *usage = dev->usage;
+  return U2FH_OK;
+#endif
+}
+
+/* Return @w converted to a multibyte string, or NULL. */
+static char *
+to_mbs (const wchar_t * w)
+{
+  size_t len;
+  char *s;
+
+  if (w == NULL || (len = wcstombs (NULL, w, 0)) == (size_t) - 1)
+    return NULL;
+  s = malloc (len + 1);
+  if (s == NULL)
+    return NULL;
+  memset (s, 0, len + 1);
+  wcstombs (s, w, len);
+
+  return s;
+}
+
+/* Tell whether the filter of @devs accepts @dev, before looking at
+   its report descriptor. */
+static int
+filter_device (u2fh_devs * devs, struct hid_device_info *dev)
+{
+  char *serial;
+  int ok;
+
+  if (!filter_path (devs, dev->path))
+    return 0;
+  if (!filter_wants_ids (devs))
+    return 1;
+
+  serial = to_mbs (dev->serial_number);
+  ok = filter_ids (devs, dev->vendor_id, dev->product_id, serial);
+  free (serial);
+
+  return ok;
+}
+
+static int
+hidapi_init (u2fh_devs * devs)
+{
+  (void) devs;
+
+  if (hid_init () != 0)
+    return U2FH_TRANSPORT_ERROR;
+
+  return U2FH_OK;
+}
+
+static void
+hidapi_exit (u2fh_devs * devs)
+{
+  (void) devs;
+
+  hid_exit ();
+}
+
+/* List the U2F devices hidapi knows about, only the one at @path
+   unless that is NULL. */
+static int
+list_devices (u2fh_devs * devs, const char *path,
+	      struct u2fh_devinfo **list)
+{
+  struct hid_device_info *di, *cur_dev;
+  struct u2fh_devinfo **tail = list;
+  unsigned short vendor_id, product_id;
+  int rc = U2FH_OK;
+
+  *list = NULL;
+  /* let hidapi skip devices of other vendors and products */
+  filter_usb_hint (devs, &vendor_id, &product_id);
+  di = hid_enumerate (vendor_id, product_id);
+  for (cur_dev = di; cur_dev; cur_dev = cur_dev->next)
+    {
+      unsigned short usage_page = 0, usage = 0;
+      struct u2fh_devinfo *info;
+
+      if (path != NULL && strcmp (cur_dev->path, path) != 0)
+	continue;
+      if (!filter_device (devs, cur_dev))
+	continue;
+      get_usages (devs, cur_dev, &usage_page, &usage);
+      if (usage_page != FIDO_USAGE_PAGE || usage != FIDO_USAGE_U2FHID)
+	continue;
+
+      info = calloc (1, sizeof (*info));
+      if (info == NULL)
+	{
+	  rc = U2FH_MEMORY_ERROR;
+	  break;
+	}
+      *tail = info;
+      tail = &info->next;
+
+      info->path = strdup (cur_dev->path);
+      if (info->path == NULL)
+	{
+	  rc = U2FH_MEMORY_ERROR;
+	  break;
+	}
+
+      if (cur_dev->product_string)
+	{
+	  info->product = to_mbs (cur_dev->product_string);
+	  if (info->product == NULL)
+	    {
+	      rc = U2FH_MEMORY_ERROR;
+	      break;
+	    }
+	}
+    }
+  hid_free_enumeration (di);
+
+  if (rc != U2FH_OK)
+    {
+      free_devinfo (*list);
+      *list = NULL;
+    }
+#ifdef __linux
+  else if (path == NULL)
+    hidraw_usages_sweep (devs);
+#endif
+
+  return rc;
+}
+
+static int
+hidapi_enumerate (u2fh_devs * devs, struct u2fh_devinfo **list)
+{
+  return list_devices (devs, NULL, list);
+}
+
+/* hidapi cannot describe a single device, so this still enumerates,
+   but only when a device was plugged in. */
+static int
+hidapi_probe (u2fh_devs * devs, const char *path, struct u2fh_devinfo **info)
+{
+  return list_devices (devs, path, info);
+}
+
+static int
+hidapi_open (u2fh_devs * devs, const char *path, void **handle)
+{
+  (void) devs;
+
+  *handle = hid_open_path (path);
+  if (*handle == NULL)
+    return U2FH_TRANSPORT_ERROR;
+
+  return U2FH_OK;
+}
+
+static int
+hidapi_write (void *handle, const unsigned char *report, size_t len)
+{
+  unsigned char data[HID_RPT_SIZE + 1];
+  int rc;
+
+  if (len > HID_RPT_SIZE)
+    return -1;
+
+  /* FIXME: add report as first byte, is report 0 correct? */
+  data[0] = 0;
+  memcpy (data + 1, report, len);
+
+  rc = hid_write ((hid_device *) handle, data, len + 1);
+  if (rc <= 0)
+    return rc;
+
+  return rc - 1;
+}
+
+static int
+hidapi_read (void *handle, unsigned char *report, size_t len, int timeout)
+{
+  return hid_read_timeout ((hid_device *) handle, report, len, timeout);
+}
+
+static void
+hidapi_close (void *handle)
+{
+  hid_close ((hid_device *) handle);
+}
+
+const struct u2fh_transport hidapi_transport = {
+  "hidapi",
+  hidapi_init,
+  hidapi_exit,
+  hidapi_enumerate,
+  hidapi_probe,
+  hidapi_open,
+  hidapi_write,
+  hidapi_read,
+  hidapi_close,
+  NULL
+};
@@ -0,0 +1,531 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Native Linux hidraw transport.  Each device is a single file
+ * descriptor driven with plain write(), poll() and read() of 64 byte
+ * reports, without hidapi's reader threads and locking.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#ifdef __linux
+
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/hidraw.h>
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+
+struct hidraw_dev
+{
+  int fd;
+};
+
+static uint32_t
+get_bytes (uint8_t * rpt, size_t len, size_t num_bytes, size_t cur)
+{
+  /* Return if there aren't enough bytes. */
+  if (cur + num_bytes >= len)
+    return 0;
+
+  if (num_bytes == 0)
+    return 0;
+  else if (num_bytes == 1)
+    {
+      return rpt[cur + 1];
+    }
+  else if (num_bytes == 2)
+    {
+      return (rpt[cur + 2] * 256 + rpt[cur + 1]);
+    }
+  else
+    return 0;
+}
+
+static int
+get_usage (uint8_t * report_descriptor, size_t size,
+	   unsigned short *usage_page, unsigned short *usage)
+{
+  size_t i = 0;
+  int size_code;
+  int data_len, key_size;
+  int usage_found = 0, usage_page_found = 0;
+
+  while (i < size)
+    {
+      int key = report_descriptor[i];
+      int key_cmd = key & 0xfc;
+
+      /* long items are not used by U2F devices */
+      if ((key & 0xf0) == 0xf0)
+	return -1;
+      else
+	{
+	  size_code = key & 0x3;
+	  switch (size_code)
+	    {
+	    case 0:
+	    case 1:
+	    case 2:
+	      data_len = size_code;
+	      break;
+	    case 3:
+	      data_len = 4;
+	      break;
+	    default:
+	      /* Can't ever happen since size_code is & 0x3 */
+	      data_len = 0;
+	      break;
+	    };
+	  key_size = 1;
+	}
+
+      if (key_cmd == 0x4)
+	{
+	  *usage_page = get_bytes (report_descriptor, size, data_len, i);
+	  usage_page_found = 1;
+	}
+      if (key_cmd == 0x8)
+	{
+	  *usage = get_bytes (report_descriptor, size, data_len, i);
+	  usage_found = 1;
+	}
+
+      if (usage_page_found && usage_found)
+	return 0;		/* success */
+
+      i += data_len + key_size;
+    }
+
+  return -1;			/* failure */
+}
+
+static int
+fd_get_usages (int fd, unsigned short *usage_page, unsigned short *usage)
+{
+  struct hidraw_report_descriptor rpt_desc;
+  int desc_size;
+
+  memset (&rpt_desc, 0, sizeof (rpt_desc));
+  if (ioctl (fd, HIDIOCGRDESCSIZE, &desc_size) < 0)
+    return U2FH_TRANSPORT_ERROR;
+
+  rpt_desc.size = desc_size;
+  if (ioctl (fd, HIDIOCGRDESC, &rpt_desc) < 0)
+    return U2FH_TRANSPORT_ERROR;
+
+  if (get_usage (rpt_desc.value, rpt_desc.size, usage_page, usage) < 0)
+    return U2FH_TRANSPORT_ERROR;
+
+  return U2FH_OK;
+}
+
+/* Usages read from the report descriptor of a hidraw node, kept
+   for as long as the node exists.  A node created again for another
+   device gets a new inode, and maybe a new device number, which
+   makes the entry for its path stale. */
+struct hidraw_usage
+{
+  struct hidraw_usage *next;
+  char *path;
+  dev_t rdev;
+  ino_t ino;
+  unsigned short usage_page;
+  unsigned short usage;
+  unsigned gen;
+};
+
+/* Read the top-level usage page and usage from the report descriptor
+   of the hidraw node at @path.  Nodes looked at before are answered
+   from the cache of @devs, without opening them, unless @devs is
+   NULL.  Called with devs->discover_lock held. */
+int
+hidraw_get_usages (u2fh_devs * devs, const char *path,
+		   unsigned short *usage_page, unsigned short *usage)
+{
+  const u2fh_ctx *ctx = devs != NULL ? devs->ctx : NULL;
+  struct hidraw_usage *u = NULL;
+  struct stat st;
+  int ret = U2FH_TRANSPORT_ERROR;
+  int handle;
+
+  if (devs != NULL && stat (path, &st) != 0)
+    devs = NULL;
+  if (devs != NULL)
+    {
+      for (u = devs->usages; u != NULL; u = u->next)
+	if (strcmp (u->path, path) == 0)
+	  break;
+      if (u != NULL && u->rdev == st.st_rdev && u->ino == st.st_ino)
+	{
+	  u->gen = devs->usages_gen;
+	  *usage_page = u->usage_page;
+	  *usage = u->usage;
+	  return U2FH_OK;
+	}
+    }
+
+  handle = open (path, O_RDWR | O_CLOEXEC);
+  if (handle >= 0)
+    {
+      ret = fd_get_usages (handle, usage_page, usage);
+      close (handle);
+      if (ret != U2FH_OK && ctx != NULL && ctx->debug)
+	u2fh_log (ctx, "invalid report descriptor in %s", path);
+    }
+
+  /* failures are not kept, the node may become readable later */
+  if (ret != U2FH_OK || devs == NULL)
+    return ret;
+
+  if (u == NULL)
+    {
+      /* the node is new, otherwise it was created again */
+      u = calloc (1, sizeof (*u));
+      if (u == NULL)
+	return ret;
+      u->path = strdup (path);
+      if (u->path == NULL)
+	{
+	  free (u);
+	  return ret;
+	}
+      u->next = devs->usages;
+      devs->usages = u;
+    }
+  u->rdev = st.st_rdev;
+  u->ino = st.st_ino;
+  u->usage_page = *usage_page;
+  u->usage = *usage;
+  u->gen = devs->usages_gen;
+
+  return ret;
+}
+
+/* Drop the cached usages of nodes that were not looked at since the
+   last call, after a complete enumeration. */
+void
+hidraw_usages_sweep (u2fh_devs * devs)
+{
+  struct hidraw_usage **p = &devs->usages;
+
+  while (*p != NULL)
+    {
+      struct hidraw_usage *u = *p;
+
+      if (u->gen != devs->usages_gen)
+	{
+	  *p = u->next;
+	  free (u->path);
+	  free (u);
+	}
+      else
+	p = &u->next;
+    }
+  devs->usages_gen++;
+}
+
+void
+hidraw_usages_done (u2fh_devs * devs)
+{
+  devs->usages_gen++;
+  hidraw_usages_sweep (devs);
+}
+
+/* Properties of the HID device behind a hidraw node. */
+struct hid_props
+{
+  unsigned vendor_id;
+  unsigned product_id;
+  char *name;
+  char *serial;
+};
+
+/* Read the properties of hidraw node @name from sysfs. */
+static void
+read_props (const char *name, struct hid_props *props)
+{
+  char path[512];
+  char line[256];
+  FILE *fh;
+
+  memset (props, 0, sizeof (*props));
+  snprintf (path, sizeof (path), SYSFS_HIDRAW "/%s/device/uevent", name);
+  fh = fopen (path, "r");
+  if (fh == NULL)
+    return;
+
+  while (fgets (line, sizeof (line), fh) != NULL)
+    {
+      line[strcspn (line, "\n")] = '\0';
+      if (strncmp (line, "HID_ID=", strlen ("HID_ID=")) == 0)
+	{
+	  unsigned bus;
+
+	  if (sscanf (line + strlen ("HID_ID="), "%x:%x:%x", &bus,
+		      &props->vendor_id, &props->product_id) != 3)
+	    props->vendor_id = props->product_id = 0;
+	}
+      else if (strncmp (line, "HID_NAME=", strlen ("HID_NAME=")) == 0
+	       && props->name == NULL)
+	props->name = strdup (line + strlen ("HID_NAME="));
+      else if (strncmp (line, "HID_UNIQ=", strlen ("HID_UNIQ=")) == 0
+	       && props->serial == NULL)
+	props->serial = strdup (line + strlen ("HID_UNIQ="));
+    }
+  fclose (fh);
+}
+
+static int
+hidraw_init (u2fh_devs * devs)
+{
+  (void) devs;
+
+  return U2FH_OK;
+}
+
+static void
+hidraw_exit (u2fh_devs * devs)
+{
+  (void) devs;
+}
+
+/* Describe the hidraw node @name into *@info if it is a U2F device
+   accepted by the filter of @devs, otherwise set it to NULL. */
+static int
+probe_node (u2fh_devs * devs, const char *name, struct u2fh_devinfo **info)
+{
+  unsigned short usage_page = 0, usage = 0;
+  struct hid_props props;
+  int have_props = 0;
+  char path[512];
+  int rc = U2FH_OK;
+
+  *info = NULL;
+  if (strncmp (name, "hidraw", strlen ("hidraw")) != 0)
+    return U2FH_OK;
+
+  snprintf (path, sizeof (path), "/dev/%s", name);
+  if (!filter_path (devs, path))
+    return U2FH_OK;
+  memset (&props, 0, sizeof (props));
+  if (filter_wants_ids (devs))
+    {
+      /* sysfs tells the ids without opening the device */
+      read_props (name, &props);
+      have_props = 1;
+      if (!filter_ids (devs, props.vendor_id, props.product_id,
+		       props.serial))
+	goto out;
+    }
+
+  if (hidraw_get_usages (devs, path, &usage_page, &usage) != U2FH_OK)
+    goto out;
+  if (usage_page != FIDO_USAGE_PAGE || usage != FIDO_USAGE_U2FHID)
+    goto out;
+
+  if (!have_props)
+    read_props (name, &props);
+  *info = calloc (1, sizeof (**info));
+  if (*info == NULL)
+    {
+      rc = U2FH_MEMORY_ERROR;
+      goto out;
+    }
+  (*info)->path = strdup (path);
+  if ((*info)->path == NULL)
+    {
+      free (*info);
+      *info = NULL;
+      rc = U2FH_MEMORY_ERROR;
+      goto out;
+    }
+  (*info)->product = props.name;
+  props.name = NULL;
+
+out:
+  free (props.name);
+  free (props.serial);
+  return rc;
+}
+
+/* Order hidraw nodes by number, so that devices are found in the
+   same order every time. */
+static int
+compare_nodes (const struct dirent **a, const struct dirent **b)
+{
+  return strverscmp ((*a)->d_name, (*b)->d_name);
+}
+
+static int
+hidraw_enumerate (u2fh_devs * devs, struct u2fh_devinfo **list)
+{
+  struct u2fh_devinfo **tail = list;
+  struct dirent **names;
+  int i, n;
+  int rc = U2FH_OK;
+
+  *list = NULL;
+  n = scandir (SYSFS_HIDRAW, &names, NULL, compare_nodes);
+  if (n < 0)
+    return U2FH_OK;
+
+  for (i = 0; i < n; i++)
+    {
+      if (rc == U2FH_OK)
+	{
+	  rc = probe_node (devs, names[i]->d_name, tail);
+	  if (*tail != NULL)
+	    tail = &(*tail)->next;
+	}
+      free (names[i]);
+    }
+  free (names);
+
+  if (rc != U2FH_OK)
+    {
+      free_devinfo (*list);
+      *list = NULL;
+    }
+  else
+    hidraw_usages_sweep (devs);
+
+  return rc;
+}
+
+static int
+hidraw_probe (u2fh_devs * devs, const char *path,
+	      struct u2fh_devinfo **info)
+{
+  *info = NULL;
+  if (strncmp (path, "/dev/", strlen ("/dev/")) != 0
+      || strchr (path + strlen ("/dev/"), '/') != NULL)
+    return U2FH_OK;
+
+  return probe_node (devs, path + strlen ("/dev/"), info);
+}
+
+static int
+hidraw_open (u2fh_devs * devs, const char *path, void **handle)
+{
+  struct hidraw_dev *d;
+
+  (void) devs;
+
+  d = malloc (sizeof (*d));
+  if (d == NULL)
+    return U2FH_MEMORY_ERROR;
+
+  d->fd = open (path, O_RDWR | O_CLOEXEC);
+  if (d->fd < 0)
+    {
+      free (d);
+      return U2FH_TRANSPORT_ERROR;
+    }
+
+  *handle = d;
+  return U2FH_OK;
+}
+
+static int
+hidraw_write (void *handle, const unsigned char *report, size_t len)
+{
+  struct hidraw_dev *d = handle;
+  unsigned char data[HID_RPT_SIZE + 1];
+  ssize_t rc;
+
+  if (len > HID_RPT_SIZE)
+    return -1;
+
+  /* U2F devices use unnumbered reports, so the report number is 0 */
+  data[0] = 0;
+  memcpy (data + 1, report, len);
+
+  do
+    rc = write (d->fd, data, len + 1);
+  while (rc < 0 && errno == EINTR);
+  if (rc <= 0)
+    return rc;
+
+  return rc - 1;
+}
+
+static int
+hidraw_read (void *handle, unsigned char *report, size_t len, int timeout)
+{
+  struct hidraw_dev *d = handle;
+  struct pollfd pfd;
+  ssize_t rc;
+
+  pfd.fd = d->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  rc = poll (&pfd, 1, timeout);
+  if (rc < 0)
+    return errno == EINTR ? 0 : -1;
+  if (rc == 0)
+    return 0;
+  if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+    return -1;
+
+  do
+    rc = read (d->fd, report, len);
+  while (rc < 0 && errno == EINTR);
+
+  return rc;
+}
+
+static void
+hidraw_close (void *handle)
+{
+  struct hidraw_dev *d = handle;
+
+  close (d->fd);
+  free (d);
+}
+
+static int
+hidraw_fd (void *handle)
+{
+  struct hidraw_dev *d = handle;
+
+  return d->fd;
+}
+
+const struct u2fh_transport hidraw_transport = {
+  "hidraw",
+  hidraw_init,
+  hidraw_exit,
+  hidraw_enumerate,
+  hidraw_probe,
+  hidraw_open,
+  hidraw_write,
+  hidraw_read,
+  hidraw_close,
+  hidraw_fd
+};
+
+#endif /* __linux */
@@ -0,0 +1,220 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Hotplug events for hidraw nodes, read straight from the netlink
+ * socket udev broadcasts on.  udev sends an event once its rules have
+ * run, so a node that is announced already carries the permissions
+ * given by 70-u2f.rules.  No libudev is needed.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#ifdef __linux
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <arpa/inet.h>
+
+/* multicast group of events sent by udev, the kernel uses 1 */
+#define UDEV_MONITOR_UDEV 2
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+
+/* Header in front of the properties of an event sent by udev. */
+struct udev_monitor_header
+{
+  char prefix[8];
+  unsigned magic;
+  unsigned header_size;
+  unsigned properties_off;
+  unsigned properties_len;
+  unsigned filter_subsystem_hash;
+  unsigned filter_devtype_hash;
+  unsigned filter_tag_bloom_hi;
+  unsigned filter_tag_bloom_lo;
+};
+
+/* Open a nonblocking socket receiving udev events into @fd. */
+int
+hotplug_open (int *fd)
+{
+  struct sockaddr_nl addr;
+  int on = 1;
+
+  *fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+  if (*fd < 0)
+    return U2FH_TRANSPORT_ERROR;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = UDEV_MONITOR_UDEV;
+  if (bind (*fd, (struct sockaddr *) &addr, sizeof (addr)) != 0
+      || setsockopt (*fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof (on)) != 0)
+    {
+      close (*fd);
+      *fd = -1;
+      return U2FH_TRANSPORT_ERROR;
+    }
+
+  return U2FH_OK;
+}
+
+void
+hotplug_close (int fd)
+{
+  if (fd >= 0)
+    close (fd);
+}
+
+/* Return the value of property @p of @n bytes if it is @key. */
+static const char *
+prop_value (const char *p, size_t n, const char *key)
+{
+  size_t keylen = strlen (key);
+
+  if (n < keylen || memcmp (p, key, keylen) != 0)
+    return NULL;
+  return p + keylen;
+}
+
+/* Look for hidraw events in the properties @p of @len bytes, storing
+   the action and the device node.  Returns 1 for a hidraw event. */
+static int
+parse_properties (const char *p, size_t len, char *action,
+		  size_t actionlen, char *path, size_t pathlen)
+{
+  const char *end = p + len;
+  int hidraw = 0;
+
+  *action = '\0';
+  *path = '\0';
+  while (p < end)
+    {
+      size_t n = strnlen (p, end - p);
+      const char *v;
+
+      if ((v = prop_value (p, n, "ACTION=")) != NULL)
+	snprintf (action, actionlen, "%.*s", (int) (p + n - v), v);
+      else if ((v = prop_value (p, n, "DEVNAME=")) != NULL && v < p + n)
+	snprintf (path, pathlen, "%s%.*s", *v == '/' ? "" : "/dev/",
+		  (int) (p + n - v), v);
+      else if ((v = prop_value (p, n, "SUBSYSTEM=")) != NULL)
+	hidraw = p + n - v == 6 && memcmp (v, "hidraw", 6) == 0;
+      p += n + 1;
+    }
+
+  return hidraw && *action != '\0' && *path != '\0';
+}
+
+/* Read the next hidraw event from @fd, storing its action, e.g. "add"
+   or "remove", and the path of the device node.  Other events are
+   skipped.  Returns 1 for an event, 0 once none is waiting, or
+   %U2FH_TRANSPORT_ERROR. */
+int
+hotplug_next (int fd, char *action, size_t actionlen, char *path,
+	      size_t pathlen)
+{
+  for (;;)
+    {
+      union
+      {
+	struct udev_monitor_header hdr;
+	char buf[8192];
+      } msg;
+      char control[CMSG_SPACE (sizeof (struct ucred))];
+      struct sockaddr_nl addr;
+      struct iovec iov;
+      struct msghdr mh;
+      struct cmsghdr *cmsg;
+      struct ucred *cred;
+      ssize_t n;
+
+      iov.iov_base = &msg;
+      iov.iov_len = sizeof (msg);
+      memset (&mh, 0, sizeof (mh));
+      mh.msg_name = &addr;
+      mh.msg_namelen = sizeof (addr);
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof (control);
+
+      n = recvmsg (fd, &mh, 0);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN)
+	    return 0;
+	  /* ENOBUFS: events were lost, the caller can rediscover */
+	  return U2FH_TRANSPORT_ERROR;
+	}
+
+      /* only trust udev, running as root */
+      cmsg = CMSG_FIRSTHDR (&mh);
+      if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS
+	  || addr.nl_pid == 0)
+	continue;
+      cred = (struct ucred *) CMSG_DATA (cmsg);
+      if (cred->uid != 0)
+	continue;
+
+      if ((size_t) n < sizeof (msg.hdr)
+	  || memcmp (msg.hdr.prefix, "libudev", 8) != 0
+	  || ntohl (msg.hdr.magic) != UDEV_MONITOR_MAGIC
+	  || msg.hdr.properties_off > (size_t) n
+	  || msg.hdr.properties_len > (size_t) n - msg.hdr.properties_off)
+	continue;
+
+      if (parse_properties (msg.buf + msg.hdr.properties_off,
+			    msg.hdr.properties_len, action, actionlen,
+			    path, pathlen))
+	return 1;
+    }
+}
+
+#else /* !__linux */
+
+int
+hotplug_open (int *fd)
+{
+  *fd = -1;
+  return U2FH_TRANSPORT_ERROR;
+}
+
+void
+hotplug_close (int fd)
+{
+  (void) fd;
+}
+
+int
+hotplug_next (int fd, char *action, size_t actionlen, char *path,
+	      size_t pathlen)
+{
+  (void) fd;
+  (void) action;
+  (void) actionlen;
+  (void) path;
+  (void) pathlen;
+  return 0;
+}
+
+#endif /* __linux */
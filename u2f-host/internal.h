@@ -19,7 +19,6 @@
 #define INTERNAL_H
 
 #include <u2f-host.h>
-#include <hidapi.h>
 #include <stdio.h>
 
 #include "inc/u2f.h"
@@ -29,18 +28,167 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <pthread.h>
 #define Sleep(x) (usleep((x) * 1000))
 #endif
 
+#ifdef _WIN32
+typedef CRITICAL_SECTION u2fh_mutex;
+#define mutex_init(m) InitializeCriticalSection (m)
+#define mutex_lock(m) EnterCriticalSection (m)
+#define mutex_unlock(m) LeaveCriticalSection (m)
+#define mutex_destroy(m) DeleteCriticalSection (m)
+typedef SRWLOCK u2fh_rwlock;
+#define rwlock_init(l) InitializeSRWLock (l)
+#define rwlock_rdlock(l) AcquireSRWLockShared (l)
+#define rwlock_rdunlock(l) ReleaseSRWLockShared (l)
+#define rwlock_wrlock(l) AcquireSRWLockExclusive (l)
+#define rwlock_wrunlock(l) ReleaseSRWLockExclusive (l)
+#define rwlock_destroy(l) ((void) (l))
+typedef CONDITION_VARIABLE u2fh_cond;
+#define cond_init(c) InitializeConditionVariable (c)
+#define cond_broadcast(c) WakeAllConditionVariable (c)
+#define cond_timedwait(c, m, ms) SleepConditionVariableCS (c, m, ms)
+#define cond_destroy(c) ((void) (c))
+#define refcount_inc(p) InterlockedIncrement (p)
+#define refcount_dec(p) InterlockedDecrement (p)
+#else
+typedef pthread_mutex_t u2fh_mutex;
+#define mutex_init(m) pthread_mutex_init (m, NULL)
+#define mutex_lock(m) pthread_mutex_lock (m)
+#define mutex_unlock(m) pthread_mutex_unlock (m)
+#define mutex_destroy(m) pthread_mutex_destroy (m)
+typedef pthread_rwlock_t u2fh_rwlock;
+#define rwlock_init(l) pthread_rwlock_init (l, NULL)
+#define rwlock_rdlock(l) pthread_rwlock_rdlock (l)
+#define rwlock_rdunlock(l) pthread_rwlock_unlock (l)
+#define rwlock_wrlock(l) pthread_rwlock_wrlock (l)
+#define rwlock_wrunlock(l) pthread_rwlock_unlock (l)
+#define rwlock_destroy(l) pthread_rwlock_destroy (l)
+typedef pthread_cond_t u2fh_cond;
+#define cond_init(c) pthread_cond_init (c, NULL)
+#define cond_broadcast(c) pthread_cond_broadcast (c)
+#define cond_destroy(c) pthread_cond_destroy (c)
+void cond_timedwait (u2fh_cond * c, u2fh_mutex * m, int ms);
+#define refcount_inc(p) __atomic_add_fetch (p, 1, __ATOMIC_ACQ_REL)
+#define refcount_dec(p) __atomic_sub_fetch (p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+/* Device found by a transport during enumeration. */
+struct u2fh_devinfo
+{
+  struct u2fh_devinfo *next;
+  const struct u2fh_transport *transport;
+  char *path;
+  char *product;
+};
+
+/*
+ * Transport backend moving raw HID reports of HID_RPT_SIZE bytes to
+ * and from a device.  Functions taking a @devs return an #u2fh_rc
+ * code, write and read return the number of bytes transferred or a
+ * negative value on errors.  The read function returns 0 if no
+ * report arrived within @timeout milliseconds.  The optional fd
+ * function returns a descriptor that polls readable when a report
+ * is waiting, or -1 if there is none.  The optional probe function
+ * looks at the single device node @path announced by a hotplug event
+ * and sets *info as enumerate would, or to NULL if it is not a U2F
+ * device of the transport.
+ */
+struct u2fh_transport
+{
+  const char *name;
+  int (*init) (u2fh_devs * devs);
+  void (*exit) (u2fh_devs * devs);
+  int (*enumerate) (u2fh_devs * devs, struct u2fh_devinfo ** list);
+  int (*probe) (u2fh_devs * devs, const char *path,
+		struct u2fh_devinfo ** info);
+  int (*open) (u2fh_devs * devs, const char *path, void **handle);
+  int (*write) (void *handle, const unsigned char *report, size_t len);
+  int (*read) (void *handle, unsigned char *report, size_t len,
+	       int timeout);
+  void (*close) (void *handle);
+  int (*fd) (void *handle);
+};
+
+extern const struct u2fh_transport hidapi_transport;
+extern const struct u2fh_transport softtoken_transport;
+#ifdef __linux
+extern const struct u2fh_transport hidraw_transport;
+int hidraw_get_usages (u2fh_devs * devs, const char *path,
+		       unsigned short *usage_page, unsigned short *usage);
+void hidraw_usages_sweep (u2fh_devs * devs);
+void hidraw_usages_done (u2fh_devs * devs);
+#endif
+
+#define MAX_TRANSPORTS 2
+
+/* Library context, see global.c. */
+struct u2fh_ctx
+{
+  int debug;
+  u2fh_initflags flags;
+  u2fh_log_cb log_cb;
+  void *log_arg;
+  /* default milliseconds to wait for a touch */
+  unsigned timeout;
+  /* milliseconds a device may go unused before it is closed, or 0 */
+  unsigned idle_timeout;
+};
+
+extern u2fh_ctx default_ctx;
+
+#define MAXDATASIZE 16384
+#define KH_DIGEST_SIZE 32
+/* most channels opened on one device, besides the broadcast one */
+#define MAX_CHANNELS 8
+
+/* A U2FHID channel of a device, see channel.c. */
+struct u2fh_channel
+{
+  struct u2fdevice *dev;
+  uint32_t cid;
+  int busy;
+  /* set after a transaction was abandoned, until its reply is through
+     or drain_until has passed */
+  int draining;
+  size_t drain_left;
+  uint64_t drain_until;
+  /* pipe readable while reports are queued */
+  int notify[2];
+  /* reports read by others for this channel */
+  unsigned char (*queue)[HID_RPT_SIZE];
+  size_t qhead, qlen, qsize;
+};
+
 struct u2fdevice
 {
-  struct u2fdevice *next;
-  hid_device *devh;
+  /* next device in the same bucket of the path table */
+  struct u2fdevice *path_next;
+  const struct u2fh_transport *transport;
+  /* NULL until the device is first used or after it was idle */
+  void *handle;
+  u2fh_devs *devs;
+  const u2fh_ctx *ctx;
   unsigned id;
-  uint32_t cid;
+  /* discovery that last saw the device */
+  unsigned seen;
+  /* one reference for the device table, one per user */
+  volatile long refs;
+  /* protects the transport handle and the channels */
+  u2fh_mutex io;
+  struct u2fh_channel *bcast;
+  struct u2fh_channel *channels[MAX_CHANNELS];
+  size_t nchannels;
+  int allocating;
+  /* signalled, and freed counted, whenever a channel may have become
+     free or may be opened */
+  u2fh_cond freed;
+  unsigned freed_gen;
+  /* when the last transaction ended */
+  uint64_t last_used;
   char *device_string;
   char *device_path;
-  int skipped;
   uint8_t versionInterface;	// Interface version
   uint8_t versionMajor;		// Major version number
   uint8_t versionMinor;		// Minor version number
@@ -50,31 +198,304 @@ struct u2fdevice
 
 struct u2fh_devs
 {
+  const u2fh_ctx *ctx;
+  /* protects max_id and the device and path tables */
+  u2fh_rwlock list_lock;
   unsigned max_id;
-  struct u2fdevice *first;
+  /* devices by id, slot i holding id base_id + i or NULL */
+  struct u2fdevice **table;
+  size_t table_size;
+  unsigned base_id;
+  size_t ndevices;
+  /* devices by path, npaths buckets chained through path_next */
+  struct u2fdevice **paths;
+  size_t npaths;
+  /* serializes discovery, protects the transports and softtokens */
+  u2fh_mutex discover_lock;
+  unsigned discover_gen;
+  const struct u2fh_transport *transports[MAX_TRANSPORTS];
+  size_t ntransports;
+  struct softtoken *softtokens;
+  /* socket receiving hotplug events, or -1 */
+  int monitor_fd;
+  /* copy of the filter given to u2fh_devs_set_filter() */
+  u2fh_devfilter filter;
+  /* classification of hidraw nodes, see hidraw.c */
+  struct hidraw_usage *usages;
+  unsigned usages_gen;
+  /* protects ops and their cancelled flags, adding softtokens and
+     the key handle cache */
+  u2fh_mutex lock;
+  struct u2fh_op *ops;
+  /* owners of key handles, KH_CACHE_SIZE entries, see khcache.c */
+  struct kh_route *routes;
 };
 
-extern int debug;
+/* One U2FHID transaction in flight on a device. */
+struct u2fh_xfer
+{
+  struct u2fdevice *dev;
+  struct u2fh_channel *ch;
+  /* the channel was taken by xfer_start() and is handed back */
+  int own_channel;
+  int state;
+  int rc;
+  uint8_t cmd;
+  uint8_t seq;
+  int have_init;
+  /* status of the last CTAPHID_KEEPALIVE, or 0 */
+  int keepalive;
+  uint64_t deadline;
+  uint64_t limit;
+  /* request kept for resending while the device is busy */
+  const unsigned char *req;
+  uint16_t reqlen;
+  uint64_t retry;
+  unsigned char *resp;
+  size_t resp_max;
+  size_t resp_len;
+  size_t resp_got;
+};
 
-#define MAXDATASIZE 16384
+/* A U2FHID_INIT asking a device for a new channel, see channel.c. */
+struct channel_open
+{
+  struct u2fdevice *dev;
+  struct u2fh_xfer x;
+  unsigned char nonce[INIT_NONCE_SIZE];
+  unsigned char resp[1024];
+};
+
+#define XFER_IDLE 0
+#define XFER_BUSY 1
+#define XFER_DONE 2
+
+/* One device taking part in a fanout. */
+struct fanout_dev
+{
+  struct u2fh_xfer x;
+  /* set while a channel is being opened for x */
+  int opening;
+  struct channel_open open;
+  int active;
+  unsigned interval;
+  uint64_t next_poll;
+  unsigned char resp[MAXDATASIZE];
+};
+
+/* A U2F APDU running on every device of a set, see fanout.c. */
+struct fanout
+{
+  struct fanout_dev *devs;
+  size_t n;
+  struct u2fh_xfer **busy;
+  size_t nbusy;
+  unsigned char apdu[MAXDATASIZE];
+  size_t apdulen;
+  int presence;
+  uint64_t deadline;
+  uint64_t wakeup;
+  int done;
+  int rc;
+  int notsatisfied;
+  int have_status;
+  unsigned char status[2];
+  /* asking only devs[route] so far, see fanout_route() */
+  int routed;
+  size_t route;
+  /* the device routed to did not own the key handle */
+  int rerouted;
+  /* the outcome, once fanout_step() stops returning U2FH_AGAIN */
+  const unsigned char *result;
+  size_t result_len;
+  /* the device that returned the result or 0x6985, if any */
+  struct u2fdevice *owner;
+};
+
+/* A register or authenticate request, parsed by request_parse(). */
+struct u2fh_request
+{
+  /* websafe base64 strings as found in the JSON */
+  char challenge[256];
+  char keyhandle[256];
+  int have_keyhandle;
+  /* SHA-256 of the application id */
+  unsigned char appparam[32];
+  /* the decoded key handle */
+  unsigned char kh[256];
+  size_t khlen;
+};
+
+/* An asynchronous register or authenticate operation. */
+struct u2fh_op
+{
+  struct u2fh_op *next;
+  u2fh_devs *devs;
+  int cancelled;
+  /* pipe written by u2fh_cancel() to wake up a waiting thread */
+  int wake[2];
+  int cmd;
+  u2fh_cmdflags flags;
+  /* started with binary parameters, see op_start_raw() */
+  int raw;
+  char bd[2048];
+  struct u2fh_request req;
+  /* application parameter, and digest of the key handle used */
+  unsigned char appparam[32];
+  unsigned char khdigest[KH_DIGEST_SIZE];
+  uint64_t started;
+  struct fanout fo;
+  int rc;
+};
 
 #define MAXFIXEDLEN 1024
 
+/* entries of the key handle cache of a device set */
+#define KH_CACHE_SIZE 256
+
 #define REGISTER_TYP "navigator.id.finishEnrollment"
 #define AUTHENTICATE_TYP "navigator.id.getAssertion"
 
+#define CTAPHID_CANCEL           (TYPE_INIT | 0x11)	// Cancel outstanding request
 #define CTAPHID_KEEPALIVE        (TYPE_INIT | 0x3b)	// Keepalive response
 
-int prepare_browserdata (const char *challenge, const char *origin,
-			 const char *typstr, char *out, size_t * outlen);
-int prepare_origin (const char *origin, unsigned char *p);
+// CTAPHID_KEEPALIVE status codes
+#define STATUS_PROCESSING       1	// Still processing the request
+#define STATUS_UPNEEDED         2	// Waiting for user presence
+
+#define CAPFLAG_CBOR            0x04	// Device supports CTAPHID_CBOR
+
+/* milliseconds before a request turned down with ERR_CHANNEL_BUSY is
+   sent again */
+#define CHANNEL_BUSY_RETRY 2
+/* longest milliseconds spent in one read from a transport without a
+   descriptor, while other threads wait for the device */
+#define READ_SLICE 5
+
+/* milliseconds between checks for cancellation where there is no
+   descriptor to wake up on */
+#define CANCEL_CHECK_INTERVAL 20
+
+/* milliseconds allowed for a complete response */
+#define HID_TRANS_TIMEOUT 8192
+/* default milliseconds to wait for the user to touch a device */
+#define PRESENCE_TIMEOUT 16000
+/* milliseconds between requests to a device waiting for a touch,
+   growing from the first to the second value */
+#define PRESENCE_POLL_INTERVAL 10
+#define PRESENCE_POLL_MAX 100
+
+int json_write_object (const char *const *keys, const char *const *values,
+		       size_t n, char **out, size_t * outlen);
+int prepare_browserdata (const u2fh_ctx * ctx, const char *challenge,
+			 const char *origin, const char *typstr, char *out,
+			 size_t * outlen);
+size_t build_apdu (int cmd, int p1, const unsigned char *d, size_t dlen,
+		   unsigned char *out);
 u2fh_rc send_apdu (u2fh_devs * devs, int index, int cmd,
 		   const unsigned char *d, size_t dlen, int p1,
 		   unsigned char *out, size_t * outlen);
-int get_fixed_json_data (const char *jsonstr, const char *key, char *p,
-			 size_t * len);
+int xfer_start (struct u2fh_xfer *x, struct u2fdevice *dev, uint8_t cmd,
+		const unsigned char *data, uint16_t len,
+		unsigned char *resp, size_t resp_max, uint64_t deadline);
+int xfer_start_on (struct u2fh_xfer *x, struct u2fh_channel *ch,
+		   uint8_t cmd, const unsigned char *data, uint16_t len,
+		   unsigned char *resp, size_t resp_max, uint64_t deadline);
+int xfer_start_own (struct u2fh_xfer *x, struct u2fh_channel *ch,
+		    uint8_t cmd, const unsigned char *data, uint16_t len,
+		    unsigned char *resp, size_t resp_max, uint64_t deadline);
+int xfer_poll (struct u2fh_xfer *x, uint64_t now);
+void xfer_wait (struct u2fh_xfer **xs, size_t n, uint64_t until,
+		int wakefd);
+size_t xfer_fds (struct u2fh_xfer *x, int *fds);
+void xfer_cancel (struct u2fh_xfer *x);
+void xfer_abandon (struct u2fh_xfer *x);
+int channel_open_start (struct channel_open *op, struct u2fdevice *dev,
+			uint64_t deadline);
+int channel_open_finish (struct channel_open *op, struct u2fh_channel **chp);
+void channel_open_abandon (struct channel_open *op);
+int channel_take (struct u2fdevice *dev, struct u2fh_channel **chp);
+int channel_acquire (struct u2fdevice *dev, uint64_t deadline,
+		     struct u2fh_channel **chp);
+void channel_release (struct u2fh_channel *ch, int abandoned);
+int channel_read (struct u2fh_channel *ch, unsigned char *report,
+		  int timeout);
+int channel_fd (struct u2fh_channel *ch);
+void channels_done (struct u2fdevice *dev);
+int fanout_start (struct fanout *f, u2fh_devs * devs, int cmd,
+		  const unsigned char *d, size_t dlen, int p1, int presence,
+		  unsigned timeout);
+int fanout_route (struct fanout *f, unsigned id);
+int fanout_step (struct fanout *f);
+void fanout_wait (struct fanout *f, int wakefd);
+void fanout_cancel (struct fanout *f);
+int fanout_fds (struct fanout *f, int *fds, size_t * nfds, int *timeout);
+int fanout_status (struct fanout *f);
+void fanout_done (struct fanout *f);
+int register_start (u2fh_devs * devs, const char *origin,
+		    u2fh_cmdflags flags, unsigned timeout, u2fh_op * op);
+int register_start_raw (u2fh_devs * devs, const unsigned char *challenge,
+			const unsigned char *appparam, u2fh_cmdflags flags,
+			unsigned timeout, u2fh_op * op);
+int register_response (u2fh_op * op, const unsigned char *buf, size_t len,
+		       char **response, size_t * response_len);
+void register_learn (u2fh_op * op);
+int authenticate_start (u2fh_devs * devs, const char *origin,
+			u2fh_cmdflags flags, unsigned timeout, u2fh_op * op);
+int authenticate_start_raw (u2fh_devs * devs, const unsigned char *challenge,
+			    const unsigned char *appparam,
+			    const unsigned char *kh, size_t khlen,
+			    u2fh_cmdflags flags, unsigned timeout,
+			    u2fh_op * op);
+int authenticate_response (u2fh_op * op, const unsigned char *buf,
+			   size_t len, char **response,
+			   size_t * response_len);
+void authenticate_learn (u2fh_op * op);
+int op_start (u2fh_devs * devs, int cmd, const char *challenge,
+	      const char *origin, u2fh_cmdflags flags,
+	      const u2fh_cmdopts * opts, u2fh_op ** op);
+int op_start_request (u2fh_devs * devs, int cmd, const u2fh_request * req,
+		      const char *origin, u2fh_cmdflags flags,
+		      const u2fh_cmdopts * opts, u2fh_op ** op);
+int op_start_raw (u2fh_devs * devs, int cmd, const unsigned char *challenge,
+		  const unsigned char *appparam, const unsigned char *kh,
+		  size_t khlen, u2fh_cmdflags flags,
+		  const u2fh_cmdopts * opts, u2fh_op ** op);
+int op_run (u2fh_op * op, u2fh_cmdopts * opts, char **response,
+	    size_t * response_len);
+int request_parse (struct u2fh_request *req, const char *challenge);
 int hash_data (const char *in, size_t len, unsigned char *out);
+void kh_digest (const unsigned char *appparam, const unsigned char *kh,
+		size_t khlen, unsigned char *digest);
+int kh_lookup (u2fh_devs * devs, const unsigned char *digest, unsigned *id);
+void kh_remember (u2fh_devs * devs, const unsigned char *digest,
+		  unsigned id);
+void kh_forget (u2fh_devs * devs, const unsigned char *digest);
+void kh_cache_done (u2fh_devs * devs);
 
 struct u2fdevice *get_device (u2fh_devs * devs, unsigned index);
+void hold_device (struct u2fdevice *dev);
+void put_device (struct u2fdevice *dev);
+int device_open (struct u2fdevice *dev);
+void free_devinfo (struct u2fh_devinfo *list);
+int filter_path (u2fh_devs * devs, const char *path);
+int filter_wants_ids (u2fh_devs * devs);
+int filter_ids (u2fh_devs * devs, unsigned short vendor_id,
+		unsigned short product_id, const char *serial);
+void filter_usb_hint (u2fh_devs * devs, unsigned short *vendor_id,
+		      unsigned short *product_id);
+int add_transport (u2fh_devs * devs, const struct u2fh_transport *transport);
+int obtain_nonce (unsigned char *nonce);
+int make_pipe (int *fds);
+int hotplug_open (int *fd);
+void hotplug_close (int fd);
+int hotplug_next (int fd, char *action, size_t actionlen, char *path,
+		  size_t pathlen);
+uint64_t monotonic_ms (void);
+void u2fh_log (const u2fh_ctx * ctx, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__ ((format (printf, 2, 3)))
+#endif
+  ;
 
 #endif
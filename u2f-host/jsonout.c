@@ -0,0 +1,157 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Writing the flat JSON objects of client data and responses.  They
+ * hold nothing but string members, so they are written straight into
+ * the output buffer instead of being built as json-c objects first.
+ * The text is the same as json-c prints: members in the order given,
+ * separated the same way, and strings escaped the same way.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+
+struct json_out
+{
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+/* Append @n bytes of @s, counting what does not fit. */
+static void
+out_bytes (struct json_out *o, const char *s, size_t n)
+{
+  if (o->len < o->size)
+    memcpy (o->buf + o->len, s,
+	    n < o->size - o->len ? n : o->size - o->len);
+  o->len += n;
+}
+
+static void
+out_string (struct json_out *o, const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+  const char *run = s;
+
+  out_bytes (o, "\"", 1);
+  for (; *s != '\0'; s++)
+    {
+      unsigned char c = *s;
+      char esc[6];
+      size_t n = 2;
+
+      esc[0] = '\\';
+      switch (c)
+	{
+	case '\b':
+	  esc[1] = 'b';
+	  break;
+	case '\n':
+	  esc[1] = 'n';
+	  break;
+	case '\r':
+	  esc[1] = 'r';
+	  break;
+	case '\t':
+	  esc[1] = 't';
+	  break;
+	case '\f':
+	  esc[1] = 'f';
+	  break;
+	case '"':
+	case '\\':
+	case '/':
+	  esc[1] = c;
+	  break;
+	default:
+	  if (c >= ' ')
+	    continue;
+	  memcpy (esc + 1, "u00", 3);
+	  esc[4] = hex[c >> 4];
+	  esc[5] = hex[c & 0xf];
+	  n = 6;
+	  break;
+	}
+      out_bytes (o, run, s - run);
+      out_bytes (o, esc, n);
+      run = s + 1;
+    }
+  out_bytes (o, run, s - run);
+  out_bytes (o, "\"", 1);
+}
+
+/* Write the object with the @n members @keys set to @values into @buf
+   of @size bytes.  Returns the length of the whole text; it is NUL
+   terminated if shorter than @size. */
+static size_t
+write_object (const char *const *keys, const char *const *values, size_t n,
+	      char *buf, size_t size)
+{
+  struct json_out o = { buf, size, 0 };
+  size_t i;
+
+  out_bytes (&o, "{", 1);
+  for (i = 0; i < n; i++)
+    {
+      out_bytes (&o, i == 0 ? " " : ", ", i == 0 ? 1 : 2);
+      out_string (&o, keys[i]);
+      out_bytes (&o, ": ", 2);
+      out_string (&o, values[i]);
+    }
+  out_bytes (&o, " }", 2);
+  if (o.len < size)
+    buf[o.len] = '\0';
+
+  return o.len;
+}
+
+/* Write the JSON object with the @n string members @keys set to
+   @values into *@out of *@outlen bytes, or into a newly allocated
+   string if *@out is NULL.  On success *@outlen is set to the length
+   of the text.  If it does not fit, %U2FH_SIZE_ERROR is returned and
+   *@outlen is set to the size needed. */
+int
+json_write_object (const char *const *keys, const char *const *values,
+		   size_t n, char **out, size_t * outlen)
+{
+  size_t len;
+
+  if (*out == NULL)
+    {
+      len = write_object (keys, values, n, NULL, 0);
+      *out = malloc (len + 1);
+      if (*out == NULL)
+	return U2FH_MEMORY_ERROR;
+      write_object (keys, values, n, *out, len + 1);
+    }
+  else
+    {
+      len = write_object (keys, values, n, *out, *outlen);
+      if (len >= *outlen)
+	{
+	  *outlen = len + 1;
+	  return U2FH_SIZE_ERROR;
+	}
+    }
+  *outlen = len;
+
+  return U2FH_OK;
+}
@@ -0,0 +1,135 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Which device owns a key handle.  Register and authenticate remember
+ * the device that created or recognized a key handle, so that later
+ * authentications with it are sent to that device alone instead of
+ * to every device of the set.  The cache is a fixed table indexed by
+ * a digest of the application parameter and the key handle; an entry
+ * whose slot is needed by another key handle is forgotten.  Device
+ * ids are never reused, so an entry for a device that is gone just
+ * misses.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+#include "sha256.h"
+
+struct kh_route
+{
+  unsigned char digest[KH_DIGEST_SIZE];
+  unsigned id;
+  int used;
+};
+
+/* Compute the digest identifying key handle @kh of @khlen bytes for
+   application parameter @appparam. */
+void
+kh_digest (const unsigned char *appparam, const unsigned char *kh,
+	   size_t khlen, unsigned char *digest)
+{
+  struct sha256_ctx ctx;
+  unsigned char len = khlen;
+
+  sha256_init_ctx (&ctx);
+  sha256_process_bytes (appparam, 32, &ctx);
+  sha256_process_bytes (&len, 1, &ctx);
+  sha256_process_bytes (kh, khlen, &ctx);
+  sha256_finish_ctx (&ctx, digest);
+}
+
+/* slots are picked by masking the digest, so the size has to be a
+   power of two, no larger than 2^24 */
+typedef char kh_cache_size_check[(KH_CACHE_SIZE & (KH_CACHE_SIZE - 1)) == 0
+				 && KH_CACHE_SIZE <= 1 << 24 ? 1 : -1];
+
+static struct kh_route *
+kh_slot (u2fh_devs * devs, const unsigned char *digest)
+{
+  size_t i = ((size_t) digest[0] | (size_t) digest[1] << 8
+	      | (size_t) digest[2] << 16) & (KH_CACHE_SIZE - 1);
+
+  return &devs->routes[i];
+}
+
+/* Store in @id the device that owns the key handle with @digest.
+   Returns 1 if it is known. */
+int
+kh_lookup (u2fh_devs * devs, const unsigned char *digest, unsigned *id)
+{
+  struct kh_route *r;
+  int found = 0;
+
+  mutex_lock (&devs->lock);
+  if (devs->routes != NULL)
+    {
+      r = kh_slot (devs, digest);
+      if (r->used && memcmp (r->digest, digest, KH_DIGEST_SIZE) == 0)
+	{
+	  *id = r->id;
+	  found = 1;
+	}
+    }
+  mutex_unlock (&devs->lock);
+
+  return found;
+}
+
+/* Remember that device @id owns the key handle with @digest. */
+void
+kh_remember (u2fh_devs * devs, const unsigned char *digest, unsigned id)
+{
+  struct kh_route *r;
+
+  mutex_lock (&devs->lock);
+  if (devs->routes == NULL)
+    devs->routes = calloc (KH_CACHE_SIZE, sizeof (*devs->routes));
+  if (devs->routes != NULL)
+    {
+      r = kh_slot (devs, digest);
+      memcpy (r->digest, digest, KH_DIGEST_SIZE);
+      r->id = id;
+      r->used = 1;
+    }
+  mutex_unlock (&devs->lock);
+}
+
+/* Forget the owner of the key handle with @digest. */
+void
+kh_forget (u2fh_devs * devs, const unsigned char *digest)
+{
+  struct kh_route *r;
+
+  mutex_lock (&devs->lock);
+  if (devs->routes != NULL)
+    {
+      r = kh_slot (devs, digest);
+      if (r->used && memcmp (r->digest, digest, KH_DIGEST_SIZE) == 0)
+	r->used = 0;
+    }
+  mutex_unlock (&devs->lock);
+}
+
+void
+kh_cache_done (u2fh_devs * devs)
+{
+  free (devs->routes);
+  devs->routes = NULL;
+}
@@ -0,0 +1,401 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Register and authenticate as operations that are advanced step by
+ * step.  The blocking u2fh_register() and u2fh_authenticate() calls
+ * run the same steps and wait in between.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+
+static int
+op_new (u2fh_devs * devs, int cmd, u2fh_cmdflags flags, u2fh_op ** op)
+{
+  u2fh_op *o;
+  int rc;
+
+  o = calloc (1, sizeof (*o));
+  if (o == NULL)
+    return U2FH_MEMORY_ERROR;
+  o->devs = devs;
+  o->cmd = cmd;
+  o->flags = flags;
+  o->rc = U2FH_AGAIN;
+  o->started = monotonic_ms ();
+
+  rc = make_pipe (o->wake);
+  if (rc != U2FH_OK)
+    {
+      free (o);
+      return rc;
+    }
+
+  *op = o;
+  return U2FH_OK;
+}
+
+/* Hand out @o, once started, where u2fh_cancel() can find it. */
+static void
+op_link (u2fh_op * o, u2fh_op ** op)
+{
+  mutex_lock (&o->devs->lock);
+  o->next = o->devs->ops;
+  o->devs->ops = o;
+  mutex_unlock (&o->devs->lock);
+
+  *op = o;
+}
+
+/* Start @o, which has its request set. */
+static int
+op_begin (u2fh_op * o, const char *origin, const u2fh_cmdopts * opts,
+	  u2fh_op ** op)
+{
+  unsigned timeout = opts ? opts->timeout : 0;
+  int rc;
+
+  if (o->cmd == U2F_REGISTER)
+    rc = register_start (o->devs, origin, o->flags, timeout, o);
+  else
+    rc = authenticate_start (o->devs, origin, o->flags, timeout, o);
+  if (rc != U2FH_OK)
+    {
+      u2fh_op_done (o);
+      return rc;
+    }
+
+  op_link (o, op);
+  return U2FH_OK;
+}
+
+int
+op_start (u2fh_devs * devs, int cmd, const char *challenge,
+	  const char *origin, u2fh_cmdflags flags,
+	  const u2fh_cmdopts * opts, u2fh_op ** op)
+{
+  u2fh_op *o;
+  int rc;
+
+  rc = op_new (devs, cmd, flags, &o);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = request_parse (&o->req, challenge);
+  if (rc != U2FH_OK)
+    {
+      u2fh_op_done (o);
+      return rc;
+    }
+
+  return op_begin (o, origin, opts, op);
+}
+
+/* Start @cmd with @req, parsed before by u2fh_request_init(). */
+int
+op_start_request (u2fh_devs * devs, int cmd, const u2fh_request * req,
+		  const char *origin, u2fh_cmdflags flags,
+		  const u2fh_cmdopts * opts, u2fh_op ** op)
+{
+  u2fh_op *o;
+  int rc;
+
+  rc = op_new (devs, cmd, flags, &o);
+  if (rc != U2FH_OK)
+    return rc;
+  o->req = *req;
+
+  return op_begin (o, origin, opts, op);
+}
+
+/* Start @cmd with the binary parameters of the APDU, for which the
+   response is the bytes returned by the device. */
+int
+op_start_raw (u2fh_devs * devs, int cmd, const unsigned char *challenge,
+	      const unsigned char *appparam, const unsigned char *kh,
+	      size_t khlen, u2fh_cmdflags flags, const u2fh_cmdopts * opts,
+	      u2fh_op ** op)
+{
+  unsigned timeout = opts ? opts->timeout : 0;
+  u2fh_op *o;
+  int rc;
+
+  rc = op_new (devs, cmd, flags, &o);
+  if (rc != U2FH_OK)
+    return rc;
+  o->raw = 1;
+
+  if (cmd == U2F_REGISTER)
+    rc = register_start_raw (devs, challenge, appparam, flags, timeout, o);
+  else
+    rc = authenticate_start_raw (devs, challenge, appparam, kh, khlen,
+				 flags, timeout, o);
+  if (rc != U2FH_OK)
+    {
+      u2fh_op_done (o);
+      return rc;
+    }
+
+  op_link (o, op);
+  return U2FH_OK;
+}
+
+/* Copy the response of @op, status word included, to @response. */
+static int
+raw_response (u2fh_op * op, unsigned char *response, size_t * response_len)
+{
+  if (op->fo.result_len > *response_len)
+    {
+      *response_len = op->fo.result_len;
+      return U2FH_SIZE_ERROR;
+    }
+  memcpy (response, op->fo.result, op->fo.result_len);
+  *response_len = op->fo.result_len;
+
+  return U2FH_OK;
+}
+
+static int
+op_step (u2fh_op * op, char **response, size_t * response_len)
+{
+  if (op->rc == U2FH_AGAIN)
+    {
+      int cancelled;
+
+      mutex_lock (&op->devs->lock);
+      cancelled = op->cancelled;
+      mutex_unlock (&op->devs->lock);
+
+      if (cancelled)
+	{
+	  fanout_cancel (&op->fo);
+	  op->rc = U2FH_CANCELLED;
+	}
+      else
+	op->rc = fanout_step (&op->fo);
+      if (op->rc != U2FH_AGAIN && op->cmd == U2F_AUTHENTICATE)
+	authenticate_learn (op);
+      else if (op->rc != U2FH_AGAIN)
+	register_learn (op);
+    }
+  if (op->rc != U2FH_OK)
+    return op->rc;
+
+  if (op->raw)
+    return raw_response (op, (unsigned char *) *response, response_len);
+
+  if (op->cmd == U2F_REGISTER)
+    return register_response (op, op->fo.result, op->fo.result_len,
+			      response, response_len);
+  return authenticate_response (op, op->fo.result, op->fo.result_len,
+				response, response_len);
+}
+
+/* Run @op to completion, blocking in between steps, and store the
+   time taken in @opts if given. */
+int
+op_run (u2fh_op * op, u2fh_cmdopts * opts, char **response,
+	size_t * response_len)
+{
+  u2fh_status_cb status_cb = opts ? opts->status_cb : NULL;
+  int status = U2FH_STATUS_IDLE;
+  int rc;
+
+  while ((rc = op_step (op, response, response_len)) == U2FH_AGAIN)
+    {
+      if (status_cb && fanout_status (&op->fo) != status)
+	{
+	  status = fanout_status (&op->fo);
+	  status_cb (status, opts->status_arg);
+	}
+      fanout_wait (&op->fo, op->wake[0]);
+    }
+
+  if (opts)
+    opts->elapsed = monotonic_ms () - op->started;
+
+  return rc;
+}
+
+/**
+ * u2fh_op_fds:
+ * @op: an operation, from u2fh_register_start() or
+ *   u2fh_authenticate_start().
+ * @fds: array for file descriptors to wait on.
+ * @nfds: on input the size of @fds, on output the number of
+ *   descriptors stored.
+ * @timeout: output variable for the time in milliseconds to wait at
+ *   most.
+ *
+ * Tell what to wait for before the next call to u2fh_step().  Wait
+ * until one of @fds is readable, e.g. with poll(), or until @timeout
+ * milliseconds have passed, whichever comes first.  Devices whose
+ * transport has no descriptor are covered by a short @timeout.  The
+ * descriptors include one that becomes readable when u2fh_cancel()
+ * is called for @op.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned.  If @fds is
+ * too small %U2FH_SIZE_ERROR is returned and @nfds holds the size
+ * needed.
+ */
+u2fh_rc
+u2fh_op_fds (u2fh_op * op, int *fds, size_t * nfds, int *timeout)
+{
+  size_t size = *nfds;
+  int rc;
+
+  if (op->rc != U2FH_AGAIN)
+    {
+      *nfds = 0;
+      *timeout = 0;
+      return U2FH_OK;
+    }
+
+  rc = fanout_fds (&op->fo, fds, nfds, timeout);
+  if (op->wake[0] >= 0)
+    {
+      if (rc == U2FH_OK && *nfds < size)
+	fds[*nfds] = op->wake[0];
+      else
+	rc = U2FH_SIZE_ERROR;
+      ++*nfds;
+    }
+#ifdef _WIN32
+  if (*timeout > CANCEL_CHECK_INTERVAL)
+    *timeout = CANCEL_CHECK_INTERVAL;
+#endif
+
+  return rc;
+}
+
+/**
+ * u2fh_op_status:
+ * @op: an operation, from u2fh_register_start() or
+ *   u2fh_authenticate_start().
+ *
+ * Tell how @op is progressing, for instance to prompt the user for a
+ * touch once %U2FH_STATUS_UPNEEDED is returned.
+ *
+ * Returns: the #u2fh_status of @op.
+ */
+u2fh_status
+u2fh_op_status (u2fh_op * op)
+{
+  if (op->rc != U2FH_AGAIN)
+    return U2FH_STATUS_IDLE;
+
+  return fanout_status (&op->fo);
+}
+
+/**
+ * u2fh_step:
+ * @op: an operation, from u2fh_register_start() or
+ *   u2fh_authenticate_start().
+ * @response: buffer for the JSON response.
+ * @response_len: pointer to length of @response.
+ *
+ * Advance @op without blocking.  While the operation is waiting for
+ * devices %U2FH_AGAIN is returned; wait as told by u2fh_op_fds() and
+ * call this function again.  Once the operation has finished, the
+ * response is written to @response like u2fh_register2() and
+ * u2fh_authenticate2() do.  After %U2FH_SIZE_ERROR the call can be
+ * repeated with a larger buffer.
+ *
+ * Returns: %U2FH_AGAIN while the operation is running, %U2FH_OK
+ * (integer 0) on success, or another #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_step (u2fh_op * op, char *response, size_t * response_len)
+{
+  return op_step (op, &response, response_len);
+}
+
+/**
+ * u2fh_op_done:
+ * @op: an operation, from u2fh_register_start() or
+ *   u2fh_authenticate_start().
+ *
+ * Release all resources held by @op.  An operation that is still
+ * running is abandoned.
+ */
+void
+u2fh_op_done (u2fh_op * op)
+{
+  u2fh_op **p;
+
+  if (op == NULL)
+    return;
+
+  mutex_lock (&op->devs->lock);
+  for (p = &op->devs->ops; *p != NULL; p = &(*p)->next)
+    if (*p == op)
+      {
+	*p = op->next;
+	break;
+      }
+  mutex_unlock (&op->devs->lock);
+
+#ifndef _WIN32
+  if (op->wake[0] >= 0)
+    {
+      close (op->wake[0]);
+      close (op->wake[1]);
+    }
+#endif
+  fanout_done (&op->fo);
+  free (op);
+}
+
+/**
+ * u2fh_cancel:
+ * @devs: a device set handle, from u2fh_devs_init().
+ * @op: the operation to cancel, or %NULL for all operations on @devs.
+ *
+ * Cancel a register or authenticate operation.  This function may be
+ * called from any thread.  The operation stops waiting right away and
+ * returns %U2FH_CANCELLED, from u2fh_step() or from the blocking
+ * call running it.  Devices that support it are told to abandon the
+ * request.  Passing %NULL for @op is the way to cancel blocking calls
+ * such as u2fh_register2().  Operations that already finished are
+ * not affected.
+ *
+ * Returns: %U2FH_OK (integer 0).
+ */
+u2fh_rc
+u2fh_cancel (u2fh_devs * devs, u2fh_op * op)
+{
+  u2fh_op *o;
+
+  mutex_lock (&devs->lock);
+  for (o = devs->ops; o != NULL; o = o->next)
+    {
+      if (op != NULL && o != op)
+	continue;
+      o->cancelled = 1;
+#ifndef _WIN32
+      if (o->wake[1] >= 0 && write (o->wake[1], "", 1) < 0
+	  && devs->ctx->debug)
+	u2fh_log (devs->ctx, "cannot wake up cancelled operation");
+#endif
+    }
+  mutex_unlock (&devs->lock);
+
+  return U2FH_OK;
+}
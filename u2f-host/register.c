@@ -18,82 +18,46 @@
 #include <config.h>
 #include "internal.h"
 
-#include <json.h>
-#include "b64/cencode.h"
+#include "b64/b64url.h"
 #include "sha256.h"
 
+/* offset of the key handle in the response */
+#define KH_OFFSET (1 + 65 + 1)
+
+/* longest registration data a device may return, which bounds both
+   the responses and u2fh_register_size() */
+#define MAX_REGISTRATION_DATA \
+  (KH_OFFSET + U2F_MAX_KH_SIZE + U2F_MAX_ATT_CERT_SIZE + U2F_MAX_EC_SIG_SIZE)
+
 static int
 prepare_response2 (const char *respstr, const char *bdstr, char **response,
 		   size_t * response_len)
 {
-  int rc = U2FH_JSON_ERROR;
-  struct json_object *jo = NULL, *resp = NULL, *bd = NULL;
-  const char *reply;
-
-  bd = json_object_new_string (bdstr);
-  if (bd == NULL)
-    goto done;
-  resp = json_object_new_string (respstr);
-  if (resp == NULL)
-    goto done;
-
-  jo = json_object_new_object ();
-  if (jo == NULL)
-    goto done;
-
-  json_object_object_add (jo, "registrationData", json_object_get (resp));
-  json_object_object_add (jo, "clientData", json_object_get (bd));
-
-  reply = json_object_to_json_string (jo);
-  if (*response == NULL)
-    {
-      *response = strdup (reply);
-    }
-  else
-    {
-      if (strlen (reply) >= *response_len)
-	{
-	  rc = U2FH_SIZE_ERROR;
-	  *response_len = strlen (reply) + 1;
-	  goto done;
-	}
-      strcpy (*response, reply);
-    }
-  *response_len = strlen (reply);
-  if (*response == NULL)
-    rc = U2FH_MEMORY_ERROR;
-  else
-    rc = U2FH_OK;
+  static const char *const keys[] = { "registrationData", "clientData" };
+  const char *values[2];
 
-done:
-  json_object_put (jo);
-  json_object_put (resp);
-  json_object_put (bd);
+  values[0] = respstr;
+  values[1] = bdstr;
 
-  return rc;
+  return json_write_object (keys, values, 2, response, response_len);
 }
 
 static int
 prepare_response (const unsigned char *buf, int len, const char *bd,
 		  char **response, size_t * response_len)
 {
-  base64_encodestate b64ctx;
-  char b64resp[2048];
-  char bdstr[2048];
-  int cnt;
+  char b64resp[B64URL_ENCODED_LEN (MAX_REGISTRATION_DATA) + 1];
+  char bdstr[B64URL_ENCODED_LEN (2048) + 1];
+  size_t bdlen = strlen (bd);
 
-  if (len > 2048)
-    return U2FH_MEMORY_ERROR;
-  if (strlen (bd) > 2048)
+  /* a device exceeding the limits of U2F is not followed */
+  if (len < 0 || (size_t) len > MAX_REGISTRATION_DATA)
+    return U2FH_AUTHENTICATOR_ERROR;
+  if (B64URL_ENCODED_LEN (bdlen) >= sizeof (bdstr))
     return U2FH_MEMORY_ERROR;
 
-  base64_init_encodestate (&b64ctx);
-  cnt = base64_encode_block (buf, len, b64resp, &b64ctx);
-  base64_encode_blockend (b64resp + cnt, &b64ctx);
-
-  base64_init_encodestate (&b64ctx);
-  cnt = base64_encode_block (bd, strlen (bd), bdstr, &b64ctx);
-  base64_encode_blockend (bdstr + cnt, &b64ctx);
+  b64url_encode (buf, len, b64resp);
+  b64url_encode ((const unsigned char *) bd, bdlen, bdstr);
 
   return prepare_response2 (b64resp, bdstr, response, response_len);
 }
@@ -101,78 +65,92 @@ prepare_response (const unsigned char *buf, int len, const char *bd,
 #define V2CHALLEN 32
 
 #define HOSIZE 32
-#define NOTSATISFIED "\x69\x85"
+
+int
+register_start (u2fh_devs * devs, const char *origin, u2fh_cmdflags flags,
+		unsigned timeout, u2fh_op * op)
+{
+  unsigned char data[V2CHALLEN];
+  size_t bdlen = sizeof (op->bd);
+  int rc;
+
+  if (devs->ctx->debug)
+    u2fh_log (devs->ctx, "JSON challenge URL-B64: %s", op->req.challenge);
+
+  rc = prepare_browserdata (devs->ctx, op->req.challenge, origin,
+			    REGISTER_TYP, op->bd, &bdlen);
+  if (rc != U2FH_OK)
+    return rc;
+
+  sha256_buffer (op->bd, bdlen, data);
+
+  return register_start_raw (devs, data, op->req.appparam, flags, timeout,
+			     op);
+}
+
+/* Start registering with the 32-byte challenge and application
+   parameters of the APDU. */
+int
+register_start_raw (u2fh_devs * devs, const unsigned char *challenge,
+		    const unsigned char *appparam, u2fh_cmdflags flags,
+		    unsigned timeout, u2fh_op * op)
+{
+  unsigned char data[V2CHALLEN + HOSIZE];
+
+  memcpy (data, challenge, V2CHALLEN);
+  memcpy (data + V2CHALLEN, appparam, HOSIZE);
+  memcpy (op->appparam, appparam, HOSIZE);
+
+  return fanout_start (&op->fo, devs, U2F_REGISTER, data, sizeof (data),
+		       flags & U2FH_REQUEST_USER_PRESENCE ? 3 : 0,
+		       flags & U2FH_REQUEST_USER_PRESENCE, timeout);
+}
+
+/* Remember the device that created the key handle of @op, which has
+   finished, for authenticating with it. */
+void
+register_learn (u2fh_op * op)
+{
+  const unsigned char *buf = op->fo.result;
+  size_t len = op->fo.result_len;
+  unsigned char digest[KH_DIGEST_SIZE];
+
+  /* the key handle follows the reserved byte and the public key */
+  if (op->rc != U2FH_OK || op->fo.owner == NULL || len <= KH_OFFSET + 2
+      || buf[0] != 0x05 || KH_OFFSET + (size_t) buf[KH_OFFSET - 1] + 2 > len)
+    return;
+
+  kh_digest (op->appparam, buf + KH_OFFSET, buf[KH_OFFSET - 1], digest);
+  kh_remember (op->devs, digest, op->fo.owner->id);
+}
+
+int
+register_response (u2fh_op * op, const unsigned char *buf, size_t len,
+		   char **response, size_t * response_len)
+{
+  if (len == 2)
+    return U2FH_TRANSPORT_ERROR;
+
+  return prepare_response (buf, len - 2, op->bd, response, response_len);
+}
 
 static u2fh_rc
 _u2fh_register (u2fh_devs * devs,
 		const char *challenge,
 		const char *origin, char **response, size_t * response_len,
-		u2fh_cmdflags flags)
+		u2fh_cmdflags flags, u2fh_cmdopts * opts)
 {
-  unsigned char data[V2CHALLEN + HOSIZE];
-  unsigned char buf[MAXDATASIZE];
-  char bd[2048];
-  size_t bdlen = sizeof (bd);
-  size_t len;
-  int rc = U2FH_JSON_ERROR;
-  char chalb64[256];
-  size_t challen = sizeof (chalb64);
-  int iterations = 0;
-
-  rc = get_fixed_json_data (challenge, "challenge", chalb64, &challen);
-  if (rc != U2FH_OK)
-    {
-      return rc;
-    }
+  u2fh_op *op;
+  int rc;
 
-  rc = prepare_browserdata (chalb64, origin, REGISTER_TYP, bd, &bdlen);
+  rc = op_start (devs, U2F_REGISTER, challenge, origin, flags, opts, &op);
   if (rc != U2FH_OK)
     return rc;
 
-  sha256_buffer (bd, bdlen, data);
-
-  prepare_origin (challenge, data + V2CHALLEN);
-
-  /* FIXME: Support asynchronous usage, through a new u2fh_cmdflags
-     flag. */
-
-  do
-    {
-      struct u2fdevice *dev;
-      if (iterations++ > 15)
-	{
-	  return U2FH_TIMEOUT_ERROR;
-	}
-      for (dev = devs->first; dev != NULL; dev = dev->next)
-	{
-	  len = MAXDATASIZE;
-	  rc = send_apdu (devs, dev->id, U2F_REGISTER, data, sizeof (data),
-			  flags & U2FH_REQUEST_USER_PRESENCE ? 3 : 0, buf,
-			  &len);
-	  if (rc != U2FH_OK)
-	    {
-	      return rc;
-	    }
-	  else if (len != 2)
-	    {
-	      break;
-	    }
-	}
-      if (len != 2)
-	{
-	  break;
-	}
-      Sleep (1000);
-    }
-  while ((flags & U2FH_REQUEST_USER_PRESENCE)
-	 && len == 2 && memcmp (buf, NOTSATISFIED, 2) == 0);
-
-  if (len != 2)
-    {
-      prepare_response (buf, len - 2, bd, response, response_len);
-      return U2FH_OK;
-    }
-  return U2FH_TRANSPORT_ERROR;
+  rc = op_run (op, opts, response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
 }
 
 /**
@@ -196,7 +174,33 @@ u2fh_register2 (u2fh_devs * devs,
 		u2fh_cmdflags flags)
 {
   return _u2fh_register (devs, challenge, origin, &response, response_len,
-			 flags);
+			 flags, NULL);
+}
+
+/**
+ * u2fh_register3:
+ * @devs: a device set handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @response: pointer to output string with JSON data.
+ * @response_len: pointer to length of @response
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Register operation like u2fh_register2(), giving up
+ * after the timeout in @opts.  The time taken is stored in @opts.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_register3 (u2fh_devs * devs,
+		const char *challenge,
+		const char *origin, char *response, size_t * response_len,
+		u2fh_cmdflags flags, u2fh_cmdopts * opts)
+{
+  return _u2fh_register (devs, challenge, origin, &response, response_len,
+			 flags, opts);
 }
 
 /**
@@ -220,5 +224,151 @@ u2fh_register (u2fh_devs * devs,
   size_t response_len = 0;
   *response = NULL;
   return _u2fh_register (devs, challenge, origin, response, &response_len,
-			 flags);
+			 flags, NULL);
+}
+
+/**
+ * u2fh_register_size:
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @size: output variable for the size of the response buffer needed.
+ *
+ * Compute the size, terminating NUL included, of the largest response
+ * u2fh_register2() may return for @challenge and @origin.  A buffer of
+ * that size is never too small, so the operation does not have to be
+ * repeated, and the user asked to touch the device again, because of
+ * %U2FH_SIZE_ERROR.  A device returning more data than U2F allows
+ * fails with %U2FH_AUTHENTICATOR_ERROR instead.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_register_size (const char *challenge, const char *origin,
+		    size_t * size)
+{
+  static const unsigned char data[MAX_REGISTRATION_DATA];
+  struct u2fh_request req;
+  char bd[2048];
+  size_t bdlen = sizeof (bd);
+  char c, *response = &c;
+  int rc;
+
+  rc = request_parse (&req, challenge);
+  if (rc != U2FH_OK)
+    return rc;
+  rc = prepare_browserdata (&default_ctx, req.challenge, origin,
+			    REGISTER_TYP, bd, &bdlen);
+  if (rc != U2FH_OK)
+    return rc;
+
+  /* measure the response to the longest data, in an empty buffer */
+  *size = 0;
+  rc = prepare_response (data, sizeof (data), bd, &response, size);
+  if (rc == U2FH_SIZE_ERROR)
+    rc = U2FH_OK;
+
+  return rc;
+}
+
+/**
+ * u2fh_register_start:
+ * @devs: a device set handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: string with JSON data containing the challenge.
+ * @origin: U2F origin URL.
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ * @op: pointer to output handle for the operation.
+ *
+ * Start the U2F Register operation without waiting for it.  Drive it
+ * to completion with u2fh_op_fds() and u2fh_step(), and release it
+ * with u2fh_op_done().  The elapsed field of @opts is not used.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_register_start (u2fh_devs * devs,
+		     const char *challenge,
+		     const char *origin, u2fh_cmdflags flags,
+		     const u2fh_cmdopts * opts, u2fh_op ** op)
+{
+  return op_start (devs, U2F_REGISTER, challenge, origin, flags, opts, op);
+}
+
+/**
+ * u2fh_register_request:
+ * @devs: a device set handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @req: the request, from u2fh_request_init().
+ * @origin: U2F origin URL.
+ * @response: pointer to output string with JSON data.
+ * @response_len: pointer to length of @response
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Register operation like u2fh_register3(), with the
+ * challenge parsed before.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, and on errors
+ * an #u2fh_rc error code.
+ */
+u2fh_rc
+u2fh_register_request (u2fh_devs * devs, const u2fh_request * req,
+		       const char *origin, char *response,
+		       size_t * response_len, u2fh_cmdflags flags,
+		       u2fh_cmdopts * opts)
+{
+  u2fh_op *op;
+  int rc;
+
+  rc = op_start_request (devs, U2F_REGISTER, req, origin, flags, opts, &op);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = op_run (op, opts, &response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
+}
+
+/**
+ * u2fh_register_raw:
+ * @devs: a device set handle, from u2fh_devs_init() and u2fh_devs_discover().
+ * @challenge: the 32-byte challenge parameter, the SHA-256 hash of the
+ *   client data.
+ * @appparam: the 32-byte application parameter, the SHA-256 hash of
+ *   the application id.
+ * @response: buffer for the response of the device.
+ * @response_len: on input the size of @response, on output the length
+ *   of the response.
+ * @flags: set of ORed #u2fh_cmdflags values.
+ * @opts: a #u2fh_cmdopts with the timeout to use, or %NULL.
+ *
+ * Perform the U2F Register operation on binary parameters, for callers
+ * that build the client data themselves.  No JSON or base64 is
+ * involved: the registration data returned by the device is stored
+ * in @response as is, followed by the two-byte status word.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned.  If @response
+ * is too small %U2FH_SIZE_ERROR is returned and @response_len holds
+ * the size needed.  Otherwise an #u2fh_rc error code is returned.
+ */
+u2fh_rc
+u2fh_register_raw (u2fh_devs * devs, const unsigned char *challenge,
+		   const unsigned char *appparam, unsigned char *response,
+		   size_t * response_len, u2fh_cmdflags flags,
+		   u2fh_cmdopts * opts)
+{
+  u2fh_op *op;
+  int rc;
+
+  rc = op_start_raw (devs, U2F_REGISTER, challenge, appparam, NULL, 0,
+		     flags, opts, &op);
+  if (rc != U2FH_OK)
+    return rc;
+
+  rc = op_run (op, opts, (char **) &response, response_len);
+  u2fh_op_done (op);
+
+  return rc;
 }
@@ -0,0 +1,708 @@
+/*
+  Copyright (C) 2013-2015 Yubico AB
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * In-process software U2F token.  It speaks U2FHID framing and the
+ * U2F_REGISTER, U2F_AUTHENTICATE and U2F_VERSION APDUs so that the
+ * whole host-side protocol path can be run without hardware.
+ *
+ * The token does not implement elliptic curve cryptography.  Public
+ * keys, attestation certificates and signatures have the right shape
+ * and size but are derived from SHA-256 and cannot be verified.  Key
+ * handles are bound to the application parameter, so authenticating
+ * with a foreign key handle fails like it does on a real device.
+ */
+
+#include <config.h>
+#include "internal.h"
+
+#include <stdlib.h>
+
+#include "sha256.h"
+
+#define SOFTTOKEN_PREFIX "softtoken:"
+#define SOFTTOKEN_PRODUCT "Software U2F token"
+
+#define KH_NONCE_SIZE 32
+#define KH_SIZE (KH_NONCE_SIZE + 32)
+#define ATT_CERT_SIZE 512
+#define EC_SIG_SIZE 70
+
+#define SW_NO_ERROR 0x9000
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_WRONG_DATA 0x6a80
+#define SW_WRONG_LENGTH 0x6700
+#define SW_INS_NOT_SUPPORTED 0x6d00
+#define SW_CLA_NOT_SUPPORTED 0x6e00
+
+#define U2F_AUTH_DONT_ENFORCE 0x08
+
+/* most requests turned away with ERR_CHANNEL_BUSY at a time */
+#define MAX_BUSY_REPLIES 8
+
+struct softtoken
+{
+  struct softtoken *next;
+  unsigned num;
+  unsigned presence_delay;
+  unsigned char secret[32];
+  uint32_t counter;
+  uint32_t next_cid;
+  int presence_pending;
+  uint64_t presence_start;
+
+  /* request being assembled from incoming frames */
+  uint32_t req_cid;
+  uint8_t req_cmd;
+  uint8_t req_seq;
+  size_t req_len;
+  size_t req_got;
+  unsigned char req[MAXDATASIZE];
+
+  /* response waiting to be read */
+  uint32_t resp_cid;
+  uint8_t resp_cmd;
+  uint8_t resp_seq;
+  size_t resp_len;
+  size_t resp_off;
+  int resp_pending;
+  unsigned char resp[MAXDATASIZE];
+
+  /* channels whose request arrived while the token was busy with
+     another channel, waiting for their ERR_CHANNEL_BUSY */
+  uint32_t busy_cid[MAX_BUSY_REPLIES];
+  size_t nbusy;
+};
+
+static void
+put_be16 (unsigned char *p, unsigned v)
+{
+  p[0] = (v >> 8) & 0xff;
+  p[1] = v & 0xff;
+}
+
+static void
+put_be32 (unsigned char *p, uint32_t v)
+{
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+static void
+derive (const struct softtoken *t, const char *label,
+	const unsigned char *a, size_t alen,
+	const unsigned char *b, size_t blen, unsigned char *out)
+{
+  struct sha256_ctx ctx;
+
+  sha256_init_ctx (&ctx);
+  sha256_process_bytes (t->secret, sizeof (t->secret), &ctx);
+  sha256_process_bytes (label, strlen (label), &ctx);
+  sha256_process_bytes (a, alen, &ctx);
+  sha256_process_bytes (b, blen, &ctx);
+  sha256_finish_ctx (&ctx, out);
+}
+
+/* Write a DER encoded ECDSA-Sig-Value over @msg to @out. */
+static size_t
+sign (const struct softtoken *t, const unsigned char *kh,
+      const unsigned char *msg, size_t msglen, unsigned char *out)
+{
+  unsigned char r[32], s[32];
+
+  derive (t, "r", kh, KH_SIZE, msg, msglen, r);
+  derive (t, "s", kh, KH_SIZE, msg, msglen, s);
+  /* keep both INTEGERs positive and exactly 32 bytes long */
+  r[0] = (r[0] & 0x7f) | 0x40;
+  s[0] = (s[0] & 0x7f) | 0x40;
+
+  out[0] = 0x30;
+  out[1] = EC_SIG_SIZE - 2;
+  out[2] = 0x02;
+  out[3] = sizeof (r);
+  memcpy (out + 4, r, sizeof (r));
+  out[4 + sizeof (r)] = 0x02;
+  out[5 + sizeof (r)] = sizeof (s);
+  memcpy (out + 6 + sizeof (r), s, sizeof (s));
+
+  return EC_SIG_SIZE;
+}
+
+static void
+public_key (const struct softtoken *t, const unsigned char *kh,
+	    unsigned char *out)
+{
+  out[0] = U2F_POINT_UNCOMPRESSED;
+  derive (t, "x", kh, KH_SIZE, NULL, 0, out + 1);
+  derive (t, "y", kh, KH_SIZE, NULL, 0, out + 1 + U2F_EC_KEY_SIZE);
+}
+
+static size_t
+attestation_cert (const struct softtoken *t, unsigned char *out)
+{
+  size_t i;
+
+  out[0] = 0x30;
+  out[1] = 0x82;
+  put_be16 (out + 2, ATT_CERT_SIZE - 4);
+  for (i = 4; i < ATT_CERT_SIZE; i += 32)
+    {
+      unsigned char blk[32];
+      unsigned char ctr[4];
+      size_t n = ATT_CERT_SIZE - i < 32 ? ATT_CERT_SIZE - i : 32;
+
+      put_be32 (ctr, i);
+      derive (t, "cert", ctr, sizeof (ctr), NULL, 0, blk);
+      memcpy (out + i, blk, n);
+    }
+
+  return ATT_CERT_SIZE;
+}
+
+static int
+check_key_handle (const struct softtoken *t, const unsigned char *appid,
+		  const unsigned char *kh, size_t khlen)
+{
+  unsigned char mac[32];
+
+  if (khlen != KH_SIZE)
+    return 0;
+
+  derive (t, "kh", appid, U2F_APPID_SIZE, kh, KH_NONCE_SIZE, mac);
+  return memcmp (mac, kh + KH_NONCE_SIZE, sizeof (mac)) == 0;
+}
+
+/* Returns 1 when the simulated user has touched the token. */
+static int
+user_present (struct softtoken *t)
+{
+  uint64_t now = monotonic_ms ();
+
+  if (!t->presence_pending)
+    {
+      t->presence_pending = 1;
+      t->presence_start = now;
+    }
+  if (now - t->presence_start < t->presence_delay)
+    return 0;
+
+  t->presence_pending = 0;
+  return 1;
+}
+
+static unsigned
+do_register (struct softtoken *t, const unsigned char *data, size_t len,
+	     unsigned char *out, size_t * outlen)
+{
+  const unsigned char *chal = data;
+  const unsigned char *appid = data + U2F_CHAL_SIZE;
+  unsigned char kh[KH_SIZE];
+  unsigned char pub[U2F_EC_POINT_SIZE];
+  unsigned char tbs[1 + U2F_APPID_SIZE + U2F_CHAL_SIZE + KH_SIZE +
+		    U2F_EC_POINT_SIZE];
+  unsigned char ctr[4];
+  size_t n = 0;
+
+  if (len != U2F_CHAL_SIZE + U2F_APPID_SIZE)
+    return SW_WRONG_LENGTH;
+
+  if (!user_present (t))
+    return SW_CONDITIONS_NOT_SATISFIED;
+
+  put_be32 (ctr, ++t->counter);
+  derive (t, "nonce", ctr, sizeof (ctr), chal, U2F_CHAL_SIZE, kh);
+  derive (t, "kh", appid, U2F_APPID_SIZE, kh, KH_NONCE_SIZE,
+	  kh + KH_NONCE_SIZE);
+  public_key (t, kh, pub);
+
+  tbs[0] = 0;
+  memcpy (tbs + 1, appid, U2F_APPID_SIZE);
+  memcpy (tbs + 1 + U2F_APPID_SIZE, chal, U2F_CHAL_SIZE);
+  memcpy (tbs + 1 + U2F_APPID_SIZE + U2F_CHAL_SIZE, kh, KH_SIZE);
+  memcpy (tbs + 1 + U2F_APPID_SIZE + U2F_CHAL_SIZE + KH_SIZE, pub,
+	  sizeof (pub));
+
+  out[n++] = U2F_REGISTER_ID;
+  memcpy (out + n, pub, sizeof (pub));
+  n += sizeof (pub);
+  out[n++] = KH_SIZE;
+  memcpy (out + n, kh, KH_SIZE);
+  n += KH_SIZE;
+  n += attestation_cert (t, out + n);
+  n += sign (t, kh, tbs, sizeof (tbs), out + n);
+
+  *outlen = n;
+  return SW_NO_ERROR;
+}
+
+static unsigned
+do_authenticate (struct softtoken *t, int p1, const unsigned char *data,
+		 size_t len, unsigned char *out, size_t * outlen)
+{
+  const unsigned char *chal = data;
+  const unsigned char *appid = data + U2F_CHAL_SIZE;
+  const unsigned char *kh = data + U2F_CHAL_SIZE + U2F_APPID_SIZE + 1;
+  unsigned char tbs[U2F_APPID_SIZE + 1 + U2F_CTR_SIZE + U2F_CHAL_SIZE];
+  size_t khlen;
+  uint8_t flags = 0;
+
+  if (len < U2F_CHAL_SIZE + U2F_APPID_SIZE + 1)
+    return SW_WRONG_LENGTH;
+  khlen = data[U2F_CHAL_SIZE + U2F_APPID_SIZE];
+  if (len != U2F_CHAL_SIZE + U2F_APPID_SIZE + 1 + khlen)
+    return SW_WRONG_LENGTH;
+
+  if (!check_key_handle (t, appid, kh, khlen))
+    return SW_WRONG_DATA;
+
+  switch (p1)
+    {
+    case U2F_AUTH_CHECK_ONLY:
+      return SW_CONDITIONS_NOT_SATISFIED;
+    case U2F_AUTH_ENFORCE:
+      if (!user_present (t))
+	return SW_CONDITIONS_NOT_SATISFIED;
+      flags = U2F_AUTH_FLAG_TUP;
+      break;
+    case U2F_AUTH_DONT_ENFORCE:
+      break;
+    default:
+      return SW_WRONG_DATA;
+    }
+
+  t->counter++;
+  memcpy (tbs, appid, U2F_APPID_SIZE);
+  tbs[U2F_APPID_SIZE] = flags;
+  put_be32 (tbs + U2F_APPID_SIZE + 1, t->counter);
+  memcpy (tbs + U2F_APPID_SIZE + 1 + U2F_CTR_SIZE, chal, U2F_CHAL_SIZE);
+
+  out[0] = flags;
+  put_be32 (out + 1, t->counter);
+  *outlen = 1 + U2F_CTR_SIZE;
+  *outlen += sign (t, kh, tbs, sizeof (tbs), out + *outlen);
+
+  return SW_NO_ERROR;
+}
+
+/* Process an extended length APDU in t->req, leaving the response in
+   t->resp. */
+static void
+do_msg (struct softtoken *t)
+{
+  const unsigned char *apdu = t->req;
+  const unsigned char *data = NULL;
+  size_t len = t->req_len;
+  size_t dlen = 0;
+  size_t outlen = 0;
+  unsigned sw;
+
+  if (len < 4)
+    {
+      sw = SW_WRONG_LENGTH;
+      goto done;
+    }
+  if (len > 4)
+    {
+      if (len < 7 || apdu[4] != 0)
+	{
+	  sw = SW_WRONG_LENGTH;
+	  goto done;
+	}
+      dlen = apdu[5] << 8 | apdu[6];
+      if (7 + dlen > len)
+	{
+	  sw = SW_WRONG_LENGTH;
+	  goto done;
+	}
+      data = apdu + 7;
+    }
+
+  if (apdu[0] != 0)
+    {
+      sw = SW_CLA_NOT_SUPPORTED;
+      goto done;
+    }
+
+  switch (apdu[1])
+    {
+    case U2F_REGISTER:
+      sw = do_register (t, data, dlen, t->resp, &outlen);
+      break;
+    case U2F_AUTHENTICATE:
+      sw = do_authenticate (t, apdu[2], data, dlen, t->resp, &outlen);
+      break;
+    case U2F_VERSION:
+      outlen = strlen ("U2F_V2");
+      memcpy (t->resp, "U2F_V2", outlen);
+      sw = SW_NO_ERROR;
+      break;
+    default:
+      sw = SW_INS_NOT_SUPPORTED;
+      break;
+    }
+
+done:
+  put_be16 (t->resp + outlen, sw);
+  t->resp_len = outlen + 2;
+}
+
+static void
+respond_error (struct softtoken *t, uint32_t cid, uint8_t err)
+{
+  t->resp_cid = cid;
+  t->resp_cmd = U2FHID_ERROR;
+  t->resp[0] = err;
+  t->resp_len = 1;
+  t->resp_off = 0;
+  t->resp_seq = 0;
+  t->resp_pending = 1;
+}
+
+/* Turn away a request on channel @cid because another channel is
+   being served. */
+static void
+respond_busy (struct softtoken *t, uint32_t cid)
+{
+  if (t->nbusy < MAX_BUSY_REPLIES)
+    t->busy_cid[t->nbusy++] = cid;
+}
+
+static void
+dispatch (struct softtoken *t)
+{
+  t->resp_cid = t->req_cid;
+  t->resp_cmd = t->req_cmd;
+  t->resp_len = 0;
+
+  switch (t->req_cmd)
+    {
+    case U2FHID_INIT:
+      if (t->req_len != INIT_NONCE_SIZE)
+	{
+	  respond_error (t, t->req_cid, ERR_INVALID_LEN);
+	  return;
+	}
+      memcpy (t->resp, t->req, INIT_NONCE_SIZE);
+      t->next_cid++;
+      if (t->next_cid == 0 || t->next_cid == CID_BROADCAST)
+	t->next_cid = 1;
+      memcpy (t->resp + INIT_NONCE_SIZE, &t->next_cid, sizeof (uint32_t));
+      t->resp[INIT_NONCE_SIZE + 4] = U2FHID_IF_VERSION;
+      t->resp[INIT_NONCE_SIZE + 5] = 1;
+      t->resp[INIT_NONCE_SIZE + 6] = 0;
+      t->resp[INIT_NONCE_SIZE + 7] = 0;
+      t->resp[INIT_NONCE_SIZE + 8] = CAPFLAG_WINK;
+      t->resp_len = INIT_NONCE_SIZE + 9;
+      break;
+    case U2FHID_PING:
+      memcpy (t->resp, t->req, t->req_len);
+      t->resp_len = t->req_len;
+      break;
+    case U2FHID_WINK:
+      break;
+    case U2FHID_MSG:
+      do_msg (t);
+      break;
+    default:
+      respond_error (t, t->req_cid, ERR_INVALID_CMD);
+      return;
+    }
+
+  t->resp_off = 0;
+  t->resp_seq = 0;
+  t->resp_pending = 1;
+}
+
+static int
+softtoken_init (u2fh_devs * devs)
+{
+  (void) devs;
+
+  return U2FH_OK;
+}
+
+static void
+softtoken_exit (u2fh_devs * devs)
+{
+  struct softtoken *t = devs->softtokens;
+
+  while (t)
+    {
+      struct softtoken *next = t->next;
+      free (t);
+      t = next;
+    }
+  devs->softtokens = NULL;
+}
+
+static int
+softtoken_enumerate (u2fh_devs * devs, struct u2fh_devinfo **list)
+{
+  struct u2fh_devinfo **tail = list;
+  struct softtoken *t;
+
+  *list = NULL;
+  for (t = devs->softtokens; t != NULL; t = t->next)
+    {
+      char path[sizeof (SOFTTOKEN_PREFIX) + 10];
+      struct u2fh_devinfo *info;
+
+      sprintf (path, SOFTTOKEN_PREFIX "%u", t->num);
+      if (!filter_path (devs, path))
+	continue;
+
+      info = calloc (1, sizeof (*info));
+      if (info == NULL)
+	goto fail;
+      *tail = info;
+      tail = &info->next;
+
+      info->path = strdup (path);
+      info->product = strdup (SOFTTOKEN_PRODUCT);
+      if (info->path == NULL || info->product == NULL)
+	goto fail;
+    }
+
+  return U2FH_OK;
+
+fail:
+  free_devinfo (*list);
+  *list = NULL;
+  return U2FH_MEMORY_ERROR;
+}
+
+static int
+softtoken_open (u2fh_devs * devs, const char *path, void **handle)
+{
+  struct softtoken *t;
+  unsigned num;
+
+  if (strncmp (path, SOFTTOKEN_PREFIX, strlen (SOFTTOKEN_PREFIX)) != 0)
+    return U2FH_NO_U2F_DEVICE;
+  num = strtoul (path + strlen (SOFTTOKEN_PREFIX), NULL, 10);
+
+  /* devices are also opened outside discovery, when first used */
+  mutex_lock (&devs->lock);
+  for (t = devs->softtokens; t != NULL; t = t->next)
+    if (t->num == num)
+      break;
+  mutex_unlock (&devs->lock);
+  if (t == NULL)
+    return U2FH_NO_U2F_DEVICE;
+
+  t->resp_pending = 0;
+  t->req_len = t->req_got = 0;
+  t->nbusy = 0;
+  *handle = t;
+  return U2FH_OK;
+}
+
+static int
+softtoken_write (void *handle, const unsigned char *report, size_t len)
+{
+  struct softtoken *t = handle;
+  U2FHID_FRAME frame;
+  size_t n;
+
+  if (len != HID_RPT_SIZE)
+    return -1;
+  memcpy (&frame, report, sizeof (frame));
+
+  if (FRAME_TYPE (frame) == TYPE_INIT)
+    {
+      if (frame.cid != t->req_cid && t->req_got < t->req_len)
+	{
+	  respond_busy (t, frame.cid);
+	  return len;
+	}
+      t->req_cid = frame.cid;
+      t->req_cmd = frame.init.cmd;
+      t->req_len = MSG_LEN (frame);
+      t->req_seq = 0;
+      if (t->req_len > sizeof (t->req))
+	{
+	  respond_error (t, frame.cid, ERR_INVALID_LEN);
+	  t->req_len = t->req_got = 0;
+	  return len;
+	}
+      n = t->req_len < sizeof (frame.init.data) ?
+	t->req_len : sizeof (frame.init.data);
+      memcpy (t->req, frame.init.data, n);
+      t->req_got = n;
+    }
+  else
+    {
+      if (t->req_got >= t->req_len || frame.cid != t->req_cid)
+	return len;
+      if (FRAME_SEQ (frame) != t->req_seq++)
+	{
+	  respond_error (t, frame.cid, ERR_INVALID_SEQ);
+	  t->req_len = t->req_got = 0;
+	  return len;
+	}
+      n = t->req_len - t->req_got;
+      if (n > sizeof (frame.cont.data))
+	n = sizeof (frame.cont.data);
+      memcpy (t->req + t->req_got, frame.cont.data, n);
+      t->req_got += n;
+    }
+
+  if (t->req_got == t->req_len)
+    {
+      /* like a real token, serve one channel at a time */
+      if (t->resp_pending && t->resp_cid != t->req_cid)
+	respond_busy (t, t->req_cid);
+      else
+	dispatch (t);
+    }
+
+  return len;
+}
+
+/* Responses are produced synchronously by softtoken_write, so there
+   is never anything to wait for here. */
+static int
+softtoken_read (void *handle, unsigned char *report, size_t len,
+		int timeout)
+{
+  struct softtoken *t = handle;
+  U2FHID_FRAME frame;
+  size_t n;
+
+  (void) timeout;
+
+  if (len < HID_RPT_SIZE)
+    return -1;
+
+  memset (&frame, 0, sizeof (frame));
+  if (t->nbusy > 0 && (!t->resp_pending || t->resp_off == 0))
+    {
+      frame.cid = t->busy_cid[0];
+      frame.init.cmd = U2FHID_ERROR;
+      frame.init.bcntl = 1;
+      frame.init.data[0] = ERR_CHANNEL_BUSY;
+      memmove (t->busy_cid, t->busy_cid + 1,
+	       --t->nbusy * sizeof (t->busy_cid[0]));
+      memcpy (report, &frame, HID_RPT_SIZE);
+      return HID_RPT_SIZE;
+    }
+  if (!t->resp_pending)
+    return 0;
+
+  frame.cid = t->resp_cid;
+  if (t->resp_off == 0)
+    {
+      frame.init.cmd = t->resp_cmd;
+      frame.init.bcnth = (t->resp_len >> 8) & 0xff;
+      frame.init.bcntl = t->resp_len & 0xff;
+      n = t->resp_len < sizeof (frame.init.data) ?
+	t->resp_len : sizeof (frame.init.data);
+      memcpy (frame.init.data, t->resp, n);
+    }
+  else
+    {
+      frame.cont.seq = t->resp_seq++;
+      n = t->resp_len - t->resp_off;
+      if (n > sizeof (frame.cont.data))
+	n = sizeof (frame.cont.data);
+      memcpy (frame.cont.data, t->resp + t->resp_off, n);
+    }
+  t->resp_off += n;
+  if (t->resp_off >= t->resp_len)
+    t->resp_pending = 0;
+
+  memcpy (report, &frame, HID_RPT_SIZE);
+  return HID_RPT_SIZE;
+}
+
+static void
+softtoken_close (void *handle)
+{
+  (void) handle;
+}
+
+const struct u2fh_transport softtoken_transport = {
+  "softtoken",
+  softtoken_init,
+  softtoken_exit,
+  softtoken_enumerate,
+  NULL,
+  softtoken_open,
+  softtoken_write,
+  softtoken_read,
+  softtoken_close,
+  NULL
+};
+
+/**
+ * u2fh_devs_add_softtoken:
+ * @devs: device handle, from u2fh_devs_init().
+ * @presence_delay: simulated time in milliseconds between the first
+ *   request needing user presence and the user touching the token.
+ *
+ * Attach an in-process software U2F token to @devs.  The token is
+ * picked up by the next call to u2fh_devs_discover() and can then be
+ * used like a hardware device.  It is meant for tests and benchmarks:
+ * its keys and signatures are well formed but not cryptographically
+ * valid.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, on memory
+ * allocation errors %U2FH_MEMORY_ERROR is returned, or another
+ * #u2fh_rc error code is returned.
+ */
+u2fh_rc
+u2fh_devs_add_softtoken (u2fh_devs * devs, unsigned presence_delay)
+{
+  struct softtoken *t, **tail;
+  unsigned num = 0;
+  int rc;
+  int i;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    return U2FH_MEMORY_ERROR;
+
+  for (i = 0; i < (int) sizeof (t->secret); i += INIT_NONCE_SIZE)
+    {
+      if (obtain_nonce (t->secret + i) != 0)
+	{
+	  free (t);
+	  return U2FH_TRANSPORT_ERROR;
+	}
+    }
+  t->presence_delay = presence_delay;
+
+  mutex_lock (&devs->discover_lock);
+  rc = add_transport (devs, &softtoken_transport);
+  if (rc != U2FH_OK)
+    {
+      mutex_unlock (&devs->discover_lock);
+      free (t);
+      return rc;
+    }
+  for (tail = &devs->softtokens; *tail != NULL; tail = &(*tail)->next)
+    num = (*tail)->num + 1;
+  t->num = num;
+  mutex_lock (&devs->lock);
+  *tail = t;
+  mutex_unlock (&devs->lock);
+  mutex_unlock (&devs->discover_lock);
+
+  return U2FH_OK;
+}
@@ -28,6 +28,9 @@
  * @U2FH_NO_U2F_DEVICE: Missing U2F device.
  * @U2FH_AUTHENTICATOR_ERROR: Authenticator error.
  * @U2FH_TIMEOUT_ERROR: Timeout error.
+ * @U2FH_SIZE_ERROR: Output buffer too small.
+ * @U2FH_AGAIN: Operation in progress, call u2fh_step() again.
+ * @U2FH_CANCELLED: Operation cancelled with u2fh_cancel().
  *
  * Error codes.
  */
@@ -42,17 +45,25 @@ typedef enum
   U2FH_AUTHENTICATOR_ERROR = -6,
   U2FH_TIMEOUT_ERROR = -7,
   U2FH_SIZE_ERROR = -8,
+  U2FH_AGAIN = -9,
+  U2FH_CANCELLED = -10,
 } u2fh_rc;
 
 /**
  * u2fh_initflags:
  * @U2FH_DEBUG: Print debug messages.
+ * @U2FH_NO_HID: Do not look for HID devices, only for software tokens
+ *   added with u2fh_devs_add_softtoken().
+ * @U2FH_LAZY_OPEN: Let discovery only record the devices found; each
+ *   one is opened when it is first used.
  *
- * Flags passed to u2fh_global_init().
+ * Flags passed to u2fh_global_init() and u2fh_ctx_init().
  */
 typedef enum
 {
-  U2FH_DEBUG = 1
+  U2FH_DEBUG = 1,
+  U2FH_NO_HID = 2,
+  U2FH_LAZY_OPEN = 4
 } u2fh_initflags;
 
 /**
@@ -66,6 +77,92 @@ typedef enum
   U2FH_REQUEST_USER_PRESENCE = 1
 } u2fh_cmdflags;
 
+/**
+ * u2fh_status:
+ * @U2FH_STATUS_IDLE: The operation is not running.
+ * @U2FH_STATUS_PROCESSING: Devices are processing the request.
+ * @U2FH_STATUS_UPNEEDED: Waiting for the user to touch a device.
+ *
+ * Progress of a register or authenticate operation.
+ */
+typedef enum
+{
+  U2FH_STATUS_IDLE = 0,
+  U2FH_STATUS_PROCESSING = 1,
+  U2FH_STATUS_UPNEEDED = 2
+} u2fh_status;
+
+typedef void (*u2fh_status_cb) (u2fh_status status, void *arg);
+
+typedef void (*u2fh_log_cb) (const char *msg, void *arg);
+
+/**
+ * u2fh_cmdopts:
+ * @timeout: milliseconds to wait for the user to touch a device, or 0
+ *   for the default of the context, 16 seconds unless changed with
+ *   u2fh_ctx_set_timeout().  This also bounds every USB transfer made
+ *   on behalf of the operation.
+ * @elapsed: set to the milliseconds the operation took.
+ * @status_cb: if not %NULL, called with @status_arg whenever the
+ *   #u2fh_status of the operation changes.
+ * @status_arg: passed to @status_cb.
+ *
+ * Options passed to u2fh_register3() and u2fh_authenticate3().
+ */
+typedef struct u2fh_cmdopts
+{
+  unsigned timeout;
+  unsigned elapsed;
+  u2fh_status_cb status_cb;
+  void *status_arg;
+} u2fh_cmdopts;
+
+/**
+ * u2fh_usbid:
+ * @vendor_id: USB vendor id.
+ * @product_id: USB product id.
+ * @any_product: non-zero to match every product of @vendor_id, in
+ *   which case @product_id is ignored.
+ *
+ * A USB device model, see #u2fh_devfilter.
+ */
+typedef struct u2fh_usbid
+{
+  unsigned short vendor_id;
+  unsigned short product_id;
+  int any_product;
+} u2fh_usbid;
+
+/**
+ * u2fh_devfilter:
+ * @ids: USB device models to accept, or %NULL for all.
+ *   u2fh_known_devices() returns those of the udev rules shipped with
+ *   the library.
+ * @nids: number of entries in @ids.
+ * @serial: serial number a device must have, or %NULL for any.
+ * @path_glob: pattern the device path must match, where "*" matches
+ *   any string and "?" any character, or %NULL for any.
+ * @max_devices: most devices to keep open, or 0 for no limit.
+ *
+ * Devices that u2fh_devs_discover() and u2fh_devs_update() consider,
+ * see u2fh_devs_set_filter().  Software tokens have no USB ids or
+ * serial number and are only subject to @path_glob and @max_devices.
+ */
+typedef struct u2fh_devfilter
+{
+  const u2fh_usbid *ids;
+  size_t nids;
+  const char *serial;
+  const char *path_glob;
+  unsigned max_devices;
+} u2fh_devfilter;
+
+typedef struct u2fh_ctx u2fh_ctx;
+
 typedef struct u2fh_devs u2fh_devs;
 
+typedef struct u2fh_op u2fh_op;
+
+typedef struct u2fh_request u2fh_request;
+
 #endif
@@ -51,10 +51,28 @@ extern "C"
   U2FH_EXPORT const char *u2fh_strerror (int err);
   U2FH_EXPORT const char *u2fh_strerror_name (int err);
 
+  U2FH_EXPORT u2fh_rc u2fh_ctx_init (u2fh_ctx ** ctx, u2fh_initflags flags);
+  U2FH_EXPORT void u2fh_ctx_done (u2fh_ctx * ctx);
+  U2FH_EXPORT void u2fh_ctx_set_log (u2fh_ctx * ctx, u2fh_log_cb log_cb,
+				void *log_arg);
+  U2FH_EXPORT void u2fh_ctx_set_timeout (u2fh_ctx * ctx, unsigned timeout);
+  U2FH_EXPORT void u2fh_ctx_set_idle_timeout (u2fh_ctx * ctx,
+					 unsigned idle_timeout);
+
   U2FH_EXPORT u2fh_rc u2fh_devs_init (u2fh_devs ** devs);
+  U2FH_EXPORT u2fh_rc u2fh_devs_init2 (u2fh_devs ** devs, u2fh_ctx * ctx);
   U2FH_EXPORT u2fh_rc u2fh_devs_discover (u2fh_devs * devs, unsigned *max_index);
+  U2FH_EXPORT u2fh_rc u2fh_devs_set_filter (u2fh_devs * devs,
+				       const u2fh_devfilter * filter);
+  U2FH_EXPORT const u2fh_usbid *u2fh_known_devices (size_t * n);
+  U2FH_EXPORT u2fh_rc u2fh_devs_monitor (u2fh_devs * devs, int *fd);
+  U2FH_EXPORT u2fh_rc u2fh_devs_update (u2fh_devs * devs, unsigned *max_index);
+  U2FH_EXPORT u2fh_rc u2fh_devs_close_idle (u2fh_devs * devs, int *timeout);
   U2FH_EXPORT void u2fh_devs_done (u2fh_devs * devs);
 
+  U2FH_EXPORT u2fh_rc u2fh_devs_add_softtoken (u2fh_devs * devs,
+					  unsigned presence_delay);
+
   U2FH_EXPORT u2fh_rc u2fh_register (u2fh_devs * devs,
 				const char *challenge,
 				const char *origin,
@@ -77,6 +95,89 @@ extern "C"
 				     char *response, size_t * response_len,
 				     u2fh_cmdflags flags);
 
+  U2FH_EXPORT u2fh_rc u2fh_register3 (u2fh_devs * devs,
+				 const char *challenge,
+				 const char *origin,
+				 char *response, size_t * response_len,
+				 u2fh_cmdflags flags, u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_authenticate3 (u2fh_devs * devs,
+				     const char *challenge,
+				     const char *origin,
+				     char *response, size_t * response_len,
+				     u2fh_cmdflags flags,
+				     u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_register_size (const char *challenge,
+				     const char *origin, size_t * size);
+  U2FH_EXPORT u2fh_rc u2fh_authenticate_size (const char *challenge,
+					 const char *origin,
+					 size_t * size);
+
+  U2FH_EXPORT u2fh_rc u2fh_request_init (u2fh_request ** req,
+				    const char *challenge);
+  U2FH_EXPORT void u2fh_request_done (u2fh_request * req);
+
+  U2FH_EXPORT u2fh_rc u2fh_register_request (u2fh_devs * devs,
+					const u2fh_request * req,
+					const char *origin,
+					char *response,
+					size_t * response_len,
+					u2fh_cmdflags flags,
+					u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_authenticate_request (u2fh_devs * devs,
+					    const u2fh_request * req,
+					    const char *origin,
+					    char *response,
+					    size_t * response_len,
+					    u2fh_cmdflags flags,
+					    u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_register_raw (u2fh_devs * devs,
+				    const unsigned char *challenge,
+				    const unsigned char *appparam,
+				    unsigned char *response,
+				    size_t * response_len,
+				    u2fh_cmdflags flags,
+				    u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_authenticate_raw (u2fh_devs * devs,
+					const unsigned char *challenge,
+					const unsigned char *appparam,
+					const unsigned char *keyhandle,
+					size_t keyhandle_len,
+					unsigned char *response,
+					size_t * response_len,
+					u2fh_cmdflags flags,
+					u2fh_cmdopts * opts);
+
+  U2FH_EXPORT u2fh_rc u2fh_register_start (u2fh_devs * devs,
+				      const char *challenge,
+				      const char *origin,
+				      u2fh_cmdflags flags,
+				      const u2fh_cmdopts * opts,
+				      u2fh_op ** op);
+
+  U2FH_EXPORT u2fh_rc u2fh_authenticate_start (u2fh_devs * devs,
+					  const char *challenge,
+					  const char *origin,
+					  u2fh_cmdflags flags,
+					  const u2fh_cmdopts * opts,
+					  u2fh_op ** op);
+
+  U2FH_EXPORT u2fh_rc u2fh_op_fds (u2fh_op * op, int *fds, size_t * nfds,
+			      int *timeout);
+
+  U2FH_EXPORT u2fh_status u2fh_op_status (u2fh_op * op);
+
+  U2FH_EXPORT u2fh_rc u2fh_step (u2fh_op * op, char *response,
+			    size_t * response_len);
+
+  U2FH_EXPORT void u2fh_op_done (u2fh_op * op);
+
+  U2FH_EXPORT u2fh_rc u2fh_cancel (u2fh_devs * devs, u2fh_op * op);
+
   U2FH_EXPORT u2fh_rc u2fh_sendrecv (u2fh_devs * devs,
 				unsigned index,
 				uint8_t cmd,
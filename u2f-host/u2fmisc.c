@@ -19,12 +19,19 @@
 #include "internal.h"
 
 #include <json.h>
+#include <stdlib.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
 
+#include "b64/b64url.h"
 #include "sha256.h"
 
 #define RESPHEAD_SIZE 7
-#define HID_TIMEOUT 2
-#define HID_MAX_TIMEOUT 4096
+/* most descriptors xfer_wait() polls at once */
+#define MAX_WAIT_FDS 32
 
 #ifdef HAVE_JSON_OBJECT_OBJECT_GET_EX
 #define u2fh_json_object_object_get(obj, key, value) json_object_object_get_ex(obj, key, &value)
@@ -46,104 +53,538 @@ typedef int json_bool;
 #endif
 #endif
 
-static void
-dumpHex (unsigned char *data, int offs, int len)
+/* Create a pipe for waking up a poll(), with both ends non-blocking.
+   There are no pipes on Windows, where both descriptors are set to
+   -1. */
+int
+make_pipe (int *fds)
 {
-  int i;
-  for (i = offs; i < len; i++)
+  fds[0] = fds[1] = -1;
+#if defined HAVE_PIPE2
+  if (pipe2 (fds, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      fds[0] = fds[1] = -1;
+      return U2FH_MEMORY_ERROR;
+    }
+#elif !defined _WIN32
+  if (pipe (fds) != 0)
     {
-      fprintf (stderr, "%02x", data[i] & 0xFF);
+      fds[0] = fds[1] = -1;
+      return U2FH_MEMORY_ERROR;
     }
-  fprintf (stderr, "\n");
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+#endif
+  return U2FH_OK;
 }
 
-int
-prepare_browserdata (const char *challenge, const char *origin,
-		     const char *typstr, char *out, size_t * outlen)
+#ifndef _WIN32
+/* Wait on @c, with @m held, for at most @ms milliseconds. */
+void
+cond_timedwait (u2fh_cond * c, u2fh_mutex * m, int ms)
 {
-  int rc = U2FH_JSON_ERROR;
-  struct json_object *jo = NULL;
-  struct json_object *chal = NULL, *orig = NULL, *typ = NULL;
-  const char *buf;
-  size_t len;
+  struct timespec ts;
+
+  /* condition variables time out by the wall clock; callers check
+     their own deadline by monotonic_ms() on return */
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long) (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  pthread_cond_timedwait (c, m, &ts);
+}
+#endif
 
-  chal = json_object_new_string (challenge);
-  if (chal == NULL)
-    goto done;
+uint64_t
+monotonic_ms (void)
+{
+#ifdef _WIN32
+  return GetTickCount64 ();
+#else
+  struct timespec ts;
 
-  orig = json_object_new_string (origin);
-  if (orig == NULL)
-    goto done;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
 
-  typ = json_object_new_string (typstr);
-  if (typ == NULL)
-    goto done;
+/* Log @what followed by @len bytes of @data in hex. */
+static void
+log_hex (const u2fh_ctx * ctx, const char *what, const unsigned char *data,
+	 size_t len)
+{
+  char *hex = malloc (2 * len + 1);
+  size_t i;
+
+  if (hex == NULL)
+    return;
+  for (i = 0; i < len; i++)
+    sprintf (hex + 2 * i, "%02x", data[i] & 0xFF);
+  hex[2 * len] = '\0';
+  u2fh_log (ctx, "%s%s", what, hex);
+  free (hex);
+}
 
-  jo = json_object_new_object ();
-  if (jo == NULL)
-    goto done;
+int
+prepare_browserdata (const u2fh_ctx * ctx, const char *challenge,
+		     const char *origin, const char *typstr, char *out,
+		     size_t * outlen)
+{
+  static const char *const keys[] = { "challenge", "origin", "typ" };
+  const char *values[3];
+  int rc;
 
-  json_object_object_add (jo, "challenge", json_object_get (chal));
-  json_object_object_add (jo, "origin", json_object_get (orig));
-  json_object_object_add (jo, "typ", json_object_get (typ));
+  values[0] = challenge;
+  values[1] = origin;
+  values[2] = typstr;
+
+  rc = json_write_object (keys, values, 3, &out, outlen);
+  if (rc == U2FH_SIZE_ERROR)
+    return U2FH_MEMORY_ERROR;
+  if (rc != U2FH_OK)
+    return rc;
+
+  if (ctx->debug)
+    u2fh_log (ctx, "client data: %s", out);
+
+  return U2FH_OK;
+}
 
-  if (debug)
+static void
+xfer_finish (struct u2fh_xfer *x, int rc)
+{
+  if (x->dev->ctx->debug && rc != U2FH_OK)
+    u2fh_log (x->dev->ctx, "USB transaction failed rc %d", rc);
+  x->state = XFER_DONE;
+  x->rc = rc;
+  if (x->own_channel)
     {
-      fprintf (stderr, "client data: %s\n", json_object_to_json_string (jo));
+      channel_release (x->ch, rc != U2FH_OK);
+      x->own_channel = 0;
     }
+}
+
+/* Feed one report read from the device into the transaction. */
+static void
+xfer_input (struct u2fh_xfer *x, unsigned char *data, int len)
+{
+  U2FHID_FRAME frame;
+  size_t n;
+
+  if (x->dev->ctx->debug)
+    log_hex (x->dev->ctx, "USB recv: ", data, len);
+
+  memset (&frame, 0, sizeof (frame));
+  memcpy (&frame, data, len < HID_RPT_SIZE ? len : HID_RPT_SIZE);
 
-  buf = json_object_to_json_string (jo);
-  len = strlen (buf);
-  if (len >= *outlen)
+  if (!x->have_init)
     {
-      rc = U2FH_MEMORY_ERROR;
-      goto done;
+      if (FRAME_TYPE (frame) != TYPE_INIT)
+	return;
+      if (frame.init.cmd == CTAPHID_KEEPALIVE)
+	{
+	  /* the device is still at it, so give it more time */
+	  uint64_t deadline = monotonic_ms () + HID_TRANS_TIMEOUT;
+
+	  x->keepalive = frame.init.data[0];
+	  x->deadline = deadline < x->limit ? deadline : x->limit;
+	  return;
+	}
+      if (frame.init.cmd == U2FHID_ERROR
+	  && frame.init.data[0] == ERR_CHANNEL_BUSY)
+	{
+	  /* the device is serving another channel, so ask again */
+	  x->retry = monotonic_ms () + CHANNEL_BUSY_RETRY;
+	  return;
+	}
+      if (frame.init.cmd != x->cmd
+	  || (size_t) MSG_LEN (frame) > x->resp_max)
+	{
+	  xfer_finish (x, U2FH_TRANSPORT_ERROR);
+	  return;
+	}
+      x->have_init = 1;
+      x->resp_len = MSG_LEN (frame);
+      n = x->resp_len < sizeof (frame.init.data) ?
+	x->resp_len : sizeof (frame.init.data);
+      memcpy (x->resp, frame.init.data, n);
+      x->resp_got = n;
+      x->seq = 0;
+    }
+  else
+    {
+      if (FRAME_TYPE (frame) == TYPE_INIT || frame.cont.seq != x->seq++)
+	{
+	  xfer_finish (x, U2FH_TRANSPORT_ERROR);
+	  return;
+	}
+      n = x->resp_len - x->resp_got;
+      if (n > sizeof (frame.cont.data))
+	n = sizeof (frame.cont.data);
+      memcpy (x->resp + x->resp_got, frame.cont.data, n);
+      x->resp_got += n;
     }
 
-  strcpy (out, buf);
-  *outlen = len;
-  rc = U2FH_OK;
+  if (x->resp_got == x->resp_len)
+    xfer_finish (x, U2FH_OK);
+}
 
-done:
-  json_object_put (jo);
-  json_object_put (chal);
-  json_object_put (orig);
-  json_object_put (typ);
+/* Write the request frames of @cmd with @data to channel @ch.  The
+   device is locked throughout so that requests on other channels do
+   not interleave with this one. */
+static int
+write_frames (struct u2fh_channel *ch, uint8_t cmd,
+	      const unsigned char *data, uint16_t len)
+{
+  struct u2fdevice *dev = ch->dev;
+  size_t datasent = 0;
+  int sequence = 0;
+  int rc = U2FH_OK;
+
+  mutex_lock (&dev->io);
+  do
+    {
+      U2FHID_FRAME frame = { 0 };
+      unsigned char *p;
+      size_t n = len - datasent;
+      size_t maxlen;
+
+      frame.cid = ch->cid;
+      if (datasent == 0)
+	{
+	  frame.init.cmd = cmd;
+	  frame.init.bcnth = (len >> 8) & 0xff;
+	  frame.init.bcntl = len & 0xff;
+	  p = frame.init.data;
+	  maxlen = sizeof (frame.init.data);
+	}
+      else
+	{
+	  frame.cont.seq = sequence++;
+	  p = frame.cont.data;
+	  maxlen = sizeof (frame.cont.data);
+	}
+      if (n > maxlen)
+	n = maxlen;
+      memcpy (p, data + datasent, n);
+      datasent += n;
+
+      if (dev->ctx->debug)
+	log_hex (dev->ctx, "USB send: ", (unsigned char *) &frame,
+		 sizeof (U2FHID_FRAME));
+
+      rc = dev->transport->write (dev->handle, (unsigned char *) &frame,
+				  sizeof (U2FHID_FRAME));
+      if (dev->ctx->debug)
+	u2fh_log (dev->ctx, "USB write returned %d", rc);
+      rc = rc == (int) sizeof (U2FHID_FRAME) ? U2FH_OK : U2FH_TRANSPORT_ERROR;
+    }
+  while (rc == U2FH_OK && datasent < len);
+  mutex_unlock (&dev->io);
 
   return rc;
 }
 
+/* Start transaction @x on channel @ch: send @cmd with @data, which
+   must stay valid until @x completes, with the response going to
+   @resp.  Keepalive reports push @deadline forward, up to x->limit
+   which the caller may raise. */
 int
-prepare_origin (const char *jsonstr, unsigned char *p)
+xfer_start_on (struct u2fh_xfer *x, struct u2fh_channel *ch, uint8_t cmd,
+	       const unsigned char *data, uint16_t len,
+	       unsigned char *resp, size_t resp_max, uint64_t deadline)
 {
-  const char *app_id;
-  struct json_object *jo;
-  struct json_object *k;
+  int rc;
 
-  jo = json_tokener_parse (jsonstr);
-  if (jo == NULL)
-    return U2FH_MEMORY_ERROR;
+  memset (x, 0, sizeof (*x));
+  x->dev = ch->dev;
+  x->ch = ch;
+  x->cmd = cmd;
+  x->req = data;
+  x->reqlen = len;
+  x->resp = resp;
+  x->resp_max = resp_max;
+  x->deadline = deadline;
+  x->limit = deadline;
+
+  rc = write_frames (ch, cmd, data, len);
+  if (rc != U2FH_OK)
+    {
+      xfer_finish (x, rc);
+      return rc;
+    }
+  x->state = XFER_BUSY;
 
-  if (debug)
-    fprintf (stderr, "JSON: %s\n", json_object_to_json_string (jo));
+  return U2FH_OK;
+}
 
-  if (u2fh_json_object_object_get (jo, "appId", k) == FALSE)
-    return U2FH_JSON_ERROR;
+/* Start transaction @x like xfer_start_on(), on a free channel of
+   @dev that is handed back when @x completes.  Returns %U2FH_AGAIN
+   if all channels of @dev are in use; channel_open_start() asks the
+   device for another one. */
+int
+xfer_start (struct u2fh_xfer *x, struct u2fdevice *dev, uint8_t cmd,
+	    const unsigned char *data, uint16_t len,
+	    unsigned char *resp, size_t resp_max, uint64_t deadline)
+{
+  struct u2fh_channel *ch;
+  int rc;
 
-  app_id = json_object_get_string (k);
-  if (app_id == NULL)
-    return U2FH_JSON_ERROR;
+  x->state = XFER_IDLE;
+  rc = channel_take (dev, &ch);
+  if (rc != U2FH_OK)
+    return rc;
 
-  if (debug)
-    fprintf (stderr, "JSON app_id %s\n", app_id);
+  return xfer_start_own (x, ch, cmd, data, len, resp, resp_max, deadline);
+}
 
-  sha256_buffer (app_id ? app_id : "", app_id ? strlen (app_id) : 0, p);
+/* Start transaction @x like xfer_start_on(), on @ch which was taken
+   for it and is handed back when @x completes. */
+int
+xfer_start_own (struct u2fh_xfer *x, struct u2fh_channel *ch, uint8_t cmd,
+		const unsigned char *data, uint16_t len,
+		unsigned char *resp, size_t resp_max, uint64_t deadline)
+{
+  int rc;
 
-  json_object_put (jo);
+  rc = xfer_start_on (x, ch, cmd, data, len, resp, resp_max, deadline);
+  if (rc != U2FH_OK)
+    {
+      channel_release (ch, 1);
+      return rc;
+    }
+  x->own_channel = 1;
 
   return U2FH_OK;
 }
 
+/* Return non-zero if @fd, which may be -1, has input. */
+static int
+fd_ready (int fd)
+{
+#ifndef _WIN32
+  struct pollfd pfd;
+
+  if (fd < 0)
+    return 0;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll (&pfd, 1, 0) > 0;
+#else
+  (void) fd;
+  return 0;
+#endif
+}
+
+/* Store in @fds, which has room for two, the descriptors that turn
+   readable when @x may have input, and return how many there are.
+   Returns 0 if the transport of @x has no descriptor. */
+size_t
+xfer_fds (struct u2fh_xfer *x, int *fds)
+{
+  struct u2fdevice *dev = x->dev;
+  size_t n = 0;
+
+  if (dev->transport->fd == NULL
+      || (fds[n] = dev->transport->fd (dev->handle)) < 0)
+    return 0;
+  n++;
+  if ((fds[n] = channel_fd (x->ch)) >= 0)
+    n++;
+
+  return n;
+}
+
+/* Sleep until one of the busy transactions may have input, @wakefd
+   is readable, or @timeout milliseconds have passed. */
+static void
+wait_readable (struct u2fh_xfer **xs, size_t n, int timeout, int wakefd)
+{
+  size_t i, busy = 0;
+#ifndef _WIN32
+  struct pollfd pfd[MAX_WAIT_FDS + 1];
+  size_t nfds = 0;
+  int pollable = 1;
+
+  for (i = 0; i < n; i++)
+    {
+      int fds[2];
+      size_t j, k;
+
+      if (xs[i]->state != XFER_BUSY)
+	continue;
+      busy++;
+      if (nfds + 2 > MAX_WAIT_FDS || (k = xfer_fds (xs[i], fds)) == 0)
+	{
+	  pollable = 0;
+	  break;
+	}
+      for (j = 0; j < k; j++)
+	{
+	  pfd[nfds].fd = fds[j];
+	  pfd[nfds].events = POLLIN;
+	  pfd[nfds++].revents = 0;
+	}
+    }
+  if (pollable)
+    {
+      if (wakefd >= 0)
+	{
+	  pfd[nfds].fd = wakefd;
+	  pfd[nfds].events = POLLIN;
+	  pfd[nfds++].revents = 0;
+	}
+      poll (pfd, nfds, timeout);
+      return;
+    }
+#else
+  (void) wakefd;
+  for (i = 0; i < n; i++)
+    if (xs[i]->state == XFER_BUSY)
+      busy++;
+#endif
+
+  /* without descriptors to wait on, look again shortly */
+  Sleep (busy > 0 ? 1 : timeout);
+}
+
+/* Consume the reports that are waiting for @x without blocking, and
+   resend the request if the device asked for that.  Returns non-zero
+   if @x completed. */
+int
+xfer_poll (struct u2fh_xfer *x, uint64_t now)
+{
+  unsigned char data[HID_RPT_SIZE];
+  int rc;
+
+  if (x->state != XFER_BUSY)
+    return 0;
+
+  while (x->state == XFER_BUSY && !x->retry
+	 && (rc = channel_read (x->ch, data, 0)) != 0)
+    {
+      if (rc < 0)
+	xfer_finish (x, U2FH_TRANSPORT_ERROR);
+      else
+	xfer_input (x, data, rc);
+    }
+  if (x->state == XFER_BUSY && x->retry && now >= x->retry)
+    {
+      x->retry = 0;
+      rc = write_frames (x->ch, x->cmd, x->req, x->reqlen);
+      if (rc != U2FH_OK)
+	xfer_finish (x, rc);
+    }
+  if (x->state == XFER_BUSY && now >= x->deadline)
+    xfer_finish (x, U2FH_TIMEOUT_ERROR);
+
+  return x->state != XFER_BUSY;
+}
+
+/* Process input for the transactions in @xs until at least one of
+   them completes, @wakefd (unless -1) becomes readable, or until the
+   absolute time @until as given by monotonic_ms().  A transaction
+   that reaches its own deadline completes with %U2FH_TIMEOUT_ERROR. */
+void
+xfer_wait (struct u2fh_xfer **xs, size_t n, uint64_t until, int wakefd)
+{
+  unsigned char data[HID_RPT_SIZE];
+
+  for (;;)
+    {
+      uint64_t now = monotonic_ms ();
+      struct u2fh_xfer *last = NULL;
+      size_t i, busy = 0;
+      int done = 0;
+      int fds[2];
+      int rc;
+
+      for (i = 0; i < n; i++)
+	{
+	  struct u2fh_xfer *x = xs[i];
+
+	  if (x->state != XFER_BUSY)
+	    continue;
+	  if (xfer_poll (x, now))
+	    {
+	      done = 1;
+	      continue;
+	    }
+	  busy++;
+	  last = x;
+	  if (x->deadline < until)
+	    until = x->deadline;
+	  if (x->retry && x->retry < until)
+	    until = x->retry;
+	}
+
+      if (done || now >= until || fd_ready (wakefd))
+	return;
+
+      if (busy == 1 && !last->retry && xfer_fds (last, fds) == 0)
+	{
+	  /* a single device without a descriptor can simply block in
+	     the transport, in slices so that other threads get to use
+	     the device */
+	  int timeout = (int) (until - now);
+
+	  if (timeout > READ_SLICE)
+	    timeout = READ_SLICE;
+	  rc = channel_read (last->ch, data, timeout);
+	  if (rc < 0)
+	    xfer_finish (last, U2FH_TRANSPORT_ERROR);
+	  else if (rc > 0)
+	    xfer_input (last, data, rc);
+	}
+      else
+	wait_readable (xs, n, (int) (until - now), wakefd);
+    }
+}
+
+/* Abandon @x, asking the device to stop working on the request if
+   it understands CTAPHID_CANCEL. */
+void
+xfer_cancel (struct u2fh_xfer *x)
+{
+  int cbor;
+
+  if (x->state != XFER_BUSY)
+    return;
+
+  /* capFlags changes under dev->io when a channel is opened */
+  mutex_lock (&x->dev->io);
+  cbor = (x->dev->capFlags & CAPFLAG_CBOR) != 0;
+  if (cbor)
+    {
+      U2FHID_FRAME frame = { 0 };
+
+      frame.cid = x->ch->cid;
+      frame.init.cmd = CTAPHID_CANCEL;
+      x->dev->transport->write (x->dev->handle, (unsigned char *) &frame,
+				sizeof (frame));
+    }
+  mutex_unlock (&x->dev->io);
+  if (cbor && x->dev->ctx->debug)
+    u2fh_log (x->dev->ctx, "USB sent cancel");
+  xfer_finish (x, U2FH_CANCELLED);
+}
+
+/* Abandon @x without telling the device; its reply is dropped when it
+   arrives. */
+void
+xfer_abandon (struct u2fh_xfer *x)
+{
+  if (x->state == XFER_BUSY)
+    xfer_finish (x, U2FH_CANCELLED);
+}
+
 /**
  * u2fh_sendrecv:
  * @devs: device handle, from u2fh_devs_init().
@@ -164,264 +605,209 @@ u2fh_sendrecv (u2fh_devs * devs, unsigned index, uint8_t cmd,
 	       const unsigned char *send, uint16_t sendlen,
 	       unsigned char *recv, size_t * recvlen)
 {
-  int datasent = 0;
-  int sequence = 0;
   struct u2fdevice *dev = get_device (devs, index);
+  uint64_t deadline = monotonic_ms () + HID_TRANS_TIMEOUT;
+  struct u2fh_xfer x, *xp = &x;
+  struct u2fh_channel *ch;
+  int rc;
 
   if (!dev)
     {
       return U2FH_NO_U2F_DEVICE;
     }
 
-  while (sendlen > datasent)
+  rc = channel_acquire (dev, deadline, &ch);
+  if (rc == U2FH_OK)
+    rc = xfer_start_own (&x, ch, cmd, send, sendlen, recv, *recvlen,
+			 deadline);
+  if (rc == U2FH_OK)
     {
-      U2FHID_FRAME frame = { 0 };
-      {
-	int len = sendlen - datasent;
-	unsigned int maxlen;
-	unsigned char *data;
-	frame.cid = dev->cid;
-	if (datasent == 0)
-	  {
-	    frame.init.cmd = cmd;
-	    frame.init.bcnth = (sendlen >> 8) & 0xff;
-	    frame.init.bcntl = sendlen & 0xff;
-	    data = frame.init.data;
-	    maxlen = sizeof (frame.init.data);
-	  }
-	else
-	  {
-	    frame.cont.seq = sequence++;
-	    data = frame.cont.data;
-	    maxlen = sizeof (frame.cont.data);
-	  }
-	if (len > maxlen)
-	  {
-	    len = maxlen;
-	  }
-	memcpy (data, send + datasent, len);
-	datasent += len;
-      }
-
-      {
-	unsigned char data[sizeof (U2FHID_FRAME) + 1];
-	int len;
-	/* FIXME: add report as first byte, is report 0 correct? */
-	data[0] = 0;
-	memcpy (data + 1, &frame, sizeof (U2FHID_FRAME));
-	if (debug)
-	  {
-	    fprintf (stderr, "USB send: ");
-	    dumpHex (data, 0, sizeof (U2FHID_FRAME));
-	  }
-
-	len = hid_write (dev->devh, data, sizeof (U2FHID_FRAME) + 1);
-	if (debug)
-	  fprintf (stderr, "USB write returned %d\n", len);
-	if (len < 0)
-	  return U2FH_TRANSPORT_ERROR;
-	if (sizeof (U2FHID_FRAME) + 1 != len)
-	  return U2FH_TRANSPORT_ERROR;
-      }
+      while (x.state == XFER_BUSY)
+	xfer_wait (&xp, 1, x.deadline, -1);
+      rc = x.rc;
     }
+  put_device (dev);
+  if (rc != U2FH_OK)
+    return rc;
 
-  {
-    U2FHID_FRAME frame;
-    unsigned char data[HID_RPT_SIZE];
-    int len = HID_RPT_SIZE;
-    unsigned int maxlen = *recvlen;
-    int recvddata = 0;
-    unsigned short datalen;
-    int timeout = HID_TIMEOUT;
-    int rc = 0;
-
-    do
-      {
-	timeout = HID_TIMEOUT;
-	rc = 0;
-
-	while (rc == 0)
-	  {
-	    if (debug)
-	      {
-		fprintf (stderr, "now trying with timeout %d\n", timeout);
-	      }
-	    rc = hid_read_timeout (dev->devh, data, len, timeout);
-	    timeout *= 2;
-	    if (timeout > HID_MAX_TIMEOUT)
-	      {
-		rc = -2;
-		break;
-	      }
-	  }
-
-	if (debug)
-	  {
-	    fprintf (stderr, "USB read rc read %d\n", len);
-	    if (rc > 0)
-	      {
-		fprintf (stderr, "USB recv: ");
-		dumpHex (data, 0, rc);
-	      }
-	  }
-	if (rc < 0)
-	  {
-	    return U2FH_TRANSPORT_ERROR;
-	  }
-
-	memcpy (&frame, data, HID_RPT_SIZE);
-      }
-    while (frame.cid == dev->cid && frame.init.cmd == CTAPHID_KEEPALIVE);
-
-    if (frame.cid != dev->cid || frame.init.cmd != cmd)
-      {
-	return U2FH_TRANSPORT_ERROR;
-      }
-    datalen = frame.init.bcnth << 8 | frame.init.bcntl;
-    if (datalen + datalen % HID_RPT_SIZE > maxlen)
-      {
-	return U2FH_TRANSPORT_ERROR;
-      }
-    memcpy (recv, frame.init.data, sizeof (frame.init.data));
-    recvddata = sizeof (frame.init.data);
-
-    sequence = 0;
-    while (datalen > recvddata)
-      {
-	timeout = HID_TIMEOUT;
-	rc = 0;
-	while (rc == 0)
-	  {
-	    if (debug)
-	      {
-		fprintf (stderr, "now trying with timeout %d\n", timeout);
-	      }
-	    rc = hid_read_timeout (dev->devh, data, len, timeout);
-	    timeout *= 2;
-	    if (timeout > HID_MAX_TIMEOUT)
-	      {
-		rc = -2;
-		break;
-	      }
-	  }
-	if (debug)
-	  {
-	    fprintf (stderr, "USB read rc read %d\n", len);
-	    if (rc > 0)
-	      {
-		fprintf (stderr, "USB recv: ");
-		dumpHex (data, 0, rc);
-	      }
-	  }
-	if (rc < 0)
-	  {
-	    return U2FH_TRANSPORT_ERROR;
-	  }
-
-	memcpy (&frame, data, HID_RPT_SIZE);
-	if (frame.cid != dev->cid || frame.cont.seq != sequence++)
-	  {
-	    fprintf (stderr, "bar: %d %d %d %d\n", frame.cid, dev->cid,
-		     frame.cont.seq, sequence);
-	    return U2FH_TRANSPORT_ERROR;
-	  }
-	if (recvddata + sizeof (frame.cont.data) > maxlen)
-	  {
-	    return U2FH_TRANSPORT_ERROR;
-	  }
-	memcpy (recv + recvddata, frame.cont.data, sizeof (frame.cont.data));
-	recvddata += sizeof (frame.cont.data);
-      }
-    *recvlen = datalen;
-  }
+  *recvlen = x.resp_len;
   return U2FH_OK;
 }
 
+/* Write the U2F request APDU for @cmd to @out, which must have room
+   for dlen + 9 bytes, and return its length. */
+size_t
+build_apdu (int cmd, int p1, const unsigned char *d, size_t dlen,
+	    unsigned char *out)
+{
+  memset (out, 0, RESPHEAD_SIZE);
+  out[1] = cmd;
+  out[2] = p1;
+  out[5] = (dlen >> 8) & 0xff;
+  out[6] = dlen & 0xff;
+  memcpy (out + RESPHEAD_SIZE, d, dlen);
+  memset (out + RESPHEAD_SIZE + dlen, 0, 2);
+
+  return RESPHEAD_SIZE + dlen + 2;
+}
+
 u2fh_rc
 send_apdu (u2fh_devs * devs, int index, int cmd, const unsigned char *d,
 	   size_t dlen, int p1, unsigned char *out, size_t * outlen)
 {
-  unsigned char data[2048] = { 0 };
+  unsigned char data[2048];
+  size_t len;
   int rc;
 
-  if (dlen > MAXDATASIZE)
+  if (dlen > sizeof (data) - RESPHEAD_SIZE - 2)
     return U2FH_MEMORY_ERROR;
 
-  data[1] = cmd;
-  data[2] = p1;
-  data[5] = (dlen >> 8) & 0xff;
-  data[6] = dlen & 0xff;
-  memcpy (data + RESPHEAD_SIZE, d, dlen);
-  memset (data + RESPHEAD_SIZE + dlen, 0, 2);
-
-  rc =
-    u2fh_sendrecv (devs, index, U2FHID_MSG, data, RESPHEAD_SIZE + dlen + 2,
-		   out, outlen);
+  len = build_apdu (cmd, p1, d, dlen, data);
+  rc = u2fh_sendrecv (devs, index, U2FHID_MSG, data, len, out, outlen);
   if (rc != U2FH_OK)
     {
-      if (debug)
-	fprintf (stderr, "USB rc %d\n", rc);
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "USB rc %d", rc);
       return rc;
     }
   if (*outlen < 2)
     {
-      if (debug)
-	fprintf (stderr, "USB read too short\n");
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "USB read too short");
       return U2FH_TRANSPORT_ERROR;
     }
 
   if (*outlen > MAXDATASIZE)
     {
-      if (debug)
-	fprintf (stderr, "USB too large response?\n");
+      if (devs->ctx->debug)
+	u2fh_log (devs->ctx, "USB too large response?");
       return U2FH_MEMORY_ERROR;
     }
 
   /* FIXME: Improve APDU error handling? */
 
-  if (debug)
+  if (devs->ctx->debug)
     {
-      fprintf (stderr, "USB data (len %zu): ", *outlen);
-      dumpHex (out, 0, *outlen);
+      u2fh_log (devs->ctx, "USB data (len %zu):", *outlen);
+      log_hex (devs->ctx, "", out, *outlen);
     }
 
   return U2FH_OK;
 }
 
-int
-get_fixed_json_data (const char *jsonstr, const char *key, char *p,
-		     size_t * len)
+/* Copy the string member @key of @jo to @out of @size bytes. */
+static int
+get_json_string (struct json_object *jo, const char *key, char *out,
+		 size_t size)
 {
-  struct json_object *jo;
   struct json_object *k;
-  const char *urlb64;
+  const char *s;
 
-  jo = json_tokener_parse (jsonstr);
-  if (jo == NULL)
+  if (u2fh_json_object_object_get (jo, key, k) == FALSE)
+    return U2FH_JSON_ERROR;
+  s = json_object_get_string (k);
+  if (s == NULL || strlen (s) >= size)
     return U2FH_JSON_ERROR;
+  strcpy (out, s);
 
-  if (debug)
-    fprintf (stderr, "JSON: %s\n", json_object_to_json_string (jo));
+  return U2FH_OK;
+}
 
-  if (u2fh_json_object_object_get (jo, key, k) == FALSE)
-    return U2FH_JSON_ERROR;
+/* Parse the JSON @challenge of a register or authenticate request
+   into @req, all in one pass.  The key handle is optional. */
+int
+request_parse (struct u2fh_request *req, const char *challenge)
+{
+  struct json_object *jo;
+  struct json_object *k;
+  const char *app_id;
+  int rc;
 
-  urlb64 = json_object_get_string (k);
-  if (urlb64 == NULL)
+  memset (req, 0, sizeof (*req));
+  jo = json_tokener_parse (challenge);
+  if (jo == NULL)
     return U2FH_JSON_ERROR;
 
-  if (debug)
-    fprintf (stderr, "JSON %s URL-B64: %s\n", key, urlb64);
+  rc = get_json_string (jo, "challenge", req->challenge,
+			sizeof (req->challenge));
+  if (rc != U2FH_OK)
+    goto done;
+
+  rc = U2FH_JSON_ERROR;
+  if (u2fh_json_object_object_get (jo, "appId", k) == FALSE
+      || (app_id = json_object_get_string (k)) == NULL)
+    goto done;
+  sha256_buffer (app_id, strlen (app_id), req->appparam);
 
-  if (strlen (urlb64) >= *len)
+  /* confusion between key_handle and keyHandle */
+  if (u2fh_json_object_object_get (jo, "keyHandle", k) != FALSE)
     {
-      return U2FH_JSON_ERROR;
+      int khlen;
+
+      rc = get_json_string (jo, "keyHandle", req->keyhandle,
+			    sizeof (req->keyhandle));
+      if (rc != U2FH_OK)
+	goto done;
+      khlen = b64url_decode (req->keyhandle, strlen (req->keyhandle),
+			     req->kh, sizeof (req->kh));
+      if (khlen < 0)
+	{
+	  rc = U2FH_JSON_ERROR;
+	  goto done;
+	}
+      req->khlen = khlen;
+      req->have_keyhandle = 1;
     }
-  *len = strlen (urlb64);
-
-  strcpy (p, urlb64);
+  rc = U2FH_OK;
 
+done:
   json_object_put (jo);
 
+  return rc;
+}
+
+/**
+ * u2fh_request_init:
+ * @req: pointer to #u2fh_request type to initialize.
+ * @challenge: string with JSON data containing the challenge, as for
+ *   u2fh_register2() or u2fh_authenticate2().
+ *
+ * Parse @challenge once, for u2fh_register_request() and
+ * u2fh_authenticate_request().  The parsed request can be used for
+ * any number of calls, on any device set, for instance to try again
+ * after a timeout.
+ *
+ * Returns: On success %U2FH_OK (integer 0) is returned, if
+ * @challenge cannot be parsed %U2FH_JSON_ERROR, or
+ * %U2FH_MEMORY_ERROR.
+ */
+u2fh_rc
+u2fh_request_init (u2fh_request ** req, const char *challenge)
+{
+  u2fh_request *r = malloc (sizeof (*r));
+  int rc;
+
+  if (r == NULL)
+    return U2FH_MEMORY_ERROR;
+  rc = request_parse (r, challenge);
+  if (rc != U2FH_OK)
+    {
+      free (r);
+      return rc;
+    }
+
+  *req = r;
   return U2FH_OK;
 }
+
+/**
+ * u2fh_request_done:
+ * @req: a request, from u2fh_request_init().
+ *
+ * Release @req.  Operations started with it are not affected.
+ */
+void
+u2fh_request_done (u2fh_request * req)
+{
+  free (req);
+}